@@ -0,0 +1,500 @@
+#include "narwhal.h"
+#include "narwhal_sim.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Benchmark the locks under contention by multiple processes. Each worker process has its own identity (as if it was
+// running on a different host), and repeatedly obtains a read or write lock (at random), holds it for a while, and
+// releases it, until the duration of the run is over. We report the throughput and the percentiles of the latency of
+// obtaining the locks, in a machine readable format (JSON or CSV), so results can be collected and plotted.
+//
+// When running on a local file system, the NFS server can be simulated (see narwhal_sim.h) to estimate how the locks
+// would scale with a real cluster.
+
+// The parameters of a benchmark run.
+typedef struct {
+    const char* lockdir;
+    int n_clients;
+    double duration_sec;
+    double write_fraction;
+    long hold_usec;
+    const char* output_format;
+    Narwhal narwhal;
+    bool is_simulated;
+    NarwhalSimulation simulation;
+} Parameters;
+
+// The results of a single worker, sent to the parent process (followed by the latency of each operation).
+typedef struct {
+    long long n_reads;
+    long long n_writes;
+    long long n_errors;
+    NarwhalStats stats;
+} WorkerResults;
+
+// The current time in microseconds.
+static long long
+clock_usec() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+// Write a buffer to a file descriptor (a pipe), or die trying.
+static void
+write_all(int fd, const void* data, size_t size) {
+    for (size_t written = 0; written < size;) {
+        ssize_t result = write(fd, (const char*)data + written, size - written);
+        if (result < 0) {
+            perror("write");
+            exit(1);
+        }
+        written += result;
+    }
+}
+
+// Read a buffer from a file descriptor (a pipe). Returns false on EOF.
+static bool
+read_all(int fd, void* data, size_t size) {
+    for (size_t done = 0; done < size;) {
+        ssize_t result = read(fd, (char*)data + done, size - done);
+        if (result < 0) {
+            perror("read");
+            exit(1);
+        }
+        if (result == 0)
+            return false;
+        done += result;
+    }
+    return true;
+}
+
+// Run a worker process until the end time, and send the results to the parent.
+static void
+run_worker(const Parameters* parameters, int worker_index, long long end_usec, int result_fd) {
+    char worker_pid[32];
+    snprintf(worker_pid, sizeof(worker_pid), "%d", worker_index);
+    narwhal_hostname("bench");
+    narwhal_pid(worker_pid);
+    if (parameters->is_simulated) {
+        NarwhalSimulation simulation = parameters->simulation;
+        simulation.seed += worker_index;  // Each worker is a different NFS client.
+        narwhal_sim_start(&simulation);
+    }
+
+    WorkerResults results;
+    memset(&results, 0, sizeof(results));
+
+    size_t capacity = 1024;
+    size_t n_latencies = 0;
+    long long* latencies = malloc(capacity * sizeof(long long));
+
+    unsigned int seed = (unsigned int)(clock_usec() ^ getpid());
+    for (;;) {
+        long long start_usec = clock_usec();
+        if (start_usec >= end_usec)
+            break;
+
+        bool is_write = rand_r(&seed) < parameters->write_fraction * ((double)RAND_MAX + 1);
+        int result = is_write ? narwhal_write_lock(&parameters->narwhal) : narwhal_read_lock(&parameters->narwhal);
+        if (result < 0) {
+            results.n_errors++;
+            continue;
+        }
+
+        if (n_latencies == capacity) {
+            capacity *= 2;
+            latencies = realloc(latencies, capacity * sizeof(long long));
+        }
+        latencies[n_latencies++] = clock_usec() - start_usec;
+        if (is_write)
+            results.n_writes++;
+        else
+            results.n_reads++;
+
+        if (parameters->hold_usec > 0)
+            usleep(parameters->hold_usec);
+
+        if (narwhal_unlock(&parameters->narwhal) < 0)
+            results.n_errors++;
+    }
+
+    narwhal_close(&parameters->narwhal);
+    narwhal_stats(NULL, &results.stats);
+
+    write_all(result_fd, &results, sizeof(results));
+    write_all(result_fd, latencies, n_latencies * sizeof(long long));
+    close(result_fd);
+    free(latencies);
+}
+
+// Compare latencies for sorting them.
+static int
+compare_latencies(const void* left, const void* right) {
+    long long left_latency = *(const long long*)left;
+    long long right_latency = *(const long long*)right;
+    return left_latency < right_latency ? -1 : left_latency > right_latency ? 1 : 0;
+}
+
+// Return the latency at some quantile of the (sorted) latencies.
+static long long
+quantile(const long long* latencies, size_t n_latencies, double fraction) {
+    if (n_latencies == 0)
+        return 0;
+    size_t index = fraction * n_latencies;
+    return latencies[index < n_latencies ? index : n_latencies - 1];
+}
+
+// The names of the fields we report, in order.
+static const char* const field_names[] = { "clients",
+                                           "duration_sec",
+                                           "write_fraction",
+                                           "hold_usec",
+                                           "spin_usec",
+                                           "max_spin_usec",
+                                           "spin_growth",
+                                           "spin_jitter",
+                                           "timeout_sec",
+                                           "timeout_msec",
+                                           "state_format",
+                                           "protocol",
+                                           "wakeup",
+                                           "backend",
+                                           "policy",
+                                           "max_clients",
+                                           "sim_latency_usec",
+                                           "sim_jitter_usec",
+                                           "sim_retransmit_rate",
+                                           "sim_error_rate",
+                                           "reads",
+                                           "writes",
+                                           "errors",
+                                           "ops_per_sec",
+                                           "p50_usec",
+                                           "p99_usec",
+                                           "p999_usec",
+                                           "max_usec",
+                                           "link_attempts",
+                                           "link_failures",
+                                           "version_checks",
+                                           "state_bytes_read",
+                                           "state_bytes_written",
+                                           "wakeups_sent" };
+
+// The names of the backends and policies, for the -b and -P options and the report.
+static const char* backend_names[] = { "nfs", "fcntl", "shm" };
+static const char* policy_names[] = { "fifo", "reader", "writer" };
+
+#define N_FIELDS (sizeof(field_names) / sizeof(field_names[0]))
+
+// Print the results of the run in the requested format.
+static void
+report(const Parameters* parameters,
+       const WorkerResults* totals,
+       const long long* latencies,
+       size_t n_latencies) {
+    char values[N_FIELDS][64];
+    int field_index = 0;
+    const Narwhal* narwhal = &parameters->narwhal;
+
+#define FIELD(FORMAT, VALUE) snprintf(values[field_index++], sizeof(values[0]), FORMAT, VALUE)
+    FIELD("%d", parameters->n_clients);
+    FIELD("%g", parameters->duration_sec);
+    FIELD("%g", parameters->write_fraction);
+    FIELD("%ld", parameters->hold_usec);
+    FIELD("%ld", (long)narwhal->spin_usec);
+    FIELD("%ld", (long)narwhal->max_spin_usec);
+    FIELD("%g", narwhal->spin_growth);
+    FIELD("%g", narwhal->spin_jitter);
+    FIELD("%ld", (long)narwhal->timeout_sec);
+    FIELD("%ld", narwhal->timeout_msec);
+    FIELD("\"%s\"", narwhal->state_format == NARWHAL_FIXED_STATE ? "fixed" : "text");
+    FIELD("\"%s\"", narwhal->protocol == NARWHAL_SLOT_PROTOCOL ? "slot" : "state");
+    FIELD("%s", narwhal->wakeup ? "true" : "false");
+    FIELD("\"%s\"", backend_names[narwhal->backend]);
+    FIELD("\"%s\"", policy_names[narwhal->policy]);
+    FIELD("%d", narwhal->max_clients);
+    FIELD("%ld", parameters->simulation.latency_usec);
+    FIELD("%ld", parameters->simulation.jitter_usec);
+    FIELD("%g", parameters->simulation.link_retransmit_rate);
+    FIELD("%g", parameters->simulation.error_rate);
+    FIELD("%lld", totals->n_reads);
+    FIELD("%lld", totals->n_writes);
+    FIELD("%lld", totals->n_errors);
+    FIELD("%.1f", (totals->n_reads + totals->n_writes) / parameters->duration_sec);
+    FIELD("%lld", quantile(latencies, n_latencies, 0.5));
+    FIELD("%lld", quantile(latencies, n_latencies, 0.99));
+    FIELD("%lld", quantile(latencies, n_latencies, 0.999));
+    FIELD("%lld", n_latencies > 0 ? latencies[n_latencies - 1] : 0);
+    FIELD("%llu", totals->stats.link_attempts);
+    FIELD("%llu", totals->stats.link_failures);
+    FIELD("%llu", totals->stats.version_checks);
+    FIELD("%llu", totals->stats.state_bytes_read);
+    FIELD("%llu", totals->stats.state_bytes_written);
+    FIELD("%llu", totals->stats.wakeups_sent);
+#undef FIELD
+
+    if (!strcmp(parameters->output_format, "csv")) {
+        for (size_t index = 0; index < N_FIELDS; index++)
+            printf("%s%s", index ? "," : "", field_names[index]);
+        printf("\n");
+        for (size_t index = 0; index < N_FIELDS; index++)
+            printf("%s%s", index ? "," : "", values[index]);
+        printf("\n");
+    } else {
+        printf("{");
+        for (size_t index = 0; index < N_FIELDS; index++)
+            printf("%s\"%s\": %s", index ? ", " : "", field_names[index], values[index]);
+        printf("}\n");
+    }
+}
+
+// Remove the files we left behind in a lockdir we created, and the lockdir itself.
+static void
+remove_lockdir(const char* lockdir) {
+    const char* names[] = { "state", "lockfile", "fcntl_lock", "shm_lock" };
+    for (size_t index = 0; index < sizeof(names) / sizeof(names[0]); index++) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", lockdir, names[index]);
+        unlink(path);
+    }
+    if (rmdir(lockdir) < 0)
+        perror(lockdir);
+}
+
+static void
+usage(const char* program) {
+    fprintf(stderr, "usage: %s [options]\n", program);
+    fprintf(stderr, "  -d DIR   lockdir to use (default: a new temporary directory under the current one)\n");
+    fprintf(stderr, "  -c N     number of client processes (default: 4)\n");
+    fprintf(stderr, "  -s SEC   duration of the run (default: 5)\n");
+    fprintf(stderr, "  -w FRAC  fraction of write locks (default: 0.1)\n");
+    fprintf(stderr, "  -H USEC  time to hold each lock (default: 0)\n");
+    fprintf(stderr, "  -u USEC  spin_usec (default: 1000)\n");
+    fprintf(stderr, "  -m USEC  max_spin_usec (default: 0)\n");
+    fprintf(stderr, "  -g X     spin_growth (default: 0)\n");
+    fprintf(stderr, "  -j X     spin_jitter (default: 0)\n");
+    fprintf(stderr, "  -t SEC   timeout_sec (default: 10)\n");
+    fprintf(stderr, "  -T MSEC  timeout_msec (default: 0, overrides -t if set)\n");
+    fprintf(stderr, "  -f FMT   state format, text or fixed (default: text)\n");
+    fprintf(stderr, "  -p PROTO protocol, state or slot (default: state)\n");
+    fprintf(stderr, "  -W       send wakeup hints to waiters\n");
+    fprintf(stderr, "  -b NAME  backend, nfs, fcntl or shm (default: nfs)\n");
+    fprintf(stderr, "  -P NAME  policy, fifo, reader or writer (default: fifo)\n");
+    fprintf(stderr, "  -M N     max_clients, to preallocate buffers for (default: 0)\n");
+    fprintf(stderr, "  -o FMT   output format, json or csv (default: json)\n");
+    fprintf(stderr, "  -L USEC  simulated NFS latency (default: none)\n");
+    fprintf(stderr, "  -J USEC  simulated NFS jitter (default: none)\n");
+    fprintf(stderr, "  -R FRAC  simulated fraction of retransmitted links (default: 0)\n");
+    fprintf(stderr, "  -E FRAC  simulated fraction of failed NFS operations (default: 0)\n");
+    fprintf(stderr, "  -S SEED  seed of the simulation (default: 1)\n");
+    exit(2);
+}
+
+int
+main(int argc, char* argv[]) {
+    Parameters parameters = { .lockdir = NULL,
+                              .n_clients = 4,
+                              .duration_sec = 5,
+                              .write_fraction = 0.1,
+                              .hold_usec = 0,
+                              .output_format = "json",
+                              .narwhal = { .spin_usec = 1000, .timeout_sec = 10 },
+                              .is_simulated = false,
+                              .simulation = { .seed = 1 } };
+
+    int option;
+    while ((option = getopt(argc, argv, "d:c:s:w:H:u:m:g:j:t:T:f:p:Wb:P:M:o:L:J:R:E:S:")) != -1) {
+        switch (option) {
+        case 'd':
+            parameters.lockdir = optarg;
+            break;
+        case 'c':
+            parameters.n_clients = atoi(optarg);
+            break;
+        case 's':
+            parameters.duration_sec = atof(optarg);
+            break;
+        case 'w':
+            parameters.write_fraction = atof(optarg);
+            break;
+        case 'H':
+            parameters.hold_usec = atol(optarg);
+            break;
+        case 'u':
+            parameters.narwhal.spin_usec = atol(optarg);
+            break;
+        case 'm':
+            parameters.narwhal.max_spin_usec = atol(optarg);
+            break;
+        case 'g':
+            parameters.narwhal.spin_growth = atof(optarg);
+            break;
+        case 'j':
+            parameters.narwhal.spin_jitter = atof(optarg);
+            break;
+        case 't':
+            parameters.narwhal.timeout_sec = atol(optarg);
+            break;
+        case 'T':
+            parameters.narwhal.timeout_msec = atol(optarg);
+            break;
+        case 'f':
+            if (!strcmp(optarg, "fixed"))
+                parameters.narwhal.state_format = NARWHAL_FIXED_STATE;
+            else if (strcmp(optarg, "text"))
+                usage(argv[0]);
+            break;
+        case 'p':
+            if (!strcmp(optarg, "slot"))
+                parameters.narwhal.protocol = NARWHAL_SLOT_PROTOCOL;
+            else if (strcmp(optarg, "state"))
+                usage(argv[0]);
+            break;
+        case 'W':
+            parameters.narwhal.wakeup = true;
+            break;
+        case 'b': {
+            size_t backend = 0;
+            while (backend < sizeof(backend_names) / sizeof(backend_names[0]) && strcmp(optarg, backend_names[backend]))
+                backend++;
+            if (backend == sizeof(backend_names) / sizeof(backend_names[0]))
+                usage(argv[0]);
+            parameters.narwhal.backend = (NarwhalBackend)backend;
+            break;
+        }
+        case 'P': {
+            size_t policy = 0;
+            while (policy < sizeof(policy_names) / sizeof(policy_names[0]) && strcmp(optarg, policy_names[policy]))
+                policy++;
+            if (policy == sizeof(policy_names) / sizeof(policy_names[0]))
+                usage(argv[0]);
+            parameters.narwhal.policy = (NarwhalPolicy)policy;
+            break;
+        }
+        case 'M':
+            parameters.narwhal.max_clients = atoi(optarg);
+            break;
+        case 'o':
+            if (strcmp(optarg, "json") && strcmp(optarg, "csv"))
+                usage(argv[0]);
+            parameters.output_format = optarg;
+            break;
+        case 'L':
+            parameters.simulation.latency_usec = atol(optarg);
+            parameters.is_simulated = true;
+            break;
+        case 'J':
+            parameters.simulation.jitter_usec = atol(optarg);
+            parameters.is_simulated = true;
+            break;
+        case 'R':
+            parameters.simulation.link_retransmit_rate = atof(optarg);
+            parameters.is_simulated = true;
+            break;
+        case 'E':
+            parameters.simulation.error_rate = atof(optarg);
+            parameters.is_simulated = true;
+            break;
+        case 'S':
+            parameters.simulation.seed = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc || parameters.n_clients < 1 || parameters.duration_sec <= 0)
+        usage(argv[0]);
+
+    char template[] = "bench.XXXXXX";
+    bool is_temporary = !parameters.lockdir;
+    if (is_temporary && !(parameters.lockdir = mkdtemp(template))) {
+        perror("mkdtemp");
+        return 1;
+    }
+    parameters.narwhal.lockdir = parameters.lockdir;
+
+    int* result_fds = calloc(parameters.n_clients, sizeof(int));
+    pid_t* workers = calloc(parameters.n_clients, sizeof(pid_t));
+    long long end_usec = clock_usec() + (long long)(parameters.duration_sec * 1000000);
+
+    for (int worker_index = 0; worker_index < parameters.n_clients; worker_index++) {
+        int pipe_fds[2];
+        if (pipe(pipe_fds) < 0) {
+            perror("pipe");
+            return 1;
+        }
+        fflush(stdout);
+        workers[worker_index] = fork();
+        if (workers[worker_index] < 0) {
+            perror("fork");
+            return 1;
+        }
+        if (workers[worker_index] == 0) {
+            close(pipe_fds[0]);
+            run_worker(&parameters, worker_index + 1, end_usec, pipe_fds[1]);
+            _exit(0);
+        }
+        close(pipe_fds[1]);
+        result_fds[worker_index] = pipe_fds[0];
+    }
+
+    WorkerResults totals;
+    memset(&totals, 0, sizeof(totals));
+    size_t capacity = 1024;
+    size_t n_latencies = 0;
+    long long* latencies = malloc(capacity * sizeof(long long));
+
+    for (int worker_index = 0; worker_index < parameters.n_clients; worker_index++) {
+        WorkerResults results;
+        if (!read_all(result_fds[worker_index], &results, sizeof(results))) {
+            fprintf(stderr, "worker %d failed\n", worker_index + 1);
+            return 1;
+        }
+        totals.n_reads += results.n_reads;
+        totals.n_writes += results.n_writes;
+        totals.n_errors += results.n_errors;
+        totals.stats.link_attempts += results.stats.link_attempts;
+        totals.stats.link_failures += results.stats.link_failures;
+        totals.stats.version_checks += results.stats.version_checks;
+        totals.stats.state_bytes_read += results.stats.state_bytes_read;
+        totals.stats.state_bytes_written += results.stats.state_bytes_written;
+        totals.stats.wakeups_sent += results.stats.wakeups_sent;
+
+        for (long long index = 0; index < results.n_reads + results.n_writes; index++) {
+            if (n_latencies == capacity) {
+                capacity *= 2;
+                latencies = realloc(latencies, capacity * sizeof(long long));
+            }
+            if (!read_all(result_fds[worker_index], latencies + n_latencies++, sizeof(long long))) {
+                fprintf(stderr, "worker %d failed\n", worker_index + 1);
+                return 1;
+            }
+        }
+        close(result_fds[worker_index]);
+
+        int status;
+        waitpid(workers[worker_index], &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "worker %d failed\n", worker_index + 1);
+            return 1;
+        }
+    }
+    qsort(latencies, n_latencies, sizeof(long long), compare_latencies);
+    report(&parameters, &totals, latencies, n_latencies);
+
+    if (is_temporary)
+        remove_lockdir(parameters.lockdir);
+    free(latencies);
+    free(result_fds);
+    free(workers);
+    return 0;
+}
@@ -1,29 +1,51 @@
 #include "narwhal.h"
 
 #include <assert.h>
+#include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #ifdef LOG
 #    define DEBUG_AT(X) fprintf(stderr, "%s:%d: %s (errno: %d)\n", __FILE__, __LINE__, X, errno)
 #    define DEBUG_EXP(X, F)                                          \
-        {                                                            \
+        do {                                                         \
             fprintf(stderr, "%s:%d: %s = ", __FILE__, __LINE__, #X); \
             fprintf(stderr, F, X);                                   \
             fprintf(stderr, " (errno : %d)\n", errno);               \
-        }
+        } while (0)
 #else
-#    define DEBUG_AT(X)
-#    define DEBUG_EXP(X, F)
+#    define DEBUG_AT(X) \
+        do {            \
+        } while (0)
+#    define DEBUG_EXP(X, F) \
+        do {                \
+        } while (0)
 #endif
 
+static void
+close_handles();
+
+struct Handle;
+
+static int
+release_lease(struct Handle* handle);
+
 // The host name running this process, with spaces replaced by _ characters.
 static char* host_name;
 
@@ -41,6 +63,7 @@ patch_host_name() {
 void
 narwhal_hostname(const char* hostname) {
     assert(hostname[0]);
+    close_handles();
     if (host_name) {
         free(host_name);
     }
@@ -67,6 +90,7 @@ static char* pid;
 // Implement narwhal_pid. See the header file.
 void
 narwhal_pid(const char* new_pid) {
+    close_handles();
     if (pid) {
         free(pid);
     }
@@ -86,54 +110,481 @@ init_pid() {
     DEBUG_EXP(pid, "%s");
 }
 
-// Reusable path buffers.
-static char* state_path;
-static char* lockfile_path;
-static char* private_path;
+// Ensure a reusable buffer has room for some number of elements. The buffer grows geometrically, so a growing lockdir
+// only causes a logarithmic number of reallocations, and once it is large enough, it is never reallocated again.
+static void*
+reserve(void* buffer, size_t* capacityp, size_t count, size_t element_size) {
+    if (buffer && count <= *capacityp)
+        return buffer;
+    *capacityp = *capacityp * 2 > count ? *capacityp * 2 : count;
+    return realloc(buffer, *capacityp * element_size);
+}
 
-// Concatenate path name parts into one of the reused path names.
+// Concatenate path name parts into a (reallocated) path name. If capacityp is not NULL, the path is a reusable buffer
+// with this capacity, which is only reallocated if the new path does not fit in it.
 const char*
-format_path(char** pathp, ...) {
+format_path(char** pathp, size_t* capacityp, ...) {
     va_list(argp);
-    va_start(argp, pathp);
+    va_start(argp, capacityp);
+    va_list(sizes_argp);
+    va_copy(sizes_argp, argp);
+    size_t size = 0;
+    for (const char* part = va_arg(sizes_argp, const char*); part; part = va_arg(sizes_argp, const char*))
+        size += strlen(part);
+    va_end(sizes_argp);
 
-    int size = 0;
-    for (;;) {
-        const char* suffix = va_arg(argp, const char*);
-        if (!suffix) {
-            DEBUG_EXP(*pathp, "%s");
-            return *pathp;
-        }
-        int size_before = size;
-        size += strlen(suffix);
-        *pathp = realloc(*pathp, size + 1);
-        strcpy(*pathp + size_before, suffix);
+    size_t capacity = 0;
+    *pathp = reserve(*pathp, capacityp ? capacityp : &capacity, size + 1, 1);
+    char* end = *pathp;
+    for (const char* part = va_arg(argp, const char*); part; part = va_arg(argp, const char*)) {
+        size_t part_size = strlen(part);
+        memcpy(end, part, part_size);
+        end += part_size;
     }
+    *end = '\0';
+    va_end(argp);
+    DEBUG_EXP(*pathp, "%s");
+    return *pathp;
+}
+
+// Open a file (with an explicit mode, so it can be used as a hook).
+static int
+default_open(const char* path, int flags, mode_t mode) {
+    return open(path, flags, mode);
+}
+
+// Get the status of a file (stat may be a macro or an inline function in some C libraries).
+static int
+default_stat(const char* path, struct stat* stbuf) {
+    return stat(path, stbuf);
+}
+
+// Get the status of an open file (fstat may be a macro or an inline function in some C libraries).
+static int
+default_fstat(int fd, struct stat* stbuf) {
+    return fstat(fd, stbuf);
+}
+
+// The default system calls used to access the lockdir.
+static const NarwhalSyscalls default_syscalls = { .link = link,
+                                                  .unlink = unlink,
+                                                  .rename = rename,
+                                                  .open = default_open,
+                                                  .close = close,
+                                                  .read = read,
+                                                  .write = write,
+                                                  .pread = pread,
+                                                  .pwrite = pwrite,
+                                                  .stat = default_stat,
+                                                  .fstat = default_fstat,
+                                                  .opendir = opendir,
+                                                  .readdir = readdir,
+                                                  .closedir = closedir };
+
+// The system calls used to access the lockdir (see narwhal_syscalls).
+static NarwhalSyscalls syscalls = default_syscalls;
+
+// Implement narwhal_syscalls. See the header file.
+void
+narwhal_syscalls(const NarwhalSyscalls* hooks) {
+    syscalls = hooks ? *hooks : default_syscalls;
 }
 
 // The state of a single client, parsed from the state file.
 typedef struct {
     bool is_write_lock;
+    bool is_intent;  // Whether this is an intention lock (see narwhal_lock_path).
+    bool is_own;     // Whether this is a request of the current process.
     bool is_granted;
-    long long time;
+    bool is_upgrading;  // Whether this is a pending write request upgraded from a granted read lock.
+    long long time;     // When the request was last renewed (see state_time_msec).
+    unsigned long long ticket;  // The position of the request in the queue (requests are granted in ticket order).
     const char* host_name;
     const char* pid;
+    const char* name;  // The name of the lock ("" for the unnamed lock).
+    int slot;          // Index of the record in a fixed format state file.
+    bool is_dirty;     // Whether the record needs to be written to a fixed format state file.
 } ClientState;
 
-// Reuse buffers for parsed client states.
-static ClientState* client_states;
-static int n_client_states = 0;
+// The widths of the fields of records in a fixed format state file. Each record is a line with the same fields as the
+// text format, padded with spaces.
+#define FIXED_HOST_WIDTH 64
+#define FIXED_PID_WIDTH 20
+#define FIXED_TIME_WIDTH 20
+#define FIXED_TICKET_WIDTH 20
+#define FIXED_NAME_WIDTH 64
+
+// The offsets of the fields in each record of a fixed format state file.
+#define FIXED_PID_OFFSET (FIXED_HOST_WIDTH + 1)
+#define FIXED_MODE_OFFSET (FIXED_PID_OFFSET + FIXED_PID_WIDTH + 1)
+#define FIXED_STATUS_OFFSET (FIXED_MODE_OFFSET + 2)
+#define FIXED_TIME_OFFSET (FIXED_STATUS_OFFSET + 2)
+#define FIXED_TICKET_OFFSET (FIXED_TIME_OFFSET + FIXED_TIME_WIDTH + 1)
+#define FIXED_NAME_OFFSET (FIXED_TICKET_OFFSET + FIXED_TICKET_WIDTH + 1)
+#define FIXED_RECORD_SIZE (FIXED_NAME_OFFSET + FIXED_NAME_WIDTH + 1)
+
+// The header line of a fixed format state file, containing the generation, the number of write requests, and the write
+// generation.
+#define FIXED_MAGIC "narwhal "
+#define FIXED_HEADER_FORMAT FIXED_MAGIC "%020llu %010d %020llu\n"
+#define FIXED_HEADER_SCAN_FORMAT FIXED_MAGIC "%llu %d %llu"
+#define FIXED_HEADER_SIZE (sizeof(FIXED_MAGIC) - 1 + 20 + 1 + 10 + 1 + 20 + 1)
+
+// The line following the header of a fixed format state file, containing the payload in hex, padded with spaces. The
+// records start after it.
+#define PAYLOAD_PREFIX "#payload "
+#define FIXED_PAYLOAD_SIZE (sizeof(PAYLOAD_PREFIX) - 1 + 2 * NARWHAL_MAX_PAYLOAD + 1)
+#define FIXED_RECORDS_OFFSET (FIXED_HEADER_SIZE + FIXED_PAYLOAD_SIZE)
+
+// The optional first lines of a text format state file, containing the write generation and the payload (each omitted
+// while it is zero or empty).
+#define TEXT_WRITES_FORMAT "#writes %llu\n"
+#define TEXT_WRITES_SCAN_FORMAT "#writes %llu"
+
+// A free record slot in a fixed format state file.
+typedef struct {
+    int slot;
+    bool is_dirty;  // Whether we need to clear the record in the file.
+} FreeSlot;
+
+// Identifies a version of the state file, to cheaply detect whether it was changed.
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+    bool is_fixed_format;
+    unsigned long long generation;
+} StateVersion;
+
+// The state of a read lease of the current process.
+typedef enum {
+    // We do not hold a read lease.
+    LEASE_NONE = 0,
+
+    // We hold a read lease and the read lock is in use.
+    LEASE_ACTIVE,
+
+    // We hold a read lease but the read lock was (locally) unlocked.
+    LEASE_IDLE
+} LeaseState;
+
+// The state of spinning while waiting for something, implementing an exponential backoff with jitter.
+typedef struct {
+    double sleep_usec;
+    double max_sleep_usec;
+    double growth;
+    double jitter;
+    unsigned long long random_state;
+} Backoff;
+
+// What we saw of the lockfile while failing to get it, for detecting whether it was abandoned. Since linking and
+// unlinking a file changes its ctime, as long as the inode and ctime stay the same, the same client is still holding
+// it. We measure how long this has been the case using our own (monotonic) clock, so this does not depend on the
+// clocks of the NFS server or the other clients.
+typedef struct {
+    ino_t ino;
+    struct timespec ctime;
+
+    // When we first saw this inode and ctime (see clock_msec), or zero if we are not watching the lockfile.
+    long long since;
+} LockfileWatch;
+
+// The state of a request for a set of (read or write) locks while it is pending.
+typedef struct {
+    const NarwhalNamedLock* locks;
+    int n_locks;
+
+    // Whether to start a read lease when the lock is granted.
+    bool is_lease;
+
+    // How long to sleep (or suggest to sleep) between rounds.
+    Backoff backoff;
+
+    // The version of the state file when we last looked at it.
+    StateVersion version;
+
+    // The time (see clock_msec) by which we must look at the state file even if its version did not change (zero for
+    // the first round).
+    long long next_round_time;
+
+    // What we saw of the lockfile while failing to get it.
+    LockfileWatch lockfile_watch;
+
+    // Whether the last round failed to get the lockfile (as opposed to finding that the request is still pending).
+    bool is_lockfile_busy;
+
+    // When we started obtaining the lock (in microseconds, see clock_usec), for the statistics.
+    long long start_usec;
+
+    // The number of conflicting requests ahead of ours in the queue, as of the last round.
+    int queue_position;
+
+    // Whether we made sure we are listening for wakeup hints (if the wakeup parameter is set).
+    bool did_listen;
+} LockRequest;
+
+// All the state for accessing a single lockdir. We keep one of these for each lockdir accessed by the process, with
+// precomputed paths and reusable buffers, until narwhal_close is called or the process exits.
+typedef struct Handle {
+    // The next handle in the list of open handles.
+    struct Handle* next;
+
+    // The parameters of the current operation, using our own copy of the lockdir.
+    Narwhal narwhal;
+    char* lockdir;
+
+    // The device and inode of the lockdir, to detect accessing it using other paths (see open_handle).
+    dev_t lockdir_dev;
+    ino_t lockdir_ino;
+
+    // Precomputed paths.
+    char* state_path;
+    char* lockfile_path;
+    char* private_path;
+    char* alternate_path;
+    char* temp_path;
+    char* broken_path;
+
+    // Reuse buffer for the path of some file of some other client (its request file in the slot protocol, or its wake
+    // file).
+    char* slot_path;
+    size_t slot_path_capacity;
+
+    // The socket on which we receive wakeup hints while waiting (see the wakeup parameter), the process that opened it
+    // (as opposed to some parent process we were forked from), and the path of the wake file advertising its address.
+    int wake_fd;
+    pid_t wake_pid;
+    char* wake_path;
+
+    // Whether we removed (or downgraded) requests of the current process, so when the exclusive section ends we should
+    // wake the waiters which may now be granted.
+    bool should_wake;
+
+    // The backend implementing the locks (see narwhal.h). For the local backends, the path of the lock file, the
+    // open lock file (for the fcntl backend) or its mapping (for the shm backend), and whether we hold the lock.
+    NarwhalBackend backend;
+    char* local_path;
+    int local_fd;
+    pthread_rwlock_t* shm_lock;
+    bool is_local_locked;
+
+    // The connection to the local coordinator daemon (if any, see narwhal_coordinator.h), the process that opened it
+    // (as opposed to some parent process we were forked from), and the absolute path of the lockdir to send to it.
+    int coordinator_fd;
+    pid_t coordinator_pid;
+    char* coordinator_lockdir;
+
+    // The process that created the private file (as opposed to some parent process we were forked from).
+    pid_t creator;
+
+    // Reuse buffers for parsed client states.
+    ClientState* client_states;
+    int n_client_states;
+    size_t client_states_capacity;
+
+    // The number of our own client states, and the index of the first one as of the last time we looked for it. The
+    // index is recorded when parsing, and is only a hint, which is verified before use (see find_own_state).
+    int n_own_states;
+    int own_index;
+
+    // Whether the loaded state file uses the fixed format.
+    bool is_fixed_format;
+
+    // The generation of a fixed format state file. This is incremented whenever requests are added or removed.
+    unsigned long long generation;
 
-// A state of (some) client that has a granted lock.
-static ClientState* granted_state = NULL;
+    // The write generation of the state file (see narwhal_read_lock_gen).
+    unsigned long long write_generation;
 
-// Whether we changed the client states since parsing them from the state file.
-static bool client_states_changed = false;
+    // The payload of the state file (see narwhal_unlock_payload), and whether we changed it since parsing it.
+    unsigned char payload[NARWHAL_MAX_PAYLOAD];
+    size_t payload_size;
+    bool is_payload_changed;
 
-// Reuse buffer for the text of the state file.
-static char* state_text;
+    // The number of record slots in a fixed format state file.
+    int n_slots;
 
-// Did we initialize the reusable buffers?
+    // Reuse buffer for the free slots of a fixed format state file.
+    FreeSlot* free_slots;
+    int n_free_slots;
+    size_t free_slots_capacity;
+
+    // Whether we added or removed client states since parsing them from the state file (requiring a new generation).
+    bool is_generation_changed;
+
+    // The oldest time of the (fresh) client states. Unless the state file changes, nothing will happen until this
+    // expires.
+    long long oldest_time;
+
+    // Whether we changed the client states since parsing them from the state file.
+    bool client_states_changed;
+
+    // When we last got the lockfile (see clock_msec).
+    long long lockfile_time;
+
+    // Whether we link the alternate private file (rather than the private file) as the lockfile (see link_path).
+    bool is_alternate;
+
+    // Reuse buffer for the text of the state file.
+    char* state_text;
+    size_t state_size;
+    size_t state_capacity;
+
+    // Reuse buffer for the serialized text of the updated state file.
+    char* dump_text;
+    size_t dump_capacity;
+
+    // Serializes all operations using this handle (by the threads of the process using the narwhal_shared_* functions,
+    // and by the heartbeat thread), and protects the following fields.
+    pthread_mutex_t mutex;
+
+    // Local readers share the lock, local writers get exclusive access, before we get the actual (NFS) lock.
+    pthread_rwlock_t local_lock;
+
+    // The number of local threads sharing the (NFS) read lock.
+    int n_local_readers;
+
+    // Whether new local readers wait for the current ones to release the shared read lock (instead of joining it),
+    // because some other client is waiting for a conflicting lock (see should_stop_sharing), the condition signaled
+    // when the last local reader releases it, and the version of the state file when we last checked it.
+    bool is_sharing_stopped;
+    pthread_cond_t shared_cond;
+    StateVersion shared_version;
+
+    // When (see clock_msec) we last renewed our own requests.
+    long long own_time;
+
+    // The number of conflicting requests ahead of our pending request in the queue, as of the last time we requested
+    // it.
+    int queue_position;
+
+    // The state of our read lease (if read_lease_sec is set).
+    LeaseState lease_state;
+
+    // The time (see clock_msec) until which we may resume an idle read lease without looking at the state file (beyond
+    // checking its version did not change).
+    long long lease_until;
+
+    // The version of the state file when we last obtained or renewed our read lease.
+    StateVersion lease_version;
+
+    // Whether we hold a granted request in the state file (including an idle read lease).
+    bool is_holding;
+
+    // An outstanding asynchronous lock request (see narwhal_lock_begin), if any.
+    bool has_async_request;
+    LockRequest async_request;
+
+    // Whether narwhal_unlock_async deferred releasing our lock to the heartbeat thread, and the errno of the first
+    // deferred unlock which failed since the last narwhal_flush (zero if none).
+    bool is_unlock_pending;
+    int unlock_errno;
+
+    // The statistics of the current operation, which are published when it is done.
+    NarwhalStats stats;
+
+    // When (see clock_msec) the heartbeat thread should next look at this handle (zero if never). Unlike the above,
+    // this is protected by the handles_mutex.
+    long long heartbeat_time;
+
+    // The published statistics of all the operations using this handle. This is protected by the stats_mutex.
+    NarwhalStats published_stats;
+} Handle;
+
+// All the open handles, most recently used first.
+static Handle* handles;
+
+// Protects the list of open handles (and the process identity) from concurrent access by multiple threads.
+static pthread_mutex_t handles_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Protects the published statistics of all the handles. This is never held while locking anything else.
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// The published statistics of the handles which were closed. This is protected by the stats_mutex.
+static NarwhalStats closed_stats;
+
+// The registered tracing callback (if any) and its context (see narwhal_trace).
+static NarwhalTraceCallback trace_callback;
+static void* trace_context;
+
+// Implement narwhal_trace. See the header file.
+void
+narwhal_trace(NarwhalTraceCallback callback, void* context) {
+    trace_context = context;
+    trace_callback = callback;
+}
+
+// Report a tracing event to the registered callback. The client_state (if any) is the request the event is about.
+static void
+trace_event(const Handle* handle, NarwhalTraceEventType type, const ClientState* client_state) {
+    NarwhalTraceEvent event = { .type = type, .lockdir = handle->lockdir };
+    if (client_state) {
+        event.host_name = client_state->host_name;
+        event.pid = client_state->pid;
+        event.name = *client_state->name ? client_state->name : NULL;
+        event.is_write_lock = client_state->is_write_lock;
+    }
+    trace_callback(&event, trace_context);
+}
+
+// Report a tracing event, if tracing is enabled. This costs a single branch when it is not.
+#define TRACE(HANDLE, TYPE, CLIENT_STATE)            \
+    do {                                             \
+        if (trace_callback)                          \
+            trace_event(HANDLE, TYPE, CLIENT_STATE); \
+    } while (0)
+
+// The current time in microseconds, for measuring durations for the statistics.
+static long long
+clock_usec() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+// The current (CLOCK_MONOTONIC) time in milliseconds, for local deadlines, which must not be affected by steps of the
+// wall clock.
+static long long
+clock_msec() {
+    return clock_usec() / 1000;
+}
+
+// The current (CLOCK_REALTIME) time in milliseconds, for the times of the requests in the state file. These are
+// compared between hosts, so this assumes all the clients have synchronized clocks.
+static long long
+state_time_msec() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+// The timeout after which requests become stale, in milliseconds (see timeout_msec).
+static long long
+timeout_msec_of(const Narwhal* narwhal) {
+    return narwhal->timeout_msec > 0 ? narwhal->timeout_msec : narwhal->timeout_sec * 1000LL;
+}
+
+// Add some statistics to some others. This relies on all the fields being unsigned long long counters.
+static void
+add_stats(NarwhalStats* into, const NarwhalStats* from) {
+    unsigned long long* into_counters = (unsigned long long*)into;
+    const unsigned long long* from_counters = (const unsigned long long*)from;
+    for (size_t index = 0; index < sizeof(NarwhalStats) / sizeof(unsigned long long); index++)
+        into_counters[index] += from_counters[index];
+}
+
+// Publish the statistics of the current operation using a handle (which must be locked).
+static void
+publish_stats(Handle* handle) {
+    pthread_mutex_lock(&stats_mutex);
+    add_stats(&handle->published_stats, &handle->stats);
+    pthread_mutex_unlock(&stats_mutex);
+    memset(&handle->stats, 0, sizeof(NarwhalStats));
+}
+
+// Did we initialize the process identity?
 static bool did_init = false;
 
 static void
@@ -146,337 +597,3268 @@ init() {
 
     init_host_name();
     init_pid();
-    state_path = malloc(1024);
-    lockfile_path = malloc(1024);
-    private_path = malloc(1024);
-    state_text = calloc(1024, 1);
-    client_states = malloc(1024);
+}
+
+// Create a private file in a lockdir (even if it already exists).
+static int
+create_private_file(const char* path) {
+    DEBUG_EXP(path, "%s (create private file)");
+    int private_fd = syscalls.open(path, O_CREAT | O_TRUNC | O_WRONLY, 0777);
+    if (private_fd < 0 || syscalls.close(private_fd) < 0)
+        return -1;
+    return 0;
+}
+
+// Release a read or write lock (see below).
+static int
+unlock(Handle* handle);
+
+// Complete a deferred narwhal_unlock_async, if any. This is done by the heartbeat thread, or by whichever operation
+// uses the handle first. The errno is kept for narwhal_flush, since the operation doing this is not the one to blame.
+static void
+finish_unlock(Handle* handle) {
+    if (!handle->is_unlock_pending)
+        return;
+    handle->is_unlock_pending = false;
+    int base_errno = errno;
+    if (unlock(handle) < 0 && !handle->unlock_errno)
+        handle->unlock_errno = errno;
+    errno = base_errno;
+}
+
+// Free a handle, removing its private file (if it was created by this process and not by some parent we were forked
+// from).
+static int
+free_handle(Handle* handle) {
+    pthread_mutex_lock(&handle->mutex);  // Wait until the heartbeat thread is done with the handle.
+    if (handle->creator == getpid())
+        finish_unlock(handle);
+    pthread_mutex_unlock(&handle->mutex);
+    if (handle->lease_state != LEASE_NONE && handle->creator == getpid())
+        release_lease(handle);
+    int base_errno = errno;
+    int result = 0;
+    if (handle->creator == getpid()) {
+        // Never created (when using a coordinator or a local backend), or someone cleaned up the lockdir.
+        if ((syscalls.unlink(handle->private_path) < 0 && errno != ENOENT)
+            || (syscalls.unlink(handle->alternate_path) < 0 && errno != ENOENT))
+            result = -1;
+        else
+            errno = base_errno;
+    }
+    if (handle->coordinator_fd >= 0)
+        close(handle->coordinator_fd);
+    if (handle->wake_fd >= 0)
+        close(handle->wake_fd);
+    if (handle->local_fd >= 0)
+        close(handle->local_fd);
+    if (handle->shm_lock)
+        munmap(handle->shm_lock, sizeof(pthread_rwlock_t));
+    if (handle->wake_fd >= 0 && handle->wake_pid == getpid()) {
+        int base_errno = errno;
+        syscalls.unlink(handle->wake_path);  // This is just a hint, so we don't care if it fails.
+        errno = base_errno;
+    }
+    publish_stats(handle);
+    pthread_mutex_lock(&stats_mutex);
+    add_stats(&closed_stats, &handle->published_stats);
+    pthread_mutex_unlock(&stats_mutex);
+    free(handle->lockdir);
+    free(handle->state_path);
+    free(handle->lockfile_path);
+    free(handle->private_path);
+    free(handle->alternate_path);
+    free(handle->temp_path);
+    free(handle->broken_path);
+    free(handle->slot_path);
+    free(handle->wake_path);
+    free(handle->local_path);
+    free(handle->coordinator_lockdir);
+    free(handle->client_states);
+    free(handle->free_slots);
+    free(handle->state_text);
+    free(handle->dump_text);
+    pthread_mutex_destroy(&handle->mutex);
+    pthread_cond_destroy(&handle->shared_cond);
+    pthread_rwlock_destroy(&handle->local_lock);
+    free(handle);
+    return result;
+}
+
+// Close all the handles, either when the process exits or when its identity changes.
+static void
+close_handles() {
+    int base_errno = errno;
+    pthread_mutex_lock(&handles_mutex);
+    Handle* closed_handles = handles;
+    handles = NULL;
+    pthread_mutex_unlock(&handles_mutex);
+
+    while (closed_handles) {
+        Handle* handle = closed_handles;
+        closed_handles = handle->next;
+        free_handle(handle);
+    }
+    errno = base_errno;
+}
+
+// Initialize the locks used by the narwhal_shared_* functions. We prefer local writers (if possible), for the same
+// reason that pending write requests stall new read requests.
+static void
+init_shared_locks(Handle* handle) {
+    pthread_mutex_init(&handle->mutex, NULL);
+    pthread_cond_init(&handle->shared_cond, NULL);
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+    pthread_rwlock_init(&handle->local_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+}
+
+// Allocate the reuse buffers of a new handle. If max_clients is set, they have room for this many client states (each
+// holding one lock), so they never grow while the lockdir stays within this size; otherwise they start small.
+static void
+preallocate_buffers(Handle* handle, int max_clients) {
+    size_t n_states = max_clients > 0 ? (size_t)max_clients + 1 : 1024 / sizeof(ClientState);
+    size_t text_size = max_clients > 0 ? FIXED_RECORDS_OFFSET + n_states * FIXED_RECORD_SIZE + 2 : 1024;
+    handle->state_text = reserve(NULL, &handle->state_capacity, text_size, 1);
+    memset(handle->state_text, 0, text_size);
+    handle->client_states = reserve(NULL, &handle->client_states_capacity, n_states, sizeof(ClientState));
+    if (max_clients > 0) {
+        handle->free_slots = reserve(NULL, &handle->free_slots_capacity, n_states, sizeof(FreeSlot));
+        handle->dump_text = reserve(NULL, &handle->dump_capacity, text_size, 1);
+    }
+}
+
+// Find the handle for accessing a lockdir, creating it if needed. This is safe to call from multiple threads.
+static Handle*
+open_handle(const Narwhal* narwhal) {
+    pthread_mutex_lock(&handles_mutex);
+    init();
+
+    Handle* handle = NULL;
+    for (Handle** handlep = &handles; *handlep; handlep = &(*handlep)->next) {
+        if (!strcmp((*handlep)->lockdir, narwhal->lockdir)) {
+            handle = *handlep;
+            *handlep = handle->next;
+            break;
+        }
+    }
+
+    // Handles are identified by the lockdir path, so refuse to access a lockdir we have a handle for using another path
+    // to it (which would make us two clients sharing the same private files and local locks). Coordinator clients
+    // don't access the lockdir at all.
+    struct stat stbuf = { .st_dev = 0, .st_ino = 0 };
+    if (!handle && !narwhal->coordinator) {
+        if (syscalls.stat(narwhal->lockdir, &stbuf) < 0) {
+            pthread_mutex_unlock(&handles_mutex);
+            return NULL;
+        }
+        for (const Handle* other = handles; other; other = other->next) {
+            if (other->lockdir_dev == stbuf.st_dev && other->lockdir_ino == stbuf.st_ino) {
+                pthread_mutex_unlock(&handles_mutex);
+                errno = EEXIST;
+                return NULL;
+            }
+        }
+    }
+
+    if (!handle) {
+        static bool did_register = false;
+        if (!did_register) {
+            atexit(close_handles);
+            did_register = true;
+        }
+
+        handle = calloc(1, sizeof(Handle));
+        handle->lockdir = strdup(narwhal->lockdir);
+        handle->lockdir_dev = stbuf.st_dev;
+        handle->lockdir_ino = stbuf.st_ino;
+        handle->creator = getpid();
+        format_path(&handle->state_path, NULL, narwhal->lockdir, "/state", NULL);
+        format_path(&handle->lockfile_path, NULL, narwhal->lockdir, "/lockfile", NULL);
+        format_path(&handle->private_path, NULL, narwhal->lockdir, "/", host_name, ".", pid, NULL);
+        format_path(&handle->alternate_path, NULL, handle->private_path, ".alt", NULL);
+        format_path(&handle->temp_path, NULL, handle->private_path, ".tmp", NULL);
+        format_path(&handle->broken_path, NULL, handle->private_path, ".broken", NULL);
+        format_path(&handle->wake_path, NULL, handle->private_path, ".wake", NULL);
+        preallocate_buffers(handle, narwhal->max_clients);
+        handle->coordinator_fd = -1;
+        handle->wake_fd = -1;
+        handle->local_fd = -1;
+        handle->backend = narwhal->backend;
+        if (handle->backend != NARWHAL_NFS_BACKEND)
+            format_path(&handle->local_path,
+                        NULL,
+                        narwhal->lockdir,
+                        handle->backend == NARWHAL_SHM_BACKEND ? "/shm_lock" : "/fcntl_lock",
+                        NULL);
+        init_shared_locks(handle);
+        if (!narwhal->coordinator && handle->backend == NARWHAL_NFS_BACKEND
+            && (create_private_file(handle->private_path) < 0
+                || (narwhal->protocol != NARWHAL_SLOT_PROTOCOL && create_private_file(handle->alternate_path) < 0))) {
+            int base_errno = errno;
+            handle->creator = 0;
+            free_handle(handle);
+            pthread_mutex_unlock(&handles_mutex);
+            errno = base_errno;
+            return NULL;
+        }
+    }
+
+    handle->next = handles;
+    handles = handle;
+    pthread_mutex_unlock(&handles_mutex);
+    return handle;
+}
+
+// Copy the parameters of the current operation into the handle, after completing any deferred unlock (using the
+// parameters it was given).
+static void
+use_handle(Handle* handle, const Narwhal* narwhal) {
+    finish_unlock(handle);
+    handle->narwhal = *narwhal;
+    handle->narwhal.lockdir = handle->lockdir;
+}
+
+// Get the handle for accessing a lockdir, creating it if needed, for the current operation. This locks the handle until
+// put_handle is called.
+static Handle*
+get_handle(const Narwhal* narwhal) {
+    Handle* handle = open_handle(narwhal);
+    if (handle) {
+        pthread_mutex_lock(&handle->mutex);
+        use_handle(handle, narwhal);
+    }
+    return handle;
+}
+
+// Unlock the handle at the end of the current operation, passing through the result (and errno) of the operation.
+static int
+put_handle(Handle* handle, int result) {
+    int base_errno = errno;
+    publish_stats(handle);
+    pthread_mutex_unlock(&handle->mutex);
+    errno = base_errno;
+    return result;
 }
 
 // Load the state file into the state_text. Places an extra \0 after the final one to make parsing easier (no valid
 // field is empty).
 static int
-load_state_text(const Narwhal* narwhal) {
+load_state_text(Handle* handle) {
     DEBUG_AT("load_state_text");
-    int state_fd = open(format_path(&state_path, narwhal->lockdir, "/state", NULL), O_CREAT | O_RDONLY, 0777);
+    long long start_usec = clock_usec();
+    int state_fd = syscalls.open(handle->state_path, O_CREAT | O_RDONLY, 0777);
     if (state_fd < 0) {
         if (errno != ENOENT)
             return -1;
+        handle->state_text[0] = handle->state_text[1] = '\0';
+        handle->state_size = 0;
         return 0;
     }
 
     struct stat stbuf;
-    if (fstat(state_fd, &stbuf) < 0) {
+    if (syscalls.fstat(state_fd, &stbuf) < 0) {
         int base_errno = errno;
-        close(state_fd);
+        syscalls.close(state_fd);
         errno = base_errno;
         return -1;
     }
 
     ssize_t size = stbuf.st_size;
-    state_text = realloc(state_text, size + 2);
-    if (read(state_fd, state_text, size) != size) {
+    handle->state_text = reserve(handle->state_text, &handle->state_capacity, size + 2, 1);
+    if (syscalls.read(state_fd, handle->state_text, size) != size) {
         int base_errno = errno;
-        close(state_fd);
+        syscalls.close(state_fd);
         errno = base_errno;
         return -1;
     }
-    state_text[size] = '\0';
-    state_text[size + 1] = '\0';
+    handle->state_text[size] = '\0';
+    handle->state_text[size + 1] = '\0';
+    handle->state_size = size;
+    handle->stats.state_bytes_read += size;
+    handle->stats.state_io_usec += clock_usec() - start_usec;
 
-    if (close(state_fd) < 0)
+    if (syscalls.close(state_fd) < 0)
         return -1;
     return 0;
 }
 
-// Parse the loaded state_text into the client_states and n_client_states. Works by splitting the buffer into \0
-// separated strings by replacing all spaces and line breaks with \0. This trusts that the file was generated by the
-// code so the result will have exactly the right number of fields per line (so we don't need to distinguish between
-// space and line break, we can just count). While at it, simply do not load stale client states (if we do, already set
-// client_states_changed).
-static void
-parse_client_states(const Narwhal* narwhal) {
-    DEBUG_AT("load_state_text");
-    long long first_fresh_time = time(NULL) - narwhal->timeout_sec;
+// Whether a client state is of the current process, as determined when it was parsed (see is_own_client).
+static bool
+is_own_state(const ClientState* client_state) {
+    return client_state->is_own;
+}
 
-    n_client_states = 0;
-    for (char* p = state_text; *p; p++) {
-        n_client_states += *p == '\n';
-        if (*p == '\n' || *p == ' ')
-            *p = '\0';
-    }
-    client_states = realloc(client_states, (n_client_states + 1) * sizeof(ClientState));
+// Whether a parsed client state is of the current process. This compares the strings, so it is only done once per
+// parse, and everything else uses the cached result.
+static bool
+is_own_client(const ClientState* client_state) {
+    return client_state->pid[0] == pid[0] && !strcmp(client_state->pid, pid)
+        && !strcmp(client_state->host_name, host_name);
+}
 
-    client_states_changed = false;
-    ClientState* next_client_state = client_states;
-    granted_state = NULL;
-    int field_index = 0;
+// Whether the current operation uses the slot protocol (see narwhal.h).
+static bool
+is_slot_protocol(const Handle* handle) {
+    return handle->narwhal.protocol == NARWHAL_SLOT_PROTOCOL;
+}
 
-    const char* p = state_text;
-    while (*p) {
-        switch (field_index++ % 5) {
-        default:
-            assert(false);
+// Whether a file name ends with some suffix.
+static bool
+has_suffix(const char* name, const char* suffix) {
+    size_t name_length = strlen(name);
+    size_t suffix_length = strlen(suffix);
+    return name_length >= suffix_length && !strcmp(name + name_length - suffix_length, suffix);
+}
 
-        case 0:
-            next_client_state->host_name = p;
-            break;
+// Whether a file in the lockdir is the request file of some client (in the slot protocol). These are all the
+// hostname.pid files, which are all the files except for the state file, the lockfile, temporary files and wake files.
+static bool
+is_slot_file(const struct dirent* entry) {
+    const char* name = entry->d_name;
+    return *name != '.' && strcmp(name, "state") && strcmp(name, "lockfile") && !has_suffix(name, ".tmp")
+        && !has_suffix(name, ".wake") && !has_suffix(name, ".broken") && !has_suffix(name, ".alt")
+#ifdef _DIRENT_HAVE_D_TYPE
+        && entry->d_type != DT_DIR
+#endif
+        ;
+}
 
-        case 1:
-            next_client_state->pid = p;
-            break;
+// Whether all the requests in the request file of some other client are stale (in the slot protocol), given its text
+// (which is terminated by a '\0') and status. An empty file is stale once it was not modified for the timeout.
+static bool
+is_stale_slot_text(const char* text, const struct stat* stbuf, long long first_fresh_time) {
+    if (!*text)
+        return stbuf->st_mtim.tv_sec * 1000LL + stbuf->st_mtim.tv_nsec / 1000000 < first_fresh_time;
+    for (const char* line = text; *line; line = strchr(line, '\n') + 1) {
+        long long time;
+        if (sscanf(line, "%*s %*s %*s %*s %lld", &time) != 1 || time >= first_fresh_time)
+            return false;
+    }
+    return true;
+}
 
-        case 2:
-            assert(!p[1]);
-            switch (*p) {
-            default:
-                assert(false);
-            case 'R':
-                next_client_state->is_write_lock = false;
-                break;
-            case 'W':
-                next_client_state->is_write_lock = true;
-                break;
-            }
-            break;
+// Remove the request file of a crashed client (in the slot protocol), so we don't read it in every round from now on.
+// We first verify it is still the file we read; its owner may have been merely stalled and replaced it since. Errors
+// are ignored, since the stale requests are ignored anyway.
+static void
+remove_slot_file(Handle* handle, const struct stat* stbuf) {
+    int base_errno = errno;
+    struct stat path_stbuf;
+    if (syscalls.stat(handle->slot_path, &path_stbuf) == 0 && path_stbuf.st_ino == stbuf->st_ino
+        && path_stbuf.st_size == stbuf->st_size && path_stbuf.st_mtim.tv_sec == stbuf->st_mtim.tv_sec
+        && path_stbuf.st_mtim.tv_nsec == stbuf->st_mtim.tv_nsec) {
+        DEBUG_EXP(handle->slot_path, "%s (remove stale request file)");
+        syscalls.unlink(handle->slot_path);
+    }
+    errno = base_errno;
+}
 
-        case 3:
-            assert(!p[1]);
-            switch (*p) {
-            default:
-                assert(false);
-            case 'P':
-                next_client_state->is_granted = false;
-                break;
-            case 'G':
-                next_client_state->is_granted = true;
-                granted_state = next_client_state;
-                break;
-            }
-            break;
+// Append the content of the request file of some client to the state_text (in the slot protocol). The file may
+// disappear (or turn out to be a directory) from under us; such files are simply skipped. If all the requests in the
+// file of some other client are stale, we remove it (see remove_slot_file) after appending it, so the requests are
+// evicted just as if we kept it.
+static int
+append_slot_text(Handle* handle, const char* name, size_t* sizep, long long first_fresh_time) {
+    format_path(&handle->slot_path, &handle->slot_path_capacity, handle->lockdir, "/", name, NULL);
+    int slot_fd = syscalls.open(handle->slot_path, O_RDONLY, 0);
+    if (slot_fd < 0)
+        return errno == ENOENT ? 0 : -1;
 
-        case 4:
-            next_client_state->time = atoll(p);
-            if (next_client_state->time >= first_fresh_time) {
-                DEBUG_EXP(next_client_state->time, "%lld (fresh request)");
-                next_client_state++;
-            } else {
-                DEBUG_EXP(next_client_state->time, "%lld (stale request)");
-                client_states_changed = true;
-            }
-            break;
-        }
+    struct stat stbuf;
+    if (syscalls.fstat(slot_fd, &stbuf) < 0) {
+        int base_errno = errno;
+        syscalls.close(slot_fd);
+        errno = base_errno;
+        return -1;
+    }
 
-        while (*p++)
-            ;
+    ssize_t size = S_ISREG(stbuf.st_mode) ? stbuf.st_size : 0;
+    handle->state_text = reserve(handle->state_text, &handle->state_capacity, *sizep + size + 3, 1);
+    if (size > 0 && syscalls.read(slot_fd, handle->state_text + *sizep, size) != size) {
+        int base_errno = errno;
+        syscalls.close(slot_fd);
+        errno = base_errno;
+        return -1;
     }
+    if (syscalls.close(slot_fd) < 0)
+        return -1;
 
-    n_client_states = next_client_state - client_states;
+    size_t start = *sizep;
+    *sizep += size;
+    if (size > 0 && handle->state_text[*sizep - 1] != '\n')
+        handle->state_text[(*sizep)++] = '\n';
+    handle->state_text[*sizep] = '\0';
+    handle->stats.state_bytes_read += size;
+    if (S_ISREG(stbuf.st_mode) && strcmp(handle->slot_path, handle->private_path)
+        && is_stale_slot_text(handle->state_text + start, &stbuf, first_fresh_time))
+        remove_slot_file(handle, &stbuf);
+    return 0;
 }
 
-// Load and parse the state file.
+// Load the requests of all the clients into the state_text (in the slot protocol), by concatenating the content of all
+// their request files. The result looks just like a text state file.
 static int
-load_client_states(const Narwhal* narwhal) {
-    DEBUG_AT("load_client_states");
-    if (load_state_text(narwhal) < 0)
+load_slot_text(Handle* handle) {
+    DEBUG_AT("load_slot_text");
+    long long start_usec = clock_usec();
+    long long first_fresh_time = state_time_msec() - timeout_msec_of(&handle->narwhal);
+    DIR* dir = syscalls.opendir(handle->lockdir);
+    if (!dir)
+        return -1;
+
+    size_t size = 0;
+    int result = 0;
+    for (;;) {
+        errno = 0;
+        struct dirent* entry = syscalls.readdir(dir);
+        if (!entry) {
+            result = errno ? -1 : 0;
+            break;
+        }
+        if (is_slot_file(entry) && append_slot_text(handle, entry->d_name, &size, first_fresh_time) < 0) {
+            result = -1;
+            break;
+        }
+    }
+
+    int base_errno = errno;
+    if (syscalls.closedir(dir) < 0 && result == 0)
         return -1;
-    parse_client_states(narwhal);  // We assume this never fails because only we write the state file.
+    errno = base_errno;
+    if (result < 0)
+        return -1;
+
+    handle->state_text = reserve(handle->state_text, &handle->state_capacity, size + 2, 1);
+    handle->state_text[size] = handle->state_text[size + 1] = '\0';
+    handle->state_size = size;
+    handle->stats.state_io_usec += clock_usec() - start_usec;
     return 0;
 }
 
-// Write an updated version of the state file.
+// Accept a parsed client state, unless it is stale. Returns whether the state was accepted.
+static bool
+accept_client_state(Handle* handle, ClientState* client_state, long long first_fresh_time) {
+    handle->stats.entries_parsed++;
+    client_state->is_own = is_own_client(client_state);
+    if (client_state->time < first_fresh_time) {
+        DEBUG_EXP(client_state->time, "%lld (stale request)");
+        TRACE(handle, NARWHAL_TRACE_STALE_EVICTED, client_state);
+        handle->stats.stale_entries++;
+        if (client_state->is_granted && client_state->is_write_lock)
+            handle->write_generation++;  // The writer may have modified the data before it crashed.
+        handle->client_states_changed = true;
+        handle->is_generation_changed = true;
+        return false;
+    }
+
+    DEBUG_EXP(client_state->time, "%lld (fresh request)");
+    if (client_state->time < handle->oldest_time)
+        handle->oldest_time = client_state->time;
+    client_state->is_dirty = false;
+    if (client_state->is_own && handle->n_own_states++ == 0)
+        handle->own_index = client_state - handle->client_states;
+    return true;
+}
+
+// The value of a hex digit, or -1 if it is not one.
 static int
-dump_client_states() {
-    DEBUG_AT("dump_client_states");
-    FILE* state_fp = fopen(state_path, "w");
-    if (!state_fp)
-        return -1;
+hex_value(char digit) {
+    if (digit >= '0' && digit <= '9')
+        return digit - '0';
+    if (digit >= 'a' && digit <= 'f')
+        return digit - 'a' + 10;
+    return -1;
+}
 
-    for (const ClientState* client_state = client_states; client_state != client_states + n_client_states;
-         client_state++) {
-        if (fprintf(state_fp,
-                    "%s %s %c %c %lld\n",
-                    client_state->host_name,
-                    client_state->pid,
-                    client_state->is_write_lock ? 'W' : 'R',
-                    client_state->is_granted ? 'G' : 'P',
-                    client_state->time)
-            < 0) {
-            fclose(state_fp);
-            return -1;
-        }
+// Parse the payload from its hex representation, until the first character which is not a pair of hex digits.
+static void
+parse_payload(Handle* handle, const char* hex) {
+    handle->payload_size = 0;
+    while (handle->payload_size < NARWHAL_MAX_PAYLOAD && hex_value(hex[0]) >= 0 && hex_value(hex[1]) >= 0) {
+        handle->payload[handle->payload_size++] = hex_value(hex[0]) << 4 | hex_value(hex[1]);
+        hex += 2;
     }
+}
 
-    return fclose(state_fp);
+// Format the payload in hex, padded with spaces to some width (which must be at least twice its size).
+static void
+format_payload(const Handle* handle, char* hex, size_t width) {
+    static const char digits[] = "0123456789abcdef";
+    size_t size = 0;
+    for (size_t index = 0; index < handle->payload_size; index++) {
+        hex[size++] = digits[handle->payload[index] >> 4];
+        hex[size++] = digits[handle->payload[index] & 0xf];
+    }
+    while (size < width)
+        hex[size++] = ' ';
+    hex[size] = '\0';
 }
 
-// Update the client_states to include a lock request from the current process. Returns -1 on error, 0 if the request
-// can't be granted yet, and 1 if it was granted. Will update an existing request, or add a new one if needed. Will fail
-// if an incompatible request already exists.
-static int
-request_lock(bool is_write_lock) {
-    DEBUG_AT("request_lock");
-    DEBUG_EXP(is_write_lock, "%d");
+// Parse the loaded state_text into the client_states and n_client_states. Works by splitting the buffer into \0
+// separated strings by replacing all spaces and line breaks with \0. This trusts that the file was generated by the
+// code so each line will have exactly the right fields (the lock name is the only optional one; it is omitted for the
+// unnamed lock, so files which don't use named locks look the same as they always did). While at it, simply do not
+// load stale client states (if we do, already set client_states_changed).
+static void
+parse_text_client_states(Handle* handle, long long first_fresh_time) {
+    DEBUG_AT("parse_text_client_states");
+    handle->n_client_states = 0;
+    for (const char* p = handle->state_text; *p; p++)
+        handle->n_client_states += *p == '\n';
+    handle->client_states = reserve(
+        handle->client_states, &handle->client_states_capacity, handle->n_client_states + 1, sizeof(ClientState));
 
-    bool is_granted = !granted_state || (!is_write_lock && !granted_state->is_write_lock);
+    ClientState* next_client_state = handle->client_states;
 
-    ClientState* client_state = client_states;
-    ClientState* end_state = client_states + n_client_states;
-    for (; client_state != end_state; client_state++) {
-        if (strcmp(client_state->pid, pid) || strcmp(client_state->host_name, host_name)) {
-            fprintf(stderr, "%s != %s || %s != %s\n", client_state->pid, pid, client_state->host_name, host_name);
+    char* p = handle->state_text;
+    while (*p) {
+        if (*p == '#') {  // Not a request (host names never start with #).
+            if (!strncmp(p, PAYLOAD_PREFIX, sizeof(PAYLOAD_PREFIX) - 1))
+                parse_payload(handle, p + sizeof(PAYLOAD_PREFIX) - 1);
+            else
+                sscanf(p, TEXT_WRITES_SCAN_FORMAT, &handle->write_generation);
+            p = strchr(p, '\n') + 1;
             continue;
         }
 
-        if (client_state->is_granted || client_state->is_write_lock != is_write_lock) {
-            errno = ENOTSUP;
-            return -1;
+        char* fields[7];
+        int n_fields = 0;
+        for (bool is_end_of_line = false; !is_end_of_line; p++) {
+            assert(n_fields < 7);
+            fields[n_fields++] = p;
+            while (*p && *p != ' ' && *p != '\n')
+                p++;
+            is_end_of_line = *p != ' ';
+            *p = '\0';
         }
+        assert(n_fields >= 6);
 
-        if (is_granted) {
-            client_state->is_granted = true;
-            client_states_changed = true;
-        }
+        next_client_state->host_name = fields[0];
+        next_client_state->pid = fields[1];
 
-        break;
+        assert(!fields[2][1] && strchr("RWrw", fields[2][0]));
+        next_client_state->is_write_lock = toupper(fields[2][0]) == 'W';
+        next_client_state->is_intent = islower(fields[2][0]);
+
+        assert(!fields[3][1] && (fields[3][0] == 'P' || fields[3][0] == 'G' || fields[3][0] == 'U'));
+        next_client_state->is_granted = fields[3][0] == 'G';
+        next_client_state->is_upgrading = fields[3][0] == 'U';
+
+        next_client_state->time = atoll(fields[4]);
+        next_client_state->ticket = strtoull(fields[5], NULL, 10);
+        next_client_state->name = n_fields > 6 ? fields[6] : "";
+        next_client_state->slot = -1;
+        if (accept_client_state(handle, next_client_state, first_fresh_time))
+            next_client_state++;
     }
 
-    if (client_state == end_state) {
-        client_state->host_name = host_name;
-        client_state->pid = pid;
-        client_state->is_write_lock = is_write_lock;
-        client_state->is_granted = is_granted;
-        client_state->time = time(NULL);
-        client_states_changed = true;
-        DEBUG_EXP(client_state->time, "%lld (new request)");
-        n_client_states++;
-    } else {
-        long long now = time(NULL);
-        if (client_state->time != now) {
-            client_state->time = now;
-            client_states_changed = true;
-            DEBUG_EXP(client_state->time, "%lld (renew request)");
+    handle->n_client_states = next_client_state - handle->client_states;
+}
+
+// Terminate a space-padded field of a fixed format record.
+static void
+terminate_fixed_field(char* field, int width) {
+    char* end = field + width;
+    while (end > field && end[-1] == ' ')
+        end--;
+    *end = '\0';
+}
+
+// Parse the loaded state_text (in fixed format) into the client_states and n_client_states. Works by placing \0 at the
+// end of each field in place. Free records (and stale client states) are collected into the free_slots.
+static void
+parse_fixed_client_states(Handle* handle, long long first_fresh_time) {
+    DEBUG_AT("parse_fixed_client_states");
+    int n_writers;
+    sscanf(handle->state_text, FIXED_HEADER_SCAN_FORMAT, &handle->generation, &n_writers, &handle->write_generation);
+    parse_payload(handle, handle->state_text + FIXED_HEADER_SIZE + sizeof(PAYLOAD_PREFIX) - 1);
+    handle->n_slots = (handle->state_size - FIXED_RECORDS_OFFSET) / FIXED_RECORD_SIZE;
+    handle->client_states
+        = reserve(handle->client_states, &handle->client_states_capacity, handle->n_slots + 1, sizeof(ClientState));
+    handle->free_slots
+        = reserve(handle->free_slots, &handle->free_slots_capacity, handle->n_slots + 1, sizeof(FreeSlot));
+
+    ClientState* next_client_state = handle->client_states;
+    handle->n_free_slots = 0;
+
+    for (int slot = 0; slot < handle->n_slots; slot++) {
+        char* record = handle->state_text + FIXED_RECORDS_OFFSET + slot * FIXED_RECORD_SIZE;
+        if (*record == ' ') {
+            handle->free_slots[handle->n_free_slots].slot = slot;
+            handle->free_slots[handle->n_free_slots++].is_dirty = false;
+            continue;
+        }
+
+        terminate_fixed_field(record, FIXED_HOST_WIDTH);
+        terminate_fixed_field(record + FIXED_PID_OFFSET, FIXED_PID_WIDTH);
+        terminate_fixed_field(record + FIXED_NAME_OFFSET, FIXED_NAME_WIDTH);
+        next_client_state->host_name = record;
+        next_client_state->pid = record + FIXED_PID_OFFSET;
+        next_client_state->name = record + FIXED_NAME_OFFSET;
+        next_client_state->is_write_lock = toupper(record[FIXED_MODE_OFFSET]) == 'W';
+        next_client_state->is_intent = islower(record[FIXED_MODE_OFFSET]);
+        next_client_state->is_granted = record[FIXED_STATUS_OFFSET] == 'G';
+        next_client_state->is_upgrading = record[FIXED_STATUS_OFFSET] == 'U';
+        next_client_state->time = atoll(record + FIXED_TIME_OFFSET);
+        next_client_state->ticket = strtoull(record + FIXED_TICKET_OFFSET, NULL, 10);
+        next_client_state->slot = slot;
+
+        if (accept_client_state(handle, next_client_state, first_fresh_time)) {
+            next_client_state++;
         } else {
-            DEBUG_EXP(client_state->time, "%lld (current request)");
+            handle->free_slots[handle->n_free_slots].slot = slot;
+            handle->free_slots[handle->n_free_slots++].is_dirty = true;
         }
     }
 
-    if (client_states_changed && dump_client_states() < 0)
+    handle->n_client_states = next_client_state - handle->client_states;
+}
+
+// Parse the loaded state_text into the client_states and n_client_states, in whatever format it was written in.
+static void
+parse_client_states(Handle* handle) {
+    DEBUG_AT("parse_client_states");
+    long long first_fresh_time = state_time_msec() - timeout_msec_of(&handle->narwhal);
+
+    handle->client_states_changed = false;
+    handle->is_generation_changed = false;
+    handle->oldest_time = LLONG_MAX;
+    handle->write_generation = 0;
+    handle->payload_size = 0;
+    handle->is_payload_changed = false;
+    handle->n_own_states = 0;
+    handle->own_index = 0;
+
+    handle->is_fixed_format
+        = !is_slot_protocol(handle) && !strncmp(handle->state_text, FIXED_MAGIC, sizeof(FIXED_MAGIC) - 1);
+    if (handle->is_fixed_format)
+        parse_fixed_client_states(handle, first_fresh_time);
+    else
+        parse_text_client_states(handle, first_fresh_time);
+}
+
+// Load and parse the state file (or the request files of all the clients, in the slot protocol).
+static int
+load_client_states(Handle* handle) {
+    DEBUG_AT("load_client_states");
+    if ((is_slot_protocol(handle) ? load_slot_text(handle) : load_state_text(handle)) < 0)
         return -1;
+    parse_client_states(handle);  // We assume this never fails because only we write the state file.
+    return 0;
+}
 
-    DEBUG_EXP(is_granted, "%d");
-    return is_granted;
+// Extract the state file version from its status.
+static void
+state_version_of(const struct stat* stbuf, StateVersion* version) {
+    version->dev = stbuf->st_dev;
+    version->ino = stbuf->st_ino;
+    version->size = stbuf->st_size;
+    version->mtime = stbuf->st_mtim;
+    version->ctime = stbuf->st_ctim;
 }
 
-// Get an exclusive lock of the state file. This must be done before loading it. This just spins trying to create the
-// lock; if we spin a very long time we assume whoever held the lock died without removing the lock file, but we have no
-// way to safely remove it without introducing a race condition, so we just fail with ETIMEDOUT.
+// The path whose version tells us whether the state changed. In the slot protocol, this is the lockdir itself, whose
+// modification time changes whenever any client renames a new version of its request file into it.
+static const char*
+state_version_path(const Handle* handle) {
+    return is_slot_protocol(handle) ? handle->lockdir : handle->state_path;
+}
+
+// Record the current version of the state file. This must be done while holding the lockfile so nobody changes the
+// state file from under us.
 static int
-exclusive_lock(const Narwhal* narwhal) {
-    DEBUG_AT("exclusive_lock");
-    int private_fd = creat(format_path(&private_path, narwhal->lockdir, "/", host_name, ".", pid, NULL), 0777);
-    if (private_fd < 0 || close(private_fd) < 0)
+snapshot_state_version(const Handle* handle, StateVersion* version) {
+    DEBUG_AT("snapshot_state_version");
+    struct stat stbuf;
+    if (syscalls.stat(state_version_path(handle), &stbuf) < 0)
         return -1;
+    state_version_of(&stbuf, version);
+    version->is_fixed_format = handle->is_fixed_format;
+    version->generation = handle->generation;
+    return 0;
+}
+
+// Check whether the state file was changed since we recorded its version, without taking the lockfile. We open the
+// file (rather than just stat it) because NFS only guarantees close-to-open consistency; stat may return cached
+// attributes. Any error is reported as a change, so the caller will do a full round and report the error properly.
+static bool
+check_state_version(const Handle* handle, const StateVersion* version) {
+    DEBUG_AT("check_state_version");
+    int state_fd = syscalls.open(state_version_path(handle), O_RDONLY, 0);
+    if (state_fd < 0)
+        return true;
+
+    struct stat stbuf;
+    int stat_result = syscalls.fstat(state_fd, &stbuf);
+
+    // For the fixed format, records are updated in place (e.g. for renewals), so we look at the generation in the
+    // header, which only changes when requests are added or removed.
+    char header[FIXED_HEADER_SIZE + 1];
+    ssize_t header_size = 0;
+    if (stat_result == 0 && version->is_fixed_format)
+        header_size = syscalls.pread(state_fd, header, FIXED_HEADER_SIZE, 0);
+    syscalls.close(state_fd);
+    if (stat_result < 0)
+        return true;
+
+    StateVersion current;
+    state_version_of(&stbuf, &current);
+    if (version->is_fixed_format) {
+        if (header_size != FIXED_HEADER_SIZE || current.dev != version->dev || current.ino != version->ino)
+            return true;
+        header[FIXED_HEADER_SIZE] = '\0';
+        int n_writers;
+        unsigned long long write_generation;
+        return sscanf(header, FIXED_HEADER_SCAN_FORMAT, &current.generation, &n_writers, &write_generation) != 3
+            || current.generation != version->generation;
+    }
 
-    format_path(&lockfile_path, narwhal->lockdir, "/lockfile", NULL);
-    long long last_reasonable_time = time(NULL) + narwhal->timeout_sec;
+    return current.dev != version->dev || current.ino != version->ino || current.size != version->size
+        || current.mtime.tv_sec != version->mtime.tv_sec || current.mtime.tv_nsec != version->mtime.tv_nsec
+        || current.ctime.tv_sec != version->ctime.tv_sec || current.ctime.tv_nsec != version->ctime.tv_nsec;
+}
+
+// Check whether the state file was changed since we recorded its version (see check_state_version), collecting
+// statistics.
+static bool
+is_state_version_changed(Handle* handle, const StateVersion* version) {
+    long long start_usec = clock_usec();
+    bool is_changed = check_state_version(handle, version);
+    handle->stats.version_checks++;
+    handle->stats.state_io_usec += clock_usec() - start_usec;
+    return is_changed;
+}
+
+// The mode of a client state in the state file: R (read), W (write), or r or w for intention locks.
+static char
+mode_char(const ClientState* client_state) {
+    char mode = client_state->is_write_lock ? 'W' : 'R';
+    return client_state->is_intent ? tolower(mode) : mode;
+}
+
+// The status of a client state in the state file: G (granted), U (upgrading), or P (pending).
+static char
+status_char(const ClientState* client_state) {
+    return client_state->is_granted ? 'G' : client_state->is_upgrading ? 'U' : 'P';
+}
 
-    const struct timespec duration = { .tv_sec = narwhal->spin_usec / 1000000,
-                                       .tv_nsec = (narwhal->spin_usec % 1000000) * 1000 };
+// Append a formatted line to the dump_text, growing it as needed.
+static int
+dump_line(Handle* handle, size_t* sizep, const char* format, ...) {
     for (;;) {
-        if (!link(private_path, lockfile_path))
-            return 0;
-        nanosleep(&duration, NULL);
-        if (time(NULL) > last_reasonable_time) {
-            errno = ETIMEDOUT;
+        va_list(argp);
+        va_start(argp, format);
+        int line_size = vsnprintf(handle->dump_text + *sizep, handle->dump_capacity - *sizep, format, argp);
+        va_end(argp);
+
+        if (line_size < 0)
             return -1;
+
+        if (*sizep + line_size < handle->dump_capacity) {
+            *sizep += line_size;
+            return 0;
         }
+
+        handle->dump_text = reserve(handle->dump_text, &handle->dump_capacity, *sizep + line_size + 1, 1);
     }
 }
 
-// Release the exclusive lock of the state file.
+// Write the first size bytes of the dump_text as the new state file (or our request file, in the slot protocol). We
+// write it using a single write into a temporary file, and then atomically rename it on top of the file. This way
+// nobody ever sees a partially written file (even if we crash in the middle), and we minimize the number of NFS write
+// operations.
 static int
-exclusive_unlock(const Narwhal* narwhal) {
-    int base_errno = errno;
-    errno = 0;
-    DEBUG_AT("exclusive_unlock");
-    int lockfile_result = unlink(lockfile_path);
-    int private_result = unlink(private_path);
-    if (base_errno != 0)
+write_dump_text(Handle* handle, size_t size, const char* path) {
+    long long start_usec = clock_usec();
+    int temp_fd = syscalls.open(handle->temp_path, O_CREAT | O_TRUNC | O_WRONLY, 0777);
+    if (temp_fd < 0)
+        return -1;
+
+    for (size_t written = 0; written < size;) {
+        ssize_t result = syscalls.write(temp_fd, handle->dump_text + written, size - written);
+        if (result < 0) {
+            int base_errno = errno;
+            syscalls.close(temp_fd);
+            syscalls.unlink(handle->temp_path);
+            errno = base_errno;
+            return -1;
+        }
+        written += result;
+    }
+
+    if (syscalls.close(temp_fd) < 0 || syscalls.rename(handle->temp_path, path) < 0) {
+        int base_errno = errno;
+        syscalls.unlink(handle->temp_path);
         errno = base_errno;
-    return lockfile_result < private_result ? lockfile_result : private_result;
+        return -1;
+    }
+
+    handle->stats.state_bytes_written += size;
+    handle->stats.state_io_usec += clock_usec() - start_usec;
+    return 0;
 }
 
-// Implement narwhal_read_lock. See the header file.
-int
-narwhal_read_lock(const Narwhal* narwhal) {
-    init();
-    DEBUG_AT("narwhal_read_lock");
-    for (;;) {
-        if (exclusive_lock(narwhal) < 0)
+// Write an updated version of the state file in the text format. We serialize the whole state into memory and write it
+// all at once. In the slot protocol, we only write our own requests, into our request file.
+static int
+dump_text_client_states(Handle* handle) {
+    DEBUG_AT("dump_text_client_states");
+    size_t size = 0;
+    bool is_slot = is_slot_protocol(handle);
+    if (!is_slot && handle->write_generation > 0
+        && dump_line(handle, &size, TEXT_WRITES_FORMAT, handle->write_generation) < 0)
+        return -1;
+    if (!is_slot && handle->payload_size > 0) {
+        char hex[2 * NARWHAL_MAX_PAYLOAD + 1];
+        format_payload(handle, hex, 0);
+        if (dump_line(handle, &size, PAYLOAD_PREFIX "%s\n", hex) < 0)
             return -1;
-        int result = load_client_states(narwhal) < 0 ? -1 : request_lock(false);
-        if (exclusive_unlock(narwhal) < 0 || result < 0)
+    }
+    const ClientState* end_state = handle->client_states + handle->n_client_states;
+    for (const ClientState* client_state = handle->client_states; client_state != end_state; client_state++) {
+        if (is_slot && !is_own_state(client_state))
+            continue;
+        if (dump_line(handle,
+                      &size,
+                      *client_state->name ? "%s %s %c %c %lld %llu %s\n" : "%s %s %c %c %lld %llu\n",
+                      client_state->host_name,
+                      client_state->pid,
+                      mode_char(client_state),
+                      status_char(client_state),
+                      client_state->time,
+                      client_state->ticket,
+                      client_state->name)
+            < 0)
             return -1;
-        if (result)
-            return 0;
     }
+
+    return write_dump_text(handle, size, is_slot ? handle->private_path : handle->state_path);
 }
 
-// Implement narwhal_write_lock. See the header file.
-int
-narwhal_write_lock(const Narwhal* narwhal) {
-    init();
-    DEBUG_AT("narwhal_write_lock");
-    for (;;) {
-        if (exclusive_lock(narwhal) < 0)
+// Count the number of write requests (granted or pending), for the header of a fixed format state file.
+static int
+count_writers(const Handle* handle) {
+    int n_writers = 0;
+    const ClientState* end_state = handle->client_states + handle->n_client_states;
+    for (const ClientState* client_state = handle->client_states; client_state != end_state; client_state++)
+        n_writers += client_state->is_write_lock;
+    return n_writers;
+}
+
+// Append a record of a fixed format state file to the dump_text.
+static int
+dump_fixed_record(Handle* handle, size_t* sizep, const ClientState* client_state) {
+    if (!client_state)
+        return dump_line(handle, sizep, "%*s\n", FIXED_RECORD_SIZE - 1, "");
+    return dump_line(handle, sizep,
+                     "%-*s %-*s %c %c %0*lld %0*llu %-*s\n",
+                     FIXED_HOST_WIDTH,
+                     client_state->host_name,
+                     FIXED_PID_WIDTH,
+                     client_state->pid,
+                     mode_char(client_state),
+                     status_char(client_state),
+                     FIXED_TIME_WIDTH,
+                     client_state->time,
+                     FIXED_TICKET_WIDTH,
+                     client_state->ticket,
+                     FIXED_NAME_WIDTH,
+                     client_state->name);
+}
+
+// Append the payload line of a fixed format state file to the dump_text.
+static int
+dump_fixed_payload(Handle* handle, size_t* sizep) {
+    char hex[2 * NARWHAL_MAX_PAYLOAD + 1];
+    format_payload(handle, hex, 2 * NARWHAL_MAX_PAYLOAD);
+    return dump_line(handle, sizep, PAYLOAD_PREFIX "%s\n", hex);
+}
+
+// Write a whole new state file in the fixed format. This is only done when creating the file.
+static int
+dump_fixed_client_states(Handle* handle) {
+    DEBUG_AT("dump_fixed_client_states");
+    size_t size = 0;
+    if (dump_line(handle,
+                  &size,
+                  FIXED_HEADER_FORMAT,
+                  ++handle->generation,
+                  count_writers(handle),
+                  handle->write_generation)
+        < 0)
+        return -1;
+    if (dump_fixed_payload(handle, &size) < 0)
+        return -1;
+
+    handle->n_slots = 0;
+    ClientState* end_state = handle->client_states + handle->n_client_states;
+    for (ClientState* client_state = handle->client_states; client_state != end_state; client_state++) {
+        client_state->slot = handle->n_slots++;
+        if (dump_fixed_record(handle, &size, client_state) < 0)
+            return -1;
+    }
+
+    return write_dump_text(handle, size, handle->state_path);
+}
+
+// The pseudo slots of the header and the payload line of a fixed format state file (see write_fixed_record).
+#define FIXED_HEADER_SLOT -1
+#define FIXED_PAYLOAD_SLOT -2
+
+// Write a single record (or the header or the payload line, for the pseudo slots) of a fixed format state file in
+// place. If the client_state is NULL, clears the record instead.
+static int
+write_fixed_record(Handle* handle, int state_fd, int slot, const ClientState* client_state) {
+    size_t size = 0;
+    int result;
+    off_t offset;
+    if (slot == FIXED_HEADER_SLOT) {
+        result = dump_line(handle,
+                           &size,
+                           FIXED_HEADER_FORMAT,
+                           handle->generation,
+                           count_writers(handle),
+                           handle->write_generation);
+        offset = 0;
+    } else if (slot == FIXED_PAYLOAD_SLOT) {
+        result = dump_fixed_payload(handle, &size);
+        offset = FIXED_HEADER_SIZE;
+    } else {
+        result = dump_fixed_record(handle, &size, client_state);
+        offset = FIXED_RECORDS_OFFSET + (off_t)slot * FIXED_RECORD_SIZE;
+    }
+    if (result < 0)
+        return -1;
+
+    long long start_usec = clock_usec();
+    if (syscalls.pwrite(state_fd, handle->dump_text, size, offset) != (ssize_t)size)
+        return -1;
+    handle->stats.state_bytes_written += size;
+    handle->stats.state_io_usec += clock_usec() - start_usec;
+    return 0;
+}
+
+// Update the state file in the fixed format, writing just the modified records in place. Typically this is a single
+// record, and the header if requests were added or removed.
+static int
+update_fixed_client_states(Handle* handle) {
+    DEBUG_AT("update_fixed_client_states");
+    int state_fd = syscalls.open(handle->state_path, O_WRONLY, 0);
+    if (state_fd < 0)
+        return -1;
+
+    int result = 0;
+    ClientState* end_state = handle->client_states + handle->n_client_states;
+    for (ClientState* client_state = handle->client_states; result == 0 && client_state != end_state; client_state++) {
+        if (!client_state->is_dirty)
+            continue;
+        if (client_state->slot < 0)
+            client_state->slot
+                = handle->n_free_slots > 0 ? handle->free_slots[--handle->n_free_slots].slot : handle->n_slots++;
+        result = write_fixed_record(handle, state_fd, client_state->slot, client_state);
+    }
+
+    FreeSlot* end_slot = handle->free_slots + handle->n_free_slots;
+    for (FreeSlot* free_slot = handle->free_slots; result == 0 && free_slot != end_slot; free_slot++) {
+        if (free_slot->is_dirty)
+            result = write_fixed_record(handle, state_fd, free_slot->slot, NULL);
+    }
+
+    if (result == 0 && handle->is_payload_changed)
+        result = write_fixed_record(handle, state_fd, FIXED_PAYLOAD_SLOT, NULL);
+    if (result == 0 && handle->is_generation_changed) {
+        handle->generation++;
+        result = write_fixed_record(handle, state_fd, FIXED_HEADER_SLOT, NULL);
+    }
+
+    int base_errno = errno;
+    if (syscalls.close(state_fd) < 0 && result == 0)
+        return -1;
+    errno = base_errno;
+    return result;
+}
+
+// The private file we link as the lockfile (or linked, while we hold it). We alternate between two private files, so
+// each time we get the lockfile, it has a different inode than the last time we held it (see break_lockfile).
+static const char*
+link_path(const Handle* handle) {
+    return handle->is_alternate ? handle->alternate_path : handle->private_path;
+}
+
+// Whether some other client broke the lockfile we are holding, because we held it for longer than the timeout (e.g.,
+// if the process was stopped). Once it is broken, our private file is no longer linked to it. Checking this costs an
+// NFS operation, so we only check once we held the lockfile for half the timeout, which leaves us a safe margin.
+static bool
+is_lockfile_broken(const Handle* handle) {
+    if (is_slot_protocol(handle) || clock_msec() - handle->lockfile_time < timeout_msec_of(&handle->narwhal) / 2)
+        return false;
+    int base_errno = errno;
+    struct stat stbuf;
+    bool is_broken = syscalls.stat(link_path(handle), &stbuf) == 0 && stbuf.st_nlink < 2;
+    errno = base_errno;
+    DEBUG_AT(is_broken ? "lockfile was broken" : "lockfile is still held");
+    return is_broken;
+}
+
+// Write an updated version of the state file, in the appropriate format.
+static int
+dump_client_states(Handle* handle) {
+    if (is_slot_protocol(handle))
+        return dump_text_client_states(handle);
+    if (is_lockfile_broken(handle)) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    if (handle->is_fixed_format)
+        return update_fixed_client_states(handle);
+    if (handle->narwhal.state_format == NARWHAL_FIXED_STATE && handle->state_size == 0) {
+        handle->generation = 0;
+        handle->is_fixed_format = true;
+        return dump_fixed_client_states(handle);
+    }
+    return dump_text_client_states(handle);
+}
+
+// The name of a lock as it appears in the state file.
+static const char*
+lock_name(const NarwhalNamedLock* named_lock) {
+    return named_lock->name ? named_lock->name : "";
+}
+
+// Find the state of the current process for some lock in the client_states, if any. Our states are usually adjacent,
+// so we first look where we found the first of them last time (or where it was parsed). If we see all of them there,
+// we don't look at the states of the other clients at all, so this does not depend on the number of clients.
+static ClientState*
+find_own_state(Handle* handle, const char* name) {
+    if (handle->n_own_states == 0)
+        return NULL;
+
+    ClientState* end_state = handle->client_states + handle->n_client_states;
+    int n_seen_states = 0;
+    if (handle->own_index < handle->n_client_states) {
+        for (ClientState* client_state = handle->client_states + handle->own_index;
+             client_state != end_state && is_own_state(client_state);
+             client_state++, n_seen_states++) {
+            if (!strcmp(client_state->name, name))
+                return client_state;
+        }
+    }
+    if (n_seen_states == handle->n_own_states)
+        return NULL;
+
+    ClientState* found_state = NULL;
+    handle->own_index = -1;
+    for (ClientState* client_state = handle->client_states; client_state != end_state && !found_state; client_state++) {
+        if (!is_own_state(client_state))
+            continue;
+        if (handle->own_index < 0)
+            handle->own_index = client_state - handle->client_states;
+        if (!strcmp(client_state->name, name))
+            found_state = client_state;
+    }
+    if (handle->own_index < 0)
+        handle->own_index = 0;
+    return found_state;
+}
+
+// Verify a set of locks can be requested, and that all the fields will fit in the state file.
+static int
+check_locks(const Handle* handle, const NarwhalNamedLock* locks, int n_locks) {
+    if (n_locks <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    bool is_fixed_format = handle->is_fixed_format || handle->narwhal.state_format == NARWHAL_FIXED_STATE;
+    if (is_fixed_format && (strlen(host_name) > FIXED_HOST_WIDTH || strlen(pid) > FIXED_PID_WIDTH)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    for (int lock_index = 0; lock_index < n_locks; lock_index++) {
+        const char* name = lock_name(locks + lock_index);
+        if (strpbrk(name, " \t\n")) {
+            errno = EINVAL;
             return -1;
-        int result = load_client_states(narwhal) < 0 ? -1 : request_lock(true);
-        if (exclusive_unlock(narwhal) < 0 || result < 0)
+        }
+        if (is_fixed_format && strlen(name) > FIXED_NAME_WIDTH) {
+            errno = ENAMETOOLONG;
             return -1;
-        if (result)
+        }
+        for (int other_index = 0; other_index < lock_index; other_index++) {
+            if (!strcmp(name, lock_name(locks + other_index))) {
+                errno = EINVAL;
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Whether a request of some other client is ahead of our request (with some ticket) in the queue. When using the
+// lockfile, tickets are unique; in the slot protocol, clients may choose the same ticket concurrently, so we break ties
+// by the client identity.
+static bool
+is_ahead(const ClientState* client_state, unsigned long long ticket) {
+    if (client_state->ticket != ticket)
+        return client_state->ticket < ticket;
+    int order = strcmp(client_state->host_name, host_name);
+    return order ? order < 0 : strcmp(client_state->pid, pid) < 0;
+}
+
+// Whether a lock request (with some ticket) must wait for a conflicting request of some other client. We always wait
+// for granted requests. An upgrading request still holds its read lock, so we wait for it as if it was granted. In the
+// slot protocol, we also wait for requests which are still choosing their ticket (ticket zero). An upgrading request
+// never waits for pending requests, since they all wait for it (even readers ahead of it in the queue, which were still
+// pending when it was granted its read lock). Otherwise, it depends on the policy:
+//
+// - By default, requests are granted in ticket order, so we wait for any conflicting request ahead of us in the queue.
+//   This means a pending writer is never starved by a stream of later readers, while consecutive readers are granted
+//   together.
+//
+// - Using the reader policy, readers ignore pending writers (and writers still wait for everything ahead of them).
+//
+// - Using the writer policy, readers wait for all pending writers, so writers must ignore pending readers (even ones
+//   ahead of them), otherwise they would wait for each other forever.
+static bool
+is_conflicting(const ClientState* client_state,
+               const NarwhalNamedLock* named_lock,
+               unsigned long long ticket,
+               bool is_upgrading,
+               NarwhalPolicy policy) {
+    if (!client_state->is_write_lock && !named_lock->is_write_lock)
+        return false;
+    if (client_state->is_intent && named_lock->is_intent)
+        return false;
+    if (strcmp(client_state->name, lock_name(named_lock)))
+        return false;
+    if (client_state->is_granted || client_state->is_upgrading || !client_state->ticket)
+        return true;
+    if (is_upgrading)
+        return false;
+    switch (policy) {
+    case NARWHAL_READER_POLICY:
+        return named_lock->is_write_lock && is_ahead(client_state, ticket);
+    case NARWHAL_WRITER_POLICY:
+        return !named_lock->is_write_lock || (client_state->is_write_lock && is_ahead(client_state, ticket));
+    case NARWHAL_FIFO_POLICY:
+    default:
+        return is_ahead(client_state, ticket);
+    }
+}
+
+// Add a new request of the current process to the client_states (which must have room for it).
+static ClientState*
+add_own_state(Handle* handle, const NarwhalNamedLock* named_lock, unsigned long long ticket, long long now) {
+    ClientState* client_state = handle->client_states + handle->n_client_states++;
+    client_state->host_name = host_name;
+    client_state->pid = pid;
+    client_state->is_own = true;
+    if (handle->n_own_states++ == 0)
+        handle->own_index = client_state - handle->client_states;
+    client_state->name = lock_name(named_lock);
+    client_state->is_write_lock = named_lock->is_write_lock;
+    client_state->is_intent = named_lock->is_intent;
+    client_state->is_granted = false;
+    client_state->is_upgrading = false;
+    client_state->time = now;
+    client_state->ticket = ticket;
+    client_state->slot = -1;
+    client_state->is_dirty = true;
+    handle->client_states_changed = true;
+    handle->is_generation_changed = true;
+    DEBUG_EXP(client_state->time, "%lld (new request)");
+    TRACE(handle, NARWHAL_TRACE_REQUESTED, client_state);
+    return client_state;
+}
+
+// Choose the ticket of a new request for a set of locks in the slot protocol. Without the lockfile, clients may choose
+// tickets concurrently, so this follows Lamport's bakery algorithm: we first publish our requests with ticket zero
+// ("choosing"), then take a ticket after all the tickets we see, publish it, and reload the requests of all the
+// clients. Since clients wait for conflicting requests which are still choosing, and order equal tickets by the client
+// identity, no two conflicting requests are ever granted at once. Does nothing if we already have requests.
+static int
+choose_slot_ticket(Handle* handle, const NarwhalNamedLock* locks, int n_locks) {
+    const ClientState* end_state = handle->client_states + handle->n_client_states;
+    for (const ClientState* client_state = handle->client_states; client_state != end_state; client_state++) {
+        if (is_own_state(client_state))
             return 0;
     }
+
+    handle->client_states = reserve(
+        handle->client_states, &handle->client_states_capacity, handle->n_client_states + n_locks, sizeof(ClientState));
+    long long now = state_time_msec();
+    for (int lock_index = 0; lock_index < n_locks; lock_index++)
+        add_own_state(handle, locks + lock_index, 0, now);
+    handle->own_time = clock_msec();
+    if (dump_client_states(handle) < 0 || load_client_states(handle) < 0)
+        return -1;
+
+    unsigned long long ticket = 1;
+    end_state = handle->client_states + handle->n_client_states;
+    for (const ClientState* client_state = handle->client_states; client_state != end_state; client_state++) {
+        if (client_state->ticket >= ticket)
+            ticket = client_state->ticket + 1;
+    }
+    for (ClientState* client_state = handle->client_states; client_state != end_state; client_state++) {
+        if (is_own_state(client_state))
+            client_state->ticket = ticket;
+    }
+    if (dump_client_states(handle) < 0 || load_client_states(handle) < 0)
+        return -1;
+    return 0;
+}
+
+// How old our pending requests must be before we renew them (by rewriting their time) in a round. Renewing them in
+// every round would change the state file in every round, so all the other waiting clients would do full rounds too.
+// This is a second (the granularity of the time in the original state format), or less for short timeouts; either way
+// we renew them well before they become stale, since we do a full round at least every half the timeout.
+static long long
+renew_granularity_msec(const Handle* handle) {
+    long long granularity_msec = timeout_msec_of(&handle->narwhal) / 8;
+    return granularity_msec < 1000 ? granularity_msec : 1000;
 }
 
-// Update the client_states to remove the request of the current process (which must exist and be granted).
+// Update the client_states to include a request for a set of locks from the current process. Returns -1 on error, 0 if
+// the request can't be granted yet, and 1 if it was granted. The whole set is granted at once, or not at all. Will
+// update existing requests, or add new ones (with a new ticket at the end of the queue) if needed. Will fail if
+// incompatible requests already exist.
 static int
-remove_lock(bool is_write_lock) {
-    DEBUG_AT("remove_lock");
-    ClientState* client_state = client_states;
-    ClientState* end_state = client_states + n_client_states;
-    for (; client_state != end_state; client_state++) {
-        if (strcmp(client_state->pid, pid) || strcmp(client_state->host_name, host_name))
-            continue;
+request_locks(Handle* handle, const NarwhalNamedLock* locks, int n_locks) {
+    DEBUG_AT("request_locks");
+    DEBUG_EXP(n_locks, "%d");
 
-        assert(client_state->is_granted);
-        break;
+    if (check_locks(handle, locks, n_locks) < 0)
+        return -1;
+    if (is_slot_protocol(handle) && choose_slot_ticket(handle, locks, n_locks) < 0)
+        return -1;
+
+    int n_own_states = 0;
+    unsigned long long ticket = 1;
+    unsigned long long own_ticket = 0;
+    bool is_upgrading = false;
+    const ClientState* end_state = handle->client_states + handle->n_client_states;
+    for (const ClientState* client_state = handle->client_states; client_state != end_state; client_state++) {
+        if (client_state->ticket >= ticket)
+            ticket = client_state->ticket + 1;
+        if (is_own_state(client_state)) {
+            n_own_states++;
+            own_ticket = client_state->ticket;
+            is_upgrading = client_state->is_upgrading;
+        }
+    }
+    if (own_ticket)
+        ticket = own_ticket;
+
+    handle->queue_position = 0;
+    for (const ClientState* client_state = handle->client_states; client_state != end_state; client_state++) {
+        if (is_own_state(client_state))
+            continue;
+        for (int lock_index = 0; lock_index < n_locks; lock_index++) {
+            if (is_conflicting(client_state, locks + lock_index, ticket, is_upgrading, handle->narwhal.policy)) {
+                handle->queue_position++;
+                break;
+            }
+        }
     }
+    bool is_granted = handle->queue_position == 0;
 
-    if (client_state == end_state) {
+    for (int lock_index = 0; lock_index < n_locks; lock_index++) {
+        const ClientState* client_state = find_own_state(handle, lock_name(locks + lock_index));
+        if (client_state) {
+            if (client_state->is_granted || client_state->is_write_lock != locks[lock_index].is_write_lock
+                || client_state->is_intent != locks[lock_index].is_intent) {
+                errno = ENOTSUP;
+                return -1;
+            }
+            n_own_states--;
+        }
+    }
+    if (n_own_states > 0) {  // We have requests for some other set of locks.
         errno = ENOTSUP;
         return -1;
     }
 
+    handle->client_states = reserve(
+        handle->client_states, &handle->client_states_capacity, handle->n_client_states + n_locks, sizeof(ClientState));
+
+    long long now = state_time_msec();
+    for (int lock_index = 0; lock_index < n_locks; lock_index++) {
+        ClientState* client_state = find_own_state(handle, lock_name(locks + lock_index));
+        if (!client_state) {
+            client_state = add_own_state(handle, locks + lock_index, ticket, now);
+            client_state->is_granted = is_granted;
+            if (is_granted)
+                TRACE(handle, NARWHAL_TRACE_GRANTED, client_state);
+            continue;
+        }
+
+        if (is_granted) {
+            TRACE(handle, NARWHAL_TRACE_GRANTED, client_state);
+            client_state->is_granted = true;
+            client_state->is_upgrading = false;
+            client_state->is_dirty = true;
+            handle->client_states_changed = true;
+        }
+
+        if (is_granted || now - client_state->time >= renew_granularity_msec(handle)) {
+            client_state->time = now;
+            client_state->is_dirty = true;
+            handle->client_states_changed = true;
+            DEBUG_EXP(client_state->time, "%lld (renew request)");
+        } else {
+            DEBUG_EXP(client_state->time, "%lld (current request)");
+        }
+    }
+
+    handle->own_time = clock_msec();
+    if (handle->client_states_changed && dump_client_states(handle) < 0)
+        return -1;
+
+    DEBUG_EXP(is_granted, "%d");
+    return is_granted;
+}
+
+// Delete a state from the client_states (freeing its record if using the fixed format). Releasing a granted write lock
+// starts a new write generation.
+static void
+delete_client_state(Handle* handle, ClientState* client_state) {
+    if (client_state->is_granted && client_state->is_write_lock)
+        handle->write_generation++;
+    if (client_state->slot >= 0) {
+        handle->free_slots[handle->n_free_slots].slot = client_state->slot;
+        handle->free_slots[handle->n_free_slots++].is_dirty = true;
+    }
+    ClientState* end_state = handle->client_states + handle->n_client_states;
+    if (is_own_state(client_state))
+        handle->n_own_states--;
     memmove(client_state, client_state + 1, (end_state - client_state - 1) * sizeof(ClientState));
+    handle->n_client_states--;
+    handle->client_states_changed = true;
+    handle->is_generation_changed = true;
+}
+
+// Delete all the states of the current process from the client_states. Returns whether there were any.
+static bool
+delete_own_states(Handle* handle) {
+    bool did_delete = false;
+    ClientState* client_state = handle->client_states;
+    while (client_state != handle->client_states + handle->n_client_states) {
+        if (is_own_state(client_state)) {
+            TRACE(handle, NARWHAL_TRACE_RELEASED, client_state);
+            delete_client_state(handle, client_state);
+            did_delete = true;
+        } else {
+            client_state++;
+        }
+    }
+    if (did_delete && handle->narwhal.wakeup)
+        handle->should_wake = true;
+    return did_delete;
+}
+
+// Update the client_states to remove the requests of the current process (which must exist and be granted).
+static int
+remove_lock(Handle* handle) {
+    DEBUG_AT("remove_lock");
+    if (!delete_own_states(handle)) {
+        errno = ENOTSUP;
+        return -1;
+    }
 
-    if (dump_client_states() < 0)
+    if (dump_client_states(handle) < 0)
         return -1;
 
     return 0;
 }
 
-// Implement narwhal_unlock. See the header file.
-int
-narwhal_unlock(const Narwhal* narwhal) {
-    init();
-    DEBUG_AT("narwhal_unlock");
-    for (;;) {
-        if (exclusive_lock(narwhal) < 0)
-            return -1;
-        int result = load_client_states(narwhal) < 0 ? -1 : remove_lock(narwhal);
-        if (exclusive_unlock(narwhal) < 0 || result < 0)
-            return -1;
+// Update the client_states to withdraw the pending requests of the current process (if any).
+static int
+withdraw_request(Handle* handle) {
+    DEBUG_AT("withdraw_request");
+    if (!delete_own_states(handle))
         return 0;
+
+    if (dump_client_states(handle) < 0)
+        return -1;
+
+    return 0;
+}
+
+// Whether some other client has a pending write request for some lock.
+static bool
+has_pending_writer(const Handle* handle, const char* name) {
+    const ClientState* end_state = handle->client_states + handle->n_client_states;
+    for (const ClientState* client_state = handle->client_states; client_state != end_state; client_state++) {
+        if (client_state->is_write_lock && !client_state->is_granted && !strcmp(client_state->name, name))
+            return true;
     }
+    return false;
+}
+
+// Update the client_states to renew the granted requests of the current process. If this is an idle read lease (of the
+// unnamed lock), it is released instead if some other client is waiting for a write lock. Returns -1 on error, 0 if
+// the requests were lost (or released), and 1 if they were renewed.
+static int
+renew_request(Handle* handle, bool is_idle_lease) {
+    DEBUG_AT("renew_request");
+    long long now = state_time_msec();
+    int result = 0;
+    ClientState* end_state = handle->client_states + handle->n_client_states;
+    for (ClientState* client_state = handle->client_states; client_state != end_state; client_state++) {
+        if (!is_own_state(client_state) || !client_state->is_granted)
+            continue;
+        result = 1;
+        if (client_state->time != now) {
+            client_state->time = now;
+            client_state->is_dirty = true;
+            handle->client_states_changed = true;
+        }
+    }
+
+    if (!result) {
+        DEBUG_AT("lost request");
+    } else if (is_idle_lease && has_pending_writer(handle, "")) {
+        DEBUG_AT("release lease");
+        delete_own_states(handle);
+        result = 0;
+    } else {
+        handle->own_time = clock_msec();
+    }
+
+    if (handle->client_states_changed && dump_client_states(handle) < 0)
+        return -1;
+    return result;
+}
+
+// Find the granted request of the current process for the unnamed lock, if this is all it holds.
+static ClientState*
+find_held_lock(Handle* handle) {
+    ClientState* held_state = NULL;
+    ClientState* end_state = handle->client_states + handle->n_client_states;
+    for (ClientState* client_state = handle->client_states; client_state != end_state; client_state++) {
+        if (!is_own_state(client_state))
+            continue;
+        if (held_state || !client_state->is_granted || client_state->is_intent || *client_state->name)
+            return NULL;
+        held_state = client_state;
+    }
+    return held_state;
+}
+
+// Whether some other client is upgrading its read lock of the unnamed lock.
+static bool
+has_other_upgrader(const Handle* handle) {
+    const ClientState* end_state = handle->client_states + handle->n_client_states;
+    for (const ClientState* client_state = handle->client_states; client_state != end_state; client_state++) {
+        if (client_state->is_upgrading && !*client_state->name && !is_own_state(client_state))
+            return true;
+    }
+    return false;
+}
+
+// Change the mode of our own request, marking it as modified (and as a new generation, since this changes which
+// requests conflict with it).
+static void
+change_own_state(Handle* handle, ClientState* client_state, bool is_write_lock, bool is_granted) {
+    client_state->is_write_lock = is_write_lock;
+    client_state->is_granted = is_granted;
+    client_state->is_upgrading = is_write_lock && !is_granted;
+    client_state->is_dirty = true;
+    handle->client_states_changed = true;
+    handle->is_generation_changed = true;
+}
+
+// Update the client_states to turn the granted read lock of the current process into an upgrading write request. This
+// keeps its ticket, so it is ahead of every request which arrived after we got the read lock, and since it still
+// conflicts with every other request, no writer can sneak in before it is granted. If two readers upgraded at once,
+// each would wait for the other forever, so this fails with EDEADLK if some other client is already upgrading (leaving
+// our read lock as it was). In the slot protocol there is no lockfile to serialize this check, so after publishing our
+// upgrade we look again, and back off if some other client is also upgrading (possibly both of us do).
+static int
+upgrade_request(Handle* handle) {
+    DEBUG_AT("upgrade_request");
+    ClientState* client_state = find_held_lock(handle);
+    if (!client_state || client_state->is_write_lock) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    if (has_other_upgrader(handle)) {
+        errno = EDEADLK;
+        return -1;
+    }
+
+    change_own_state(handle, client_state, true, false);
+    TRACE(handle, NARWHAL_TRACE_REQUESTED, client_state);
+    if (dump_client_states(handle) < 0)
+        return -1;
+    if (!is_slot_protocol(handle))
+        return 0;
+
+    if (load_client_states(handle) < 0)
+        return -1;
+    if (!has_other_upgrader(handle))
+        return 0;
+    client_state = find_own_state(handle, "");
+    if (client_state) {
+        change_own_state(handle, client_state, false, true);
+        if (dump_client_states(handle) < 0)
+            return -1;
+    }
+    errno = EDEADLK;
+    return -1;
+}
+
+// Update the client_states to turn the granted write lock of the current process into a granted read lock. This keeps
+// its ticket, so any readers queued right behind it are granted in their next round.
+static int
+downgrade_request(Handle* handle) {
+    DEBUG_AT("downgrade_request");
+    ClientState* client_state = find_held_lock(handle);
+    if (!client_state || !client_state->is_write_lock) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    change_own_state(handle, client_state, false, true);
+    handle->write_generation++;
+    handle->should_wake = handle->narwhal.wakeup;
+    return dump_client_states(handle);
+}
+
+// Initialize a backoff state using the parameters given in the Narwhal.
+static void
+backoff_init(Backoff* backoff, const Narwhal* narwhal) {
+    backoff->sleep_usec = narwhal->spin_usec;
+    backoff->max_sleep_usec = narwhal->max_spin_usec > narwhal->spin_usec ? narwhal->max_spin_usec : narwhal->spin_usec;
+    backoff->growth = narwhal->spin_growth > 1 ? narwhal->spin_growth : 2;
+    backoff->jitter = narwhal->spin_jitter < 0 ? 0 : narwhal->spin_jitter > 1 ? 1 : narwhal->spin_jitter;
+
+    // Seed the random generator so that different processes (and different waits) will not sleep in lockstep.
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    backoff->random_state = ((unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec)
+                          ^ ((unsigned long long)getpid() << 32) ^ (unsigned long long)(size_t)backoff;
+    if (!backoff->random_state)
+        backoff->random_state = 1;
+}
+
+// Return a pseudo-random number between 0 (inclusive) and 1 (exclusive). This uses xorshift64* which is more than good
+// enough for jitter, and keeps the state in the backoff so we don't mess with the global rand() state of the process.
+static double
+backoff_random(Backoff* backoff) {
+    backoff->random_state ^= backoff->random_state >> 12;
+    backoff->random_state ^= backoff->random_state << 25;
+    backoff->random_state ^= backoff->random_state >> 27;
+    return ((backoff->random_state * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Return the current sleep duration (with jitter), and increase the duration of the next sleep.
+static long long
+backoff_delay(Backoff* backoff) {
+    long long sleep_usec = backoff->sleep_usec * (1 - backoff->jitter * backoff_random(backoff));
+    DEBUG_EXP(sleep_usec, "%lld");
+
+    backoff->sleep_usec *= backoff->growth;
+    if (backoff->sleep_usec > backoff->max_sleep_usec)
+        backoff->sleep_usec = backoff->max_sleep_usec;
+
+    return sleep_usec;
+}
+
+// Sleep for some number of microseconds.
+static void
+sleep_usec(long long usec) {
+    const struct timespec duration = { .tv_sec = usec / 1000000, .tv_nsec = (usec % 1000000) * 1000 };
+    nanosleep(&duration, NULL);
+}
+
+// Sleep for the current duration (with jitter), and increase the duration of the next sleep.
+static void
+backoff_sleep(Backoff* backoff) {
+    sleep_usec(backoff_delay(backoff));
+}
+
+// Break an abandoned lockfile. Renaming it is atomic, so if several clients try this at once, only one of them will
+// succeed. However, between seeing the abandoned lockfile and renaming it, its holder may have released it and some
+// (live) client, possibly the same one, may have got it. We can tell this happened by the inode of the renamed file
+// (since each client alternates between two private files, see link_path), in which case we link it back. This is
+// fooled if the holder got the lockfile twice more in the meantime, linking the inode we saw again. And if yet another
+// client got the lockfile while it was missing, we can't restore it; we back off and leave it to the new holder, and
+// the live client we took it from is left believing it holds it too. These are the remaining races (see the
+// timeout_sec parameter); each requires full lockfile cycles to happen in the few microseconds between two NFS
+// operations.
+static int
+break_lockfile(Handle* handle, ino_t ino) {
+    DEBUG_AT("break_lockfile");
+    if (syscalls.rename(handle->lockfile_path, handle->broken_path) < 0)
+        return errno == ENOENT ? 0 : -1;  // Someone else broke (or released) it first.
+
+    struct stat stbuf;
+    int result = syscalls.stat(handle->broken_path, &stbuf);
+    if (result == 0 && stbuf.st_ino != ino) {
+        DEBUG_AT("restore lockfile");
+        result = syscalls.link(handle->broken_path, handle->lockfile_path);
+        if (result < 0 && errno == EEXIST) {
+            DEBUG_AT("lockfile taken while broken");
+            result = 0;  // The next watch_lockfile will give the new holder a full timeout.
+        }
+    } else if (result == 0) {
+        handle->stats.lockfile_breaks++;
+        TRACE(handle, NARWHAL_TRACE_LOCKFILE_BROKEN, NULL);
+    }
+
+    int base_errno = errno;
+    syscalls.unlink(handle->broken_path);
+    errno = base_errno;
+    return result;
+}
+
+// Check whether the lockfile we failed to get was abandoned, and if so, break it. We only look at the lockfile again
+// once it is held for the timeout, so this costs a single NFS operation per timeout (on top of the failed links).
+static int
+watch_lockfile(Handle* handle, LockfileWatch* watch) {
+    long long now = clock_msec();
+    if (watch->since && now - watch->since < timeout_msec_of(&handle->narwhal))
+        return 0;
+
+    struct stat stbuf;
+    if (syscalls.stat(handle->lockfile_path, &stbuf) < 0) {
+        watch->since = 0;
+        return errno == ENOENT ? 0 : -1;  // It was released in the meantime.
+    }
+    if (watch->since && stbuf.st_ino == watch->ino && stbuf.st_ctim.tv_sec == watch->ctime.tv_sec
+        && stbuf.st_ctim.tv_nsec == watch->ctime.tv_nsec) {
+        watch->since = 0;
+        return break_lockfile(handle, watch->ino);
+    }
+
+    watch->ino = stbuf.st_ino;
+    watch->ctime = stbuf.st_ctim;
+    watch->since = now;
+    return 0;
+}
+
+// Try once to get an exclusive lock of the state file. Returns -1 on error, 0 if some other client holds it, and 1 if
+// we got it. If the same client holds it for longer than the timeout, we assume it died without removing the lockfile,
+// and break it (see watch_lockfile), so the next attempt will get it. The watch tracks this between attempts (and must
+// initially be zeroed).
+static int
+try_exclusive_lock(Handle* handle, LockfileWatch* watch) {
+    if (is_slot_protocol(handle))  // Each client only writes its own request file.
+        return 1;
+
+    int base_errno = errno;
+    handle->stats.link_attempts++;
+    handle->lockfile_time = clock_msec();
+    if (!syscalls.link(link_path(handle), handle->lockfile_path)) {
+        errno = base_errno;  // Do not leak the errors of failed attempts.
+        watch->since = 0;
+        return 1;
+    }
+    handle->stats.link_failures++;
+    if (errno == ENOENT && create_private_file(link_path(handle)) < 0)  // Someone cleaned up the lockdir.
+        return -1;
+
+    // If the NFS reply to our link was lost, the retransmitted request may fail with EEXIST even though the link was
+    // done. The only way to know is to check whether our private file now has two links.
+    struct stat stbuf;
+    if (errno == EEXIST && syscalls.stat(link_path(handle), &stbuf) == 0 && stbuf.st_nlink == 2) {
+        DEBUG_AT("retransmitted link");
+        errno = base_errno;
+        watch->since = 0;
+        return 1;
+    }
+
+    TRACE(handle, NARWHAL_TRACE_LOCKFILE_CONTENDED, NULL);
+    if (watch_lockfile(handle, watch) < 0)
+        return -1;
+    errno = base_errno;
+    return 0;
+}
+
+// Get an exclusive lock of the state file. This must be done before loading it. This just spins trying to create the
+// lock (see try_exclusive_lock).
+static int
+exclusive_lock(Handle* handle) {
+    DEBUG_AT("exclusive_lock");
+    LockfileWatch lockfile_watch = { .since = 0 };
+    long long start_usec = 0;
+
+    Backoff backoff;
+    backoff_init(&backoff, &handle->narwhal);
+    for (;;) {
+        int result = try_exclusive_lock(handle, &lockfile_watch);
+        if (result) {
+            if (start_usec)
+                handle->stats.lockfile_wait_usec += clock_usec() - start_usec;
+            return result < 0 ? -1 : 0;
+        }
+        if (!start_usec)
+            start_usec = clock_usec();
+        handle->stats.lockfile_spins++;
+        backoff_sleep(&backoff);
+    }
+}
+
+// Whether a pending request of some other client would be granted in its next round. Ties between equal tickets of
+// different clients (only possible in the slot protocol) are broken by our identity rather than theirs, but since this
+// is only used for sending hints, it doesn't matter.
+static bool
+is_unblocked(const Handle* handle, const ClientState* waiter) {
+    const NarwhalNamedLock named_lock
+        = { .name = waiter->name, .is_write_lock = waiter->is_write_lock, .is_intent = waiter->is_intent };
+    const ClientState* end_state = handle->client_states + handle->n_client_states;
+    for (const ClientState* client_state = handle->client_states; client_state != end_state; client_state++) {
+        if (client_state != waiter
+            && is_conflicting(client_state, &named_lock, waiter->ticket, waiter->is_upgrading, handle->narwhal.policy))
+            return false;
+    }
+    return true;
+}
+
+// Send a wakeup hint to the waiter advertised in some wake file (if it exists). The file contains the host name and
+// the UDP port the waiter listens on.
+static void
+send_wakeup(Handle* handle, const char* wake_path) {
+    int wake_fd = syscalls.open(wake_path, O_RDONLY, 0);
+    if (wake_fd < 0)
+        return;
+    char text[1100];
+    ssize_t size = syscalls.read(wake_fd, text, sizeof(text) - 1);
+    syscalls.close(wake_fd);
+    if (size <= 0)
+        return;
+    text[size] = '\0';
+
+    char address_host[1025];
+    char port[16];
+    if (sscanf(text, "%1024s %15s", address_host, port) != 2)
+        return;
+    const struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_DGRAM };
+    struct addrinfo* addresses;
+    if (getaddrinfo(address_host, port, &hints, &addresses) != 0)
+        return;
+
+    int send_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (send_fd >= 0) {
+        if (sendto(send_fd, "wake\n", 5, MSG_DONTWAIT, addresses->ai_addr, addresses->ai_addrlen) == 5)
+            handle->stats.wakeups_sent++;
+        close(send_fd);
+    }
+    freeaddrinfo(addresses);
+}
+
+// Send wakeup hints to the waiters which may be granted now that we removed (or downgraded) our requests. This is done
+// when the exclusive section ends, so they can get the lockfile right away. Each hint costs reading the wake file of
+// the waiter. Errors are ignored, since the waiters will poll the state file anyway.
+static void
+wake_waiters(Handle* handle) {
+    DEBUG_AT("wake_waiters");
+    int base_errno = errno;
+    handle->should_wake = false;
+    const ClientState* end_state = handle->client_states + handle->n_client_states;
+    for (const ClientState* client_state = handle->client_states; client_state != end_state; client_state++) {
+        if (client_state->is_granted || is_own_state(client_state) || !is_unblocked(handle, client_state))
+            continue;
+        format_path(&handle->slot_path,
+                    &handle->slot_path_capacity,
+                    handle->lockdir,
+                    "/",
+                    client_state->host_name,
+                    ".",
+                    client_state->pid,
+                    ".wake",
+                    NULL);
+        send_wakeup(handle, handle->slot_path);
+    }
+    errno = base_errno;
+}
+
+// Release the exclusive lock of the state file. We keep the private files for the next time, switching to the other
+// one (see link_path).
+static int
+exclusive_unlock(Handle* handle) {
+    int lockfile_result = 0;
+    if (!is_slot_protocol(handle)) {
+        int base_errno = errno;
+        errno = 0;
+        DEBUG_AT("exclusive_unlock");
+        if (!is_lockfile_broken(handle)) {
+            lockfile_result = syscalls.unlink(handle->lockfile_path);  // Otherwise, it may be held by someone else.
+        } else {
+            errno = ETIMEDOUT;
+            lockfile_result = -1;
+        }
+        handle->is_alternate = !handle->is_alternate;
+        if (base_errno != 0)
+            errno = base_errno;
+    }
+
+    if (handle->should_wake)
+        wake_waiters(handle);
+    return lockfile_result;
+}
+
+// Whether we are listening for wakeup hints (see listen_wakeups).
+static bool
+is_listening(const Handle* handle) {
+    return handle->wake_fd >= 0 && handle->wake_pid == getpid();
+}
+
+// Start listening for wakeup hints, by binding a UDP socket to some free port, and advertising it (with the real host
+// name, which the other clients can resolve) in our wake file. We keep listening until the handle is closed.
+static int
+listen_wakeups(Handle* handle) {
+    DEBUG_AT("listen_wakeups");
+    if (handle->wake_fd >= 0) {
+        close(handle->wake_fd);  // This socket belongs to the parent process we were forked from.
+        handle->wake_fd = -1;
+    }
+
+    int wake_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (wake_fd < 0)
+        return -1;
+
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_ANY) };
+    socklen_t address_size = sizeof(address);
+    char address_host[1025];
+    size_t size = 0;
+    if (bind(wake_fd, (const struct sockaddr*)&address, sizeof(address)) < 0
+        || getsockname(wake_fd, (struct sockaddr*)&address, &address_size) < 0
+        || gethostname(address_host, sizeof(address_host)) < 0
+        || dump_line(handle, &size, "%s %d\n", address_host, ntohs(address.sin_port)) < 0
+        || write_dump_text(handle, size, handle->wake_path) < 0) {
+        int base_errno = errno;
+        close(wake_fd);
+        errno = base_errno;
+        return -1;
+    }
+
+    handle->wake_fd = wake_fd;
+    handle->wake_pid = getpid();
+    return 0;
+}
+
+// Sleep for some number of microseconds, or until we receive a wakeup hint (if we are listening for them).
+static void
+sleep_or_wake(Handle* handle, long long usec) {
+    if (!is_listening(handle)) {
+        sleep_usec(usec);
+        return;
+    }
+
+    int base_errno = errno;
+    struct pollfd pollfd = { .fd = handle->wake_fd, .events = POLLIN };
+    poll(&pollfd, 1, (usec + 999) / 1000);
+    char buffer[64];
+    while (recv(handle->wake_fd, buffer, sizeof(buffer), MSG_DONTWAIT) >= 0)
+        handle->stats.wakeups_received++;
+    errno = base_errno;
+}
+
+// Extend our read lease after obtaining or renewing our request.
+static void
+extend_lease(Handle* handle) {
+    long long timeout_msec = timeout_msec_of(&handle->narwhal);
+    long long max_lease_msec = timeout_msec - (timeout_msec >= 2000 ? 1000 : timeout_msec / 2);
+    long long lease_msec = handle->narwhal.read_lease_sec * 1000LL;
+    if (lease_msec > max_lease_msec)
+        lease_msec = max_lease_msec;
+    handle->lease_until = handle->own_time + lease_msec;
+}
+
+// Mark the read lock we just obtained (or renewed) as an active lease. We can resume it without looking at the state
+// file until either it is changed, or until the lease ages out (which must be sufficiently before our request becomes
+// stale).
+static void
+start_lease(Handle* handle) {
+    extend_lease(handle);
+    handle->lease_state = LEASE_ACTIVE;
+}
+
+// Resume an idle read lease. Returns -1 on error, 0 if the lease was lost or released (so the caller must obtain a read
+// lock in the normal way), and 1 if we have the read lock again.
+static int
+resume_lease(Handle* handle) {
+    DEBUG_AT("resume_lease");
+    if (clock_msec() < handle->lease_until && !is_state_version_changed(handle, &handle->lease_version)) {
+        handle->lease_state = LEASE_ACTIVE;
+        return 1;
+    }
+
+    handle->lease_state = LEASE_NONE;
+    handle->is_holding = false;
+    if (exclusive_lock(handle) < 0)
+        return -1;
+    int result = load_client_states(handle) < 0 ? -1 : renew_request(handle, true);
+    if (result > 0 && snapshot_state_version(handle, &handle->lease_version) < 0)
+        result = -1;
+    if (exclusive_unlock(handle) < 0 || result < 0)
+        return -1;
+    if (result) {
+        handle->is_holding = true;
+        start_lease(handle);
+    }
+    return result;
+}
+
+// Really release an idle read lease. Returns -1 on error and 0 on success.
+static int
+release_lease(Handle* handle) {
+    DEBUG_AT("release_lease");
+    handle->lease_state = LEASE_NONE;
+    handle->is_holding = false;
+    if (exclusive_lock(handle) < 0)
+        return -1;
+    int result = load_client_states(handle) < 0 ? -1 : withdraw_request(handle);
+    if (exclusive_unlock(handle) < 0 || result < 0)
+        return -1;
+    return 0;
+}
+
+// Signals the heartbeat thread that some handle needs it. This uses the handles_mutex.
+static pthread_cond_t heartbeat_cond = PTHREAD_COND_INITIALIZER;
+
+// Whether the heartbeat thread is running in this process (it is not inherited by forked child processes).
+static bool is_heartbeat_running = false;
+
+// The number of milliseconds between renewals of our granted requests by the heartbeat thread. This is frequent enough
+// that our requests never become stale even if one renewal is delayed.
+static long long
+heartbeat_interval(const Handle* handle) {
+    long long interval = timeout_msec_of(&handle->narwhal) / 3;
+    return interval > 0 ? interval : 1;
+}
+
+// The number of milliseconds until the heartbeat thread tries again to renew our granted requests, if it failed (or
+// the handle was busy).
+static long long
+heartbeat_retry_interval(const Handle* handle) {
+    long long interval = heartbeat_interval(handle) / 4;
+    return interval < 1 ? 1 : interval < 1000 ? interval : 1000;
+}
+
+// Renew our granted request if needed, on behalf of the heartbeat thread (which locked the handle). An idle read lease
+// is released instead if some other client is waiting for a write lock, and a deferred unlock is completed. Returns the
+// time the heartbeat thread should look at the handle again (zero if never).
+static long long
+heartbeat(Handle* handle) {
+    if (handle->is_unlock_pending) {
+        finish_unlock(handle);
+        return 0;
+    }
+    if (!handle->is_holding || !handle->narwhal.heartbeat)
+        return 0;
+
+    long long now = clock_msec();
+    long long next_time = handle->own_time + heartbeat_interval(handle);
+    if (now < next_time)
+        return next_time;
+
+    DEBUG_AT("heartbeat");
+    if (exclusive_lock(handle) < 0)
+        return now + heartbeat_retry_interval(handle);
+    int result = load_client_states(handle) < 0 ? -1 : renew_request(handle, handle->lease_state == LEASE_IDLE);
+    if (result > 0 && handle->lease_state != LEASE_NONE && snapshot_state_version(handle, &handle->lease_version) < 0)
+        result = -1;
+    if (exclusive_unlock(handle) < 0 || result < 0)
+        return now + heartbeat_retry_interval(handle);
+
+    if (!result) {
+        // If the lock was in use, the following narwhal_unlock will fail with ENOTSUP.
+        handle->lease_state = LEASE_NONE;
+        handle->is_holding = false;
+        return 0;
+    }
+
+    if (handle->lease_state != LEASE_NONE)
+        extend_lease(handle);
+    return handle->own_time + heartbeat_interval(handle);
+}
+
+// The heartbeat thread renews the granted requests of all the handles using the heartbeat option. It skips handles
+// which are busy (locked by another thread), since whatever operation is using them takes care of the request.
+static void*
+heartbeat_main(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&handles_mutex);
+    for (;;) {
+        long long now = clock_msec();
+        long long next_time = 0;
+        Handle* due_handle = NULL;
+        for (Handle* handle = handles; handle && !due_handle; handle = handle->next) {
+            if (handle->heartbeat_time && handle->heartbeat_time <= now)
+                due_handle = handle;
+            else if (handle->heartbeat_time && (!next_time || handle->heartbeat_time < next_time))
+                next_time = handle->heartbeat_time;
+        }
+
+        if (due_handle && pthread_mutex_trylock(&due_handle->mutex)) {
+            due_handle->heartbeat_time = now + heartbeat_retry_interval(due_handle);
+        } else if (due_handle) {
+            pthread_mutex_unlock(&handles_mutex);
+            next_time = heartbeat(due_handle);
+            publish_stats(due_handle);
+            pthread_mutex_lock(&handles_mutex);
+            due_handle->heartbeat_time = next_time;
+            pthread_mutex_unlock(&due_handle->mutex);
+        } else if (next_time) {
+            // The condition uses CLOCK_REALTIME, but we only use it to wait for (about) the right duration.
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            long long until_nsec = until.tv_nsec + (next_time - now) * 1000000LL;
+            until.tv_sec += until_nsec / 1000000000;
+            until.tv_nsec = until_nsec % 1000000000;
+            pthread_cond_timedwait(&heartbeat_cond, &handles_mutex, &until);
+        } else {
+            pthread_cond_wait(&heartbeat_cond, &handles_mutex);
+        }
+    }
+    return NULL;
+}
+
+// Prepare for forking by ensuring the handles_mutex is not held by the heartbeat thread.
+static void
+heartbeat_prepare_fork() {
+    pthread_mutex_lock(&handles_mutex);
+}
+
+// Resume after forking (in the parent process).
+static void
+heartbeat_parent_fork() {
+    pthread_mutex_unlock(&handles_mutex);
+}
+
+// Resume after forking (in the child process). The heartbeat thread is not inherited, and neither are the requests we
+// held (they belong to the parent process). The heartbeat thread may have been holding the mutex of some handle, or
+// waiting on the condition (which would make signaling it hang in the child).
+static void
+heartbeat_child_fork() {
+    is_heartbeat_running = false;
+    pthread_cond_init(&heartbeat_cond, NULL);
+    for (Handle* handle = handles; handle; handle = handle->next) {
+        pthread_mutex_init(&handle->mutex, NULL);
+        pthread_cond_init(&handle->shared_cond, NULL);
+        handle->is_holding = false;
+        handle->is_unlock_pending = false;
+        handle->heartbeat_time = 0;
+    }
+    pthread_mutex_unlock(&handles_mutex);
+}
+
+// Start the heartbeat thread if it is not already running.
+static int
+start_heartbeat() {
+    pthread_mutex_lock(&handles_mutex);
+    int result = 0;
+    if (!is_heartbeat_running) {
+        static bool did_register = false;
+        if (!did_register) {
+            pthread_atfork(heartbeat_prepare_fork, heartbeat_parent_fork, heartbeat_child_fork);
+            did_register = true;
+        }
+
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        pthread_t thread;
+        errno = pthread_create(&thread, &attr, heartbeat_main, NULL);
+        pthread_attr_destroy(&attr);
+        if (errno)
+            result = -1;
+        else
+            is_heartbeat_running = true;
+    }
+    pthread_mutex_unlock(&handles_mutex);
+    return result;
+}
+
+// Tell the heartbeat thread when to renew the request we were just granted.
+static void
+schedule_heartbeat(Handle* handle) {
+    pthread_mutex_lock(&handles_mutex);
+    handle->heartbeat_time = handle->own_time + heartbeat_interval(handle);
+    pthread_cond_signal(&heartbeat_cond);
+    pthread_mutex_unlock(&handles_mutex);
+}
+
+// Whether a (CLOCK_REALTIME) deadline has passed.
+static bool
+is_past(const struct timespec* deadline) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec > deadline->tv_sec || (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec);
+}
+
+// Count an obtained lock in the statistics.
+static void
+count_acquired(Handle* handle, const LockRequest* request) {
+    unsigned long long latency_usec = clock_usec() - request->start_usec;
+    int bucket = 0;
+    while (latency_usec > 0 && bucket < NARWHAL_LATENCY_BUCKETS - 1) {
+        latency_usec >>= 1;
+        bucket++;
+    }
+    handle->stats.locks_acquired++;
+    handle->stats.acquire_latency_histogram[bucket]++;
+}
+
+// Connect to the local coordinator daemon.
+static int
+connect_coordinator(Handle* handle) {
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(handle->narwhal.coordinator) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(address.sun_path, handle->narwhal.coordinator);
+
+    if (!handle->coordinator_lockdir && !(handle->coordinator_lockdir = realpath(handle->lockdir, NULL)))
+        return -1;
+
+    int coordinator_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (coordinator_fd < 0)
+        return -1;
+    if (connect(coordinator_fd, (const struct sockaddr*)&address, sizeof(address)) < 0) {
+        int base_errno = errno;
+        close(coordinator_fd);
+        errno = base_errno;
+        return -1;
+    }
+
+    handle->coordinator_fd = coordinator_fd;
+    handle->coordinator_pid = getpid();
+    return 0;
+}
+
+// Drop the connection to the local coordinator daemon, after it failed. The daemon releases any lock we held.
+static void
+disconnect_coordinator(Handle* handle) {
+    int base_errno = errno;
+    close(handle->coordinator_fd);
+    handle->coordinator_fd = -1;
+    errno = base_errno;
+}
+
+// Send a command (R for read lock, W for write lock, or U for unlock) to the local coordinator daemon, and wait for its
+// reply. We keep a connection per handle, so if we crash while holding a lock, the daemon notices the connection was
+// closed and releases it for us.
+static int
+coordinator_request(Handle* handle, char command) {
+    int base_errno = errno;
+    if (handle->coordinator_fd >= 0 && handle->coordinator_pid != getpid()) {
+        close(handle->coordinator_fd);  // This connection belongs to the parent process we were forked from.
+        handle->coordinator_fd = -1;
+    }
+    if (handle->coordinator_fd < 0 && connect_coordinator(handle) < 0)
+        return -1;
+
+    size_t size = 0;
+    if (dump_line(handle, &size, "%c %s\n", command, handle->coordinator_lockdir) < 0)
+        return -1;
+    for (size_t sent = 0; sent < size;) {
+        ssize_t result = send(handle->coordinator_fd, handle->dump_text + sent, size - sent, MSG_NOSIGNAL);
+        if (result < 0) {
+            disconnect_coordinator(handle);
+            return -1;
+        }
+        sent += result;
+    }
+
+    char reply[64];
+    size_t received = 0;
+    while (received == 0 || reply[received - 1] != '\n') {
+        ssize_t result = recv(handle->coordinator_fd, reply + received, 1, 0);
+        if (result <= 0) {
+            if (result == 0)
+                errno = ECONNRESET;
+            disconnect_coordinator(handle);
+            return -1;
+        }
+        if (++received == sizeof(reply))
+            break;
+    }
+    bool is_complete = reply[received - 1] == '\n';
+    reply[received - 1] = '\0';
+
+    int result, reply_errno;
+    if (!is_complete || sscanf(reply, "%d %d", &result, &reply_errno) != 2) {
+        errno = EPROTO;
+        disconnect_coordinator(handle);
+        return -1;
+    }
+    errno = result < 0 ? reply_errno : base_errno;  // Do not leak the errors of successful calls (e.g. in realpath).
+    return result < 0 ? -1 : 0;
+}
+
+// Create the lock file of the shm backend. We initialize the lock in our temporary file and then link it into place,
+// so nobody ever sees an uninitialized lock; if several clients do this at once, all but one of the links fail, and
+// everyone uses the winner's lock.
+static int
+create_shm_lock(Handle* handle) {
+    DEBUG_AT("create_shm_lock");
+    int temp_fd = syscalls.open(handle->temp_path, O_CREAT | O_TRUNC | O_RDWR, 0777);
+    if (temp_fd < 0)
+        return -1;
+    pthread_rwlock_t* shm_lock = MAP_FAILED;
+    if (ftruncate(temp_fd, sizeof(pthread_rwlock_t)) == 0)
+        shm_lock = mmap(NULL, sizeof(pthread_rwlock_t), PROT_READ | PROT_WRITE, MAP_SHARED, temp_fd, 0);
+    int result = shm_lock == MAP_FAILED ? -1 : 0;
+    if (result == 0) {
+        pthread_rwlockattr_t attr;
+        pthread_rwlockattr_init(&attr);
+        pthread_rwlockattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+#ifdef __GLIBC__
+        pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+        pthread_rwlock_init(shm_lock, &attr);
+        pthread_rwlockattr_destroy(&attr);
+        munmap(shm_lock, sizeof(pthread_rwlock_t));
+    }
+    if (syscalls.close(temp_fd) < 0)
+        result = -1;
+    if (result == 0 && syscalls.link(handle->temp_path, handle->local_path) < 0 && errno != EEXIST)
+        result = -1;
+
+    int base_errno = errno;
+    syscalls.unlink(handle->temp_path);
+    errno = base_errno;
+    return result;
+}
+
+// Open the lock file of a local backend (creating it if needed), when first obtaining a lock.
+static int
+open_local_lock(Handle* handle) {
+    DEBUG_EXP(handle->local_path, "%s (open local lock)");
+    int base_errno = errno;
+    if (handle->backend == NARWHAL_FCNTL_BACKEND) {
+        handle->local_fd = syscalls.open(handle->local_path, O_CREAT | O_RDWR, 0777);
+        return handle->local_fd < 0 ? -1 : 0;
+    }
+
+    int local_fd = syscalls.open(handle->local_path, O_RDWR, 0);
+    if (local_fd < 0 && errno == ENOENT && create_shm_lock(handle) == 0)
+        local_fd = syscalls.open(handle->local_path, O_RDWR, 0);
+    if (local_fd < 0)
+        return -1;
+    pthread_rwlock_t* shm_lock = mmap(NULL, sizeof(pthread_rwlock_t), PROT_READ | PROT_WRITE, MAP_SHARED, local_fd, 0);
+    int mmap_errno = errno;
+    syscalls.close(local_fd);  // The mapping remains valid.
+    if (shm_lock == MAP_FAILED) {
+        errno = mmap_errno;
+        return -1;
+    }
+    handle->shm_lock = shm_lock;
+    errno = base_errno;
+    return 0;
+}
+
+// Try once to get (or convert) the fcntl lock of the whole lock file. This does not wait if is_try, and fails with
+// EBUSY if someone else holds a conflicting lock.
+static int
+fcntl_lock(Handle* handle, short type, bool is_try) {
+    struct flock region = { .l_type = type, .l_whence = SEEK_SET, .l_start = 0, .l_len = 0 };
+    int result;
+    while ((result = fcntl(handle->local_fd, is_try ? F_SETLK : F_SETLKW, &region)) < 0 && errno == EINTR)
+        ;
+    if (result < 0 && (errno == EAGAIN || errno == EACCES))
+        errno = EBUSY;
+    return result;
+}
+
+// Obtain the lock using a local backend. The fcntl backend has no way to wait until a deadline, so we poll for it,
+// using the backoff parameters.
+static int
+local_lock(Handle* handle, bool is_write_lock, bool is_try, const struct timespec* deadline) {
+    if (handle->is_local_locked) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    if (handle->local_fd < 0 && !handle->shm_lock && open_local_lock(handle) < 0)
+        return -1;
+
+    LockRequest request;
+    request.start_usec = clock_usec();
+    int result = 0;
+    if (handle->backend == NARWHAL_FCNTL_BACKEND) {
+        short type = is_write_lock ? F_WRLCK : F_RDLCK;
+        if (deadline) {
+            int base_errno = errno;
+            Backoff backoff;
+            backoff_init(&backoff, &handle->narwhal);
+            while ((result = fcntl_lock(handle, type, true)) < 0 && errno == EBUSY) {
+                if (is_past(deadline)) {
+                    errno = ETIMEDOUT;
+                    break;
+                }
+                handle->stats.pending_spins++;
+                backoff_sleep(&backoff);
+            }
+            if (result == 0)
+                errno = base_errno;
+        } else {
+            result = fcntl_lock(handle, type, is_try);
+        }
+    } else {
+        int error;
+        if (is_try)
+            error = is_write_lock ? pthread_rwlock_trywrlock(handle->shm_lock)
+                                  : pthread_rwlock_tryrdlock(handle->shm_lock);
+        else if (deadline)
+            error = is_write_lock ? pthread_rwlock_timedwrlock(handle->shm_lock, deadline)
+                                  : pthread_rwlock_timedrdlock(handle->shm_lock, deadline);
+        else
+            error = is_write_lock ? pthread_rwlock_wrlock(handle->shm_lock) : pthread_rwlock_rdlock(handle->shm_lock);
+        if (error) {
+            errno = error;
+            result = -1;
+        }
+    }
+    if (result < 0)
+        return -1;
+
+    handle->is_local_locked = true;
+    count_acquired(handle, &request);
+    return 0;
+}
+
+// Release the lock of a local backend.
+static int
+local_unlock(Handle* handle) {
+    if (!handle->is_local_locked) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    handle->is_local_locked = false;
+    if (handle->backend == NARWHAL_FCNTL_BACKEND)
+        return fcntl_lock(handle, F_UNLCK, true);
+    int error = pthread_rwlock_unlock(handle->shm_lock);
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+// The (unnamed) locks used by the functions obtaining a single lock.
+static const NarwhalNamedLock unnamed_read_lock = { .name = NULL, .is_write_lock = false };
+static const NarwhalNamedLock unnamed_write_lock = { .name = NULL, .is_write_lock = true };
+
+// Initialize the state of a pending request for a set of locks.
+static void
+init_request(Handle* handle, LockRequest* request, const NarwhalNamedLock* locks, int n_locks) {
+    request->locks = locks;
+    request->n_locks = n_locks;
+    request->is_lease = false;
+    backoff_init(&request->backoff, &handle->narwhal);
+    request->next_round_time = 0;
+    request->lockfile_watch.since = 0;
+    request->is_lockfile_busy = false;
+    request->queue_position = 0;
+    request->did_listen = false;
+}
+
+// Start obtaining a set of locks. This takes care of an idle read lease, which is resumed if we are obtaining the
+// unnamed read lock again, and released otherwise. Returns -1 on error, 0 if the caller should go on to run rounds of
+// the request, and 1 if we already have the lock.
+static int
+begin_lock(Handle* handle, LockRequest* request, const NarwhalNamedLock* locks, int n_locks) {
+    if (handle->lease_state == LEASE_ACTIVE || handle->has_async_request || handle->narwhal.coordinator
+        || handle->backend != NARWHAL_NFS_BACKEND) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    request->start_usec = clock_usec();
+
+    if (handle->narwhal.heartbeat && start_heartbeat() < 0)
+        return -1;
+
+    bool is_unnamed_read_lock = n_locks == 1 && !locks->is_write_lock && !locks->is_intent && !*lock_name(locks);
+    if (handle->lease_state == LEASE_IDLE) {
+        int result = is_unnamed_read_lock ? resume_lease(handle) : release_lease(handle);
+        if (result > 0)
+            count_acquired(handle, request);
+        if (result > 0 && handle->narwhal.heartbeat)
+            schedule_heartbeat(handle);
+        if (result != 0)
+            return result;
+    }
+
+    init_request(handle, request, locks, n_locks);
+    request->is_lease = is_unnamed_read_lock && handle->narwhal.read_lease_sec > 0;
+    return 0;
+}
+
+// Take note that a request was granted (in the state file).
+static void
+finish_request(Handle* handle, LockRequest* request) {
+    handle->is_holding = true;
+    count_acquired(handle, request);
+    if (request->is_lease)
+        start_lease(handle);
+    if (handle->narwhal.heartbeat)
+        schedule_heartbeat(handle);
+}
+
+// Do one round of a pending lock request. While the request is pending, we only poll the version of the state file,
+// and only take the lockfile and re-run request_lock when it changes, when our own request needs to be renewed (before
+// it becomes stale), or when some other request becomes stale. We just try once to get the lockfile, so this never
+// sleeps.
+//
+// If is_final_round, we always re-run request_lock, waiting for the lockfile if needed, and if the request is still not
+// granted, we withdraw it (in the same exclusive section), so we leave nothing behind.
+//
+// Returns -1 on error, 0 if the request is (still) pending, and 1 if it was granted.
+static int
+lock_round(Handle* handle, LockRequest* request, bool is_final_round) {
+    if (!is_final_round && request->next_round_time && clock_msec() < request->next_round_time
+        && !is_state_version_changed(handle, &request->version))
+        return 0;
+
+    if (is_final_round) {
+        if (exclusive_lock(handle) < 0)
+            return -1;
+    } else {
+        int result = try_exclusive_lock(handle, &request->lockfile_watch);
+        request->is_lockfile_busy = result == 0;
+        if (result <= 0)
+            return result;
+    }
+
+    int result = load_client_states(handle) < 0 ? -1 : request_locks(handle, request->locks, request->n_locks);
+    if (result == 0 && is_final_round && withdraw_request(handle) < 0)
+        result = -1;
+    if (result == 0 && !is_final_round && snapshot_state_version(handle, &request->version) < 0)
+        result = -1;
+    if (result > 0 && request->is_lease && snapshot_state_version(handle, &handle->lease_version) < 0)
+        result = -1;
+    if (exclusive_unlock(handle) < 0 || result < 0)
+        return -1;
+
+    if (result) {
+        finish_request(handle, request);
+        return 1;
+    }
+
+    request->queue_position = handle->queue_position;
+
+    // Our requests need to be renewed after half the timeout, and the oldest request becomes stale once it is older
+    // than the timeout (as measured by the clock used in the state file).
+    long long now = clock_msec();
+    long long timeout_msec = timeout_msec_of(&handle->narwhal);
+    request->next_round_time = now + (timeout_msec + 1) / 2;
+    if (handle->oldest_time != LLONG_MAX) {
+        long long stale_time = now + handle->oldest_time + timeout_msec + 1 - state_time_msec();
+        if (stale_time < request->next_round_time)
+            request->next_round_time = stale_time;
+    }
+    return 0;
+}
+
+// The delay until the next round of a pending request. This is the backoff delay, scaled by the position of the request
+// in the queue, since requests are granted in order; the head of the queue polls fast, and the tail polls rarely, so
+// the load on the NFS server does not grow much with the length of the queue. This never exceeds a quarter of the
+// timeout, so a pending request is renewed well before it becomes stale. While waiting for the lockfile, we don't know
+// our position, so we just use the backoff delay.
+static long long
+round_delay(const Handle* handle, LockRequest* request) {
+    long long delay_usec = backoff_delay(&request->backoff);
+    if (request->is_lockfile_busy)
+        return delay_usec;
+
+    delay_usec *= 1 + request->queue_position;
+    long long max_delay_usec = timeout_msec_of(&handle->narwhal) * 250;
+    if (max_delay_usec > 0 && delay_usec > max_delay_usec)
+        delay_usec = max_delay_usec;
+    return delay_usec;
+}
+
+// Run rounds of a pending request until it is granted, sleeping between them.
+//
+// If is_try, we only do a single round, and if there is a deadline, we do a final round once it passes. If the final
+// round does not grant the request, we fail with EBUSY or ETIMEDOUT.
+static int
+wait_for_request(Handle* handle, LockRequest* request, bool is_try, const struct timespec* deadline) {
+    for (;;) {
+        bool is_final_round = is_try || (deadline && is_past(deadline));
+        int result = lock_round(handle, request, is_final_round);
+        if (result != 0)
+            return result < 0 ? -1 : 0;
+        if (is_final_round) {
+            errno = is_try ? EBUSY : ETIMEDOUT;
+            return -1;
+        }
+
+        // Once we know we need to wait, start listening for wakeup hints, and look again right away (just checking the
+        // version of the state file), in case the lock was released before we advertised our address. Failing to
+        // listen is not an error; it just means we only poll (and we do not try again for this request).
+        if (handle->narwhal.wakeup && !request->did_listen && !request->is_lockfile_busy) {
+            request->did_listen = true;
+            if (!is_listening(handle)) {
+                int base_errno = errno;
+                int result = listen_wakeups(handle);
+                if (result < 0)
+                    DEBUG_AT("failed to listen for wakeups");
+                errno = base_errno;
+                if (result == 0)
+                    continue;
+            }
+        }
+
+        long long start_usec = clock_usec();
+        sleep_or_wake(handle, round_delay(handle, request));
+        if (request->is_lockfile_busy) {
+            handle->stats.lockfile_spins++;
+            handle->stats.lockfile_wait_usec += clock_usec() - start_usec;
+        } else {
+            handle->stats.pending_spins++;
+            handle->stats.pending_wait_usec += clock_usec() - start_usec;
+        }
+    }
+}
+
+// Obtain a set of locks, sleeping between rounds of the request (see wait_for_request).
+static int
+lock(Handle* handle, const NarwhalNamedLock* locks, int n_locks, bool is_try, const struct timespec* deadline) {
+    if (handle->narwhal.coordinator) {
+        if (n_locks != 1 || *lock_name(locks) || is_try || deadline) {
+            errno = ENOTSUP;
+            return -1;
+        }
+        return coordinator_request(handle, locks->is_write_lock ? 'W' : 'R');
+    }
+    if (handle->backend != NARWHAL_NFS_BACKEND) {
+        if (n_locks != 1 || *lock_name(locks)) {
+            errno = ENOTSUP;
+            return -1;
+        }
+        return local_lock(handle, locks->is_write_lock, is_try, deadline);
+    }
+
+    LockRequest request;
+    int result = begin_lock(handle, &request, locks, n_locks);
+    if (result != 0)
+        return result < 0 ? -1 : 0;
+    return wait_for_request(handle, &request, is_try, deadline);
+}
+
+// Upgrade our read lock to a write lock (see upgrade_request), waiting until the other readers release their locks.
+static int
+upgrade(Handle* handle) {
+    if (handle->lease_state == LEASE_IDLE || handle->has_async_request || handle->narwhal.coordinator
+        || handle->backend != NARWHAL_NFS_BACKEND) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    LockRequest request;
+    request.start_usec = clock_usec();
+    if (exclusive_lock(handle) < 0)
+        return -1;
+    int result = load_client_states(handle) < 0 ? -1 : upgrade_request(handle);
+    if (exclusive_unlock(handle) < 0 || result < 0)
+        return -1;
+
+    // Our read lock is now part of the write request, which the following rounds renew until it is granted.
+    handle->lease_state = LEASE_NONE;
+    handle->is_holding = false;
+    init_request(handle, &request, &unnamed_write_lock, 1);
+    return wait_for_request(handle, &request, false, NULL);
+}
+
+// Downgrade our write lock to a read lock (see downgrade_request).
+static int
+downgrade(Handle* handle) {
+    if (handle->lease_state != LEASE_NONE || handle->has_async_request || handle->narwhal.coordinator
+        || handle->backend != NARWHAL_NFS_BACKEND) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    if (exclusive_lock(handle) < 0)
+        return -1;
+    int result = load_client_states(handle) < 0 ? -1 : downgrade_request(handle);
+    if (exclusive_unlock(handle) < 0 || result < 0)
+        return -1;
+    return 0;
+}
+
+// Update the client_states to release our lock of the unnamed lock (which must be all we hold) and request it again in
+// the given mode, with a new ticket at the end of the queue. Returns -1 on error, 0 if the new request can't be granted
+// yet, and 1 if it was granted.
+static int
+relock_request(Handle* handle, const NarwhalNamedLock* lock) {
+    DEBUG_AT("relock_request");
+    if (!find_held_lock(handle)) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    delete_own_states(handle);
+    return request_locks(handle, lock, 1);
+}
+
+// Implement narwhal_read_lock. See the header file.
+int
+narwhal_read_lock(const Narwhal* narwhal) {
+    DEBUG_AT("narwhal_read_lock");
+    Handle* handle = get_handle(narwhal);
+    if (!handle)
+        return -1;
+    return put_handle(handle, lock(handle, &unnamed_read_lock, 1, false, NULL));
+}
+
+// Whether the lockdir has a single state file shared by all the clients (which is required for the write generation
+// and the payload).
+static bool
+has_state_file(const Handle* handle) {
+    return !is_slot_protocol(handle) && !handle->narwhal.coordinator && handle->backend == NARWHAL_NFS_BACKEND;
+}
+
+// Obtain the unnamed read lock, and report the write generation of the state file as of when it was granted.
+static int
+read_lock_gen(Handle* handle, unsigned long long* generation) {
+    if (!has_state_file(handle)) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    if (lock(handle, &unnamed_read_lock, 1, false, NULL) < 0)
+        return -1;
+    *generation = handle->write_generation;
+    return 0;
+}
+
+// Implement narwhal_read_lock_gen. See the header file.
+int
+narwhal_read_lock_gen(const Narwhal* narwhal, unsigned long long* generation) {
+    DEBUG_AT("narwhal_read_lock_gen");
+    Handle* handle = get_handle(narwhal);
+    if (!handle)
+        return -1;
+    return put_handle(handle, read_lock_gen(handle, generation));
+}
+
+// Implement narwhal_write_lock. See the header file.
+int
+narwhal_write_lock(const Narwhal* narwhal) {
+    DEBUG_AT("narwhal_write_lock");
+    Handle* handle = get_handle(narwhal);
+    if (!handle)
+        return -1;
+    return put_handle(handle, lock(handle, &unnamed_write_lock, 1, false, NULL));
+}
+
+// Implement narwhal_try_read_lock. See the header file.
+int
+narwhal_try_read_lock(const Narwhal* narwhal) {
+    DEBUG_AT("narwhal_try_read_lock");
+    Handle* handle = get_handle(narwhal);
+    if (!handle)
+        return -1;
+    return put_handle(handle, lock(handle, &unnamed_read_lock, 1, true, NULL));
+}
+
+// Implement narwhal_try_write_lock. See the header file.
+int
+narwhal_try_write_lock(const Narwhal* narwhal) {
+    DEBUG_AT("narwhal_try_write_lock");
+    Handle* handle = get_handle(narwhal);
+    if (!handle)
+        return -1;
+    return put_handle(handle, lock(handle, &unnamed_write_lock, 1, true, NULL));
+}
+
+// Implement narwhal_read_lock_until. See the header file.
+int
+narwhal_read_lock_until(const Narwhal* narwhal, const struct timespec* deadline) {
+    DEBUG_AT("narwhal_read_lock_until");
+    Handle* handle = get_handle(narwhal);
+    if (!handle)
+        return -1;
+    return put_handle(handle, lock(handle, &unnamed_read_lock, 1, false, deadline));
+}
+
+// Implement narwhal_write_lock_until. See the header file.
+int
+narwhal_write_lock_until(const Narwhal* narwhal, const struct timespec* deadline) {
+    DEBUG_AT("narwhal_write_lock_until");
+    Handle* handle = get_handle(narwhal);
+    if (!handle)
+        return -1;
+    return put_handle(handle, lock(handle, &unnamed_write_lock, 1, false, deadline));
+}
+
+// Implement narwhal_lock_many. See the header file.
+int
+narwhal_lock_many(const Narwhal* narwhal, const NarwhalNamedLock* locks, int n_locks) {
+    DEBUG_AT("narwhal_lock_many");
+    Handle* handle = get_handle(narwhal);
+    if (!handle)
+        return -1;
+    return put_handle(handle, lock(handle, locks, n_locks, false, NULL));
+}
+
+// Obtain the lock of a node in a tree of named locks, and intention locks of its ancestors. The names of the locks are
+// the prefixes of the path, which are copied (with their terminating \0) one after the other into a single buffer.
+static int
+lock_path(Handle* handle, const char* path, bool is_write_lock) {
+    size_t path_size = strlen(path) + 1;
+    int n_locks = 1;
+    for (const char* p = path; *p; p++)
+        n_locks += *p == '/';
+    if (path_size == 1 || path[0] == '/' || path[path_size - 2] == '/' || strstr(path, "//")) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    NarwhalNamedLock* locks = malloc(n_locks * sizeof(NarwhalNamedLock));
+    char* names = malloc(n_locks * path_size);
+    if (!locks || !names) {
+        free(locks);
+        free(names);
+        return -1;
+    }
+
+    char* name = names;
+    int lock_index = 0;
+    for (const char* p = path;; p++) {
+        if (*p && *p != '/')
+            continue;
+        memcpy(name, path, p - path);
+        name[p - path] = '\0';
+        locks[lock_index].name = name;
+        locks[lock_index].is_write_lock = is_write_lock;
+        locks[lock_index].is_intent = *p != '\0';
+        lock_index++;
+        name += p - path + 1;
+        if (!*p)
+            break;
+    }
+
+    int result = lock(handle, locks, n_locks, false, NULL);
+    int base_errno = errno;
+    free(locks);
+    free(names);
+    errno = base_errno;
+    return result;
+}
+
+// Implement narwhal_lock_path. See the header file.
+int
+narwhal_lock_path(const Narwhal* narwhal, const char* path, bool is_write_lock) {
+    DEBUG_AT("narwhal_lock_path");
+    Handle* handle = get_handle(narwhal);
+    if (!handle)
+        return -1;
+    return put_handle(handle, lock_path(handle, path, is_write_lock));
+}
+
+// Do one round of the asynchronous lock request of the handle, and suggest when to do the next one.
+static int
+poll_async_request(Handle* handle, suseconds_t* next_poll_usec) {
+    int result = lock_round(handle, &handle->async_request, false);
+    if (result != 0) {
+        handle->has_async_request = false;
+        *next_poll_usec = 0;
+    } else {
+        *next_poll_usec = round_delay(handle, &handle->async_request);
+    }
+    return result;
+}
+
+// Implement narwhal_lock_begin. See the header file.
+int
+narwhal_lock_begin(const Narwhal* narwhal, bool is_write_lock, suseconds_t* next_poll_usec) {
+    DEBUG_AT("narwhal_lock_begin");
+    Handle* handle = get_handle(narwhal);
+    if (!handle)
+        return -1;
+
+    *next_poll_usec = 0;
+    int result
+        = begin_lock(handle, &handle->async_request, is_write_lock ? &unnamed_write_lock : &unnamed_read_lock, 1);
+    if (result == 0) {
+        handle->has_async_request = true;
+        result = poll_async_request(handle, next_poll_usec);
+    }
+    return put_handle(handle, result);
+}
+
+// Implement narwhal_lock_poll. See the header file.
+int
+narwhal_lock_poll(const Narwhal* narwhal, suseconds_t* next_poll_usec) {
+    DEBUG_AT("narwhal_lock_poll");
+    Handle* handle = get_handle(narwhal);
+    if (!handle)
+        return -1;
+
+    if (!handle->has_async_request) {
+        errno = ENOTSUP;
+        return put_handle(handle, -1);
+    }
+    return put_handle(handle, poll_async_request(handle, next_poll_usec));
+}
+
+// Withdraw the asynchronous lock request of the handle.
+static int
+cancel_async_request(Handle* handle) {
+    if (!handle->has_async_request) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    handle->has_async_request = false;
+    if (exclusive_lock(handle) < 0)
+        return -1;
+    int result = load_client_states(handle) < 0 ? -1 : withdraw_request(handle);
+    if (exclusive_unlock(handle) < 0 || result < 0)
+        return -1;
+    return 0;
+}
+
+// Implement narwhal_lock_cancel. See the header file.
+int
+narwhal_lock_cancel(const Narwhal* narwhal) {
+    DEBUG_AT("narwhal_lock_cancel");
+    Handle* handle = get_handle(narwhal);
+    if (!handle)
+        return -1;
+    return put_handle(handle, cancel_async_request(handle));
+}
+
+// Release a read or write lock. If this is a read lease, we just mark it as idle.
+static int
+unlock(Handle* handle) {
+    if (handle->narwhal.coordinator)
+        return coordinator_request(handle, 'U');
+    if (handle->backend != NARWHAL_NFS_BACKEND)
+        return local_unlock(handle);
+
+    switch (handle->lease_state) {
+    case LEASE_ACTIVE:
+        handle->lease_state = LEASE_IDLE;
+        return 0;
+    case LEASE_IDLE:
+        errno = ENOTSUP;
+        return -1;
+    case LEASE_NONE:
+        break;
+    }
+
+    handle->is_holding = false;
+    if (exclusive_lock(handle) < 0)
+        return -1;
+    int result = load_client_states(handle) < 0 ? -1 : remove_lock(handle);
+    if (exclusive_unlock(handle) < 0 || result < 0)
+        return -1;
+    return 0;
+}
+
+// Defer releasing our lock to the heartbeat thread, unless this is cheap anyway. Returns -1 on error, 0 if the lock was
+// released right away, and 1 if it was deferred (in which case the caller wakes the heartbeat thread, see
+// wake_heartbeat).
+static int
+unlock_async(Handle* handle) {
+    if (handle->narwhal.coordinator || handle->backend != NARWHAL_NFS_BACKEND || handle->lease_state != LEASE_NONE)
+        return unlock(handle);
+    if (!handle->is_holding) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    if (start_heartbeat() < 0)
+        return -1;
+
+    handle->is_unlock_pending = true;
+    return 1;
+}
+
+// Tell the heartbeat thread to look at a handle right away. This must be called after unlocking the handle, otherwise
+// the thread would find it busy, and only look at it again after heartbeat_retry_interval.
+static void
+wake_heartbeat(Handle* handle) {
+    pthread_mutex_lock(&handles_mutex);
+    handle->heartbeat_time = clock_msec();
+    pthread_cond_signal(&heartbeat_cond);
+    pthread_mutex_unlock(&handles_mutex);
+}
+
+// Report the first error of the deferred unlocks since the last call (get_handle already completed any pending one).
+static int
+flush(Handle* handle) {
+    if (!handle->unlock_errno)
+        return 0;
+    errno = handle->unlock_errno;
+    handle->unlock_errno = 0;
+    return -1;
+}
+
+// Update the client_states to set the payload and release our write lock of the unnamed lock (which must be all we
+// hold).
+static int
+remove_lock_with_payload(Handle* handle, const void* payload, size_t size) {
+    DEBUG_AT("remove_lock_with_payload");
+    const ClientState* client_state = find_held_lock(handle);
+    if (!client_state || !client_state->is_write_lock) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    memcpy(handle->payload, payload, size);
+    handle->payload_size = size;
+    handle->is_payload_changed = true;
+    return remove_lock(handle);
+}
+
+// Release our write lock, setting the payload in the same exclusive section.
+static int
+unlock_payload(Handle* handle, const void* payload, size_t size) {
+    if (size > NARWHAL_MAX_PAYLOAD) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (!has_state_file(handle) || !handle->is_holding || handle->lease_state != LEASE_NONE) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    if (exclusive_lock(handle) < 0)
+        return -1;
+    int result = load_client_states(handle) < 0 ? -1 : remove_lock_with_payload(handle, payload, size);
+    if (result == 0)
+        handle->is_holding = false;
+    if (exclusive_unlock(handle) < 0 || result < 0)
+        return -1;
+    return 0;
+}
+
+// Copy the payload as of when our lock was granted. No writer could have changed it since, so this is simply what we
+// parsed the last time we loaded the state file.
+static ssize_t
+get_payload(const Handle* handle, void* buffer, size_t capacity) {
+    if (!has_state_file(handle) || !handle->is_holding || handle->lease_state == LEASE_IDLE) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    if (capacity < handle->payload_size) {
+        errno = ERANGE;
+        return -1;
+    }
+    memcpy(buffer, handle->payload, handle->payload_size);
+    return handle->payload_size;
+}
+
+// Implement narwhal_unlock_payload. See the header file.
+int
+narwhal_unlock_payload(const Narwhal* narwhal, const void* payload, size_t size) {
+    DEBUG_AT("narwhal_unlock_payload");
+    Handle* handle = get_handle(narwhal);
+    if (!handle)
+        return -1;
+    return put_handle(handle, unlock_payload(handle, payload, size));
+}
+
+// Implement narwhal_get_payload. See the header file.
+ssize_t
+narwhal_get_payload(const Narwhal* narwhal, void* buffer, size_t capacity) {
+    DEBUG_AT("narwhal_get_payload");
+    Handle* handle = get_handle(narwhal);
+    if (!handle)
+        return -1;
+    return put_handle(handle, get_payload(handle, buffer, capacity));
+}
+
+// Implement narwhal_unlock. See the header file.
+int
+narwhal_unlock(const Narwhal* narwhal) {
+    DEBUG_AT("narwhal_unlock");
+    Handle* handle = get_handle(narwhal);
+    if (!handle)
+        return -1;
+    return put_handle(handle, unlock(handle));
+}
+
+// Implement narwhal_unlock_async. See the header file.
+int
+narwhal_unlock_async(const Narwhal* narwhal) {
+    DEBUG_AT("narwhal_unlock_async");
+    Handle* handle = get_handle(narwhal);
+    if (!handle)
+        return -1;
+    int result = put_handle(handle, unlock_async(handle));
+    if (result <= 0)
+        return result;
+    wake_heartbeat(handle);
+    return 0;
+}
+
+// Implement narwhal_flush. See the header file.
+int
+narwhal_flush(const Narwhal* narwhal) {
+    DEBUG_AT("narwhal_flush");
+    Handle* handle = get_handle(narwhal);
+    if (!handle)
+        return -1;
+    return put_handle(handle, flush(handle));
+}
+
+// Implement narwhal_upgrade. See the header file.
+int
+narwhal_upgrade(const Narwhal* narwhal) {
+    DEBUG_AT("narwhal_upgrade");
+    Handle* handle = get_handle(narwhal);
+    if (!handle)
+        return -1;
+    return put_handle(handle, upgrade(handle));
+}
+
+// Implement narwhal_downgrade. See the header file.
+int
+narwhal_downgrade(const Narwhal* narwhal) {
+    DEBUG_AT("narwhal_downgrade");
+    Handle* handle = get_handle(narwhal);
+    if (!handle)
+        return -1;
+    return put_handle(handle, downgrade(handle));
+}
+
+// Release our lock and request it again in the given mode, in a single exclusive section, waiting until the new request
+// is granted. An active read lease is simply released and obtained again, since releasing it does not touch the state
+// file anyway.
+static int
+relock(Handle* handle, bool is_write_lock) {
+    if (handle->lease_state == LEASE_IDLE || handle->has_async_request || handle->narwhal.coordinator
+        || handle->backend != NARWHAL_NFS_BACKEND || !handle->is_holding) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    const NarwhalNamedLock* lock_mode = is_write_lock ? &unnamed_write_lock : &unnamed_read_lock;
+    if (handle->lease_state == LEASE_ACTIVE)
+        return unlock(handle) < 0 ? -1 : lock(handle, lock_mode, 1, false, NULL);
+
+    LockRequest request;
+    request.start_usec = clock_usec();
+    init_request(handle, &request, lock_mode, 1);
+    request.is_lease = !is_write_lock && handle->narwhal.read_lease_sec > 0;
+
+    handle->is_holding = false;
+    if (exclusive_lock(handle) < 0)
+        return -1;
+    int result = load_client_states(handle) < 0 ? -1 : relock_request(handle, lock_mode);
+    if (result > 0 && request.is_lease && snapshot_state_version(handle, &handle->lease_version) < 0)
+        result = -1;
+    if (exclusive_unlock(handle) < 0 || result < 0)
+        return -1;
+
+    if (result) {
+        finish_request(handle, &request);
+        return 0;
+    }
+    return wait_for_request(handle, &request, false, NULL);
+}
+
+// Implement narwhal_relock. See the header file.
+int
+narwhal_relock(const Narwhal* narwhal, bool is_write_lock) {
+    DEBUG_AT("narwhal_relock");
+    Handle* handle = get_handle(narwhal);
+    if (!handle)
+        return -1;
+    return put_handle(handle, relock(handle, is_write_lock));
+}
+
+// Implement narwhal_open. See the header file.
+int
+narwhal_open(const Narwhal* narwhal) {
+    DEBUG_AT("narwhal_open");
+    return open_handle(narwhal) ? 0 : -1;
+}
+
+// Implement narwhal_close. See the header file.
+int
+narwhal_close(const Narwhal* narwhal) {
+    DEBUG_AT("narwhal_close");
+    pthread_mutex_lock(&handles_mutex);
+    for (Handle** handlep = &handles; *handlep; handlep = &(*handlep)->next) {
+        Handle* handle = *handlep;
+        if (!strcmp(handle->lockdir, narwhal->lockdir)) {
+            *handlep = handle->next;
+            pthread_mutex_unlock(&handles_mutex);
+            return free_handle(handle);
+        }
+    }
+    pthread_mutex_unlock(&handles_mutex);
+    return 0;
+}
+
+// Whether new local readers should stop joining the shared read lock, because some other client has a pending request
+// which a new read request would have to wait for (see is_conflicting), for example a writer in the default policy.
+// Otherwise, overlapping local readers could hold the lock forever. We only look at the state file when it changed
+// since we last looked at it. This only works for the NFS backend; other backends do not tell us about waiting
+// clients. Any error stops the sharing, so the next local reader will obtain the lock again and report the error.
+static bool
+should_stop_sharing(Handle* handle) {
+    DEBUG_AT("should_stop_sharing");
+    if (handle->narwhal.coordinator || handle->backend != NARWHAL_NFS_BACKEND
+        || !is_state_version_changed(handle, &handle->shared_version))
+        return false;
+
+    int base_errno = errno;
+    bool result = true;
+    if (exclusive_lock(handle) == 0) {
+        if (load_client_states(handle) == 0 && snapshot_state_version(handle, &handle->shared_version) == 0) {
+            result = false;
+            const ClientState* end_state = handle->client_states + handle->n_client_states;
+            for (const ClientState* client_state = handle->client_states; client_state != end_state; client_state++) {
+                if (!is_own_state(client_state) && !client_state->is_granted
+                    && is_conflicting(client_state, &unnamed_read_lock, ULLONG_MAX, false, handle->narwhal.policy)) {
+                    result = true;
+                    break;
+                }
+            }
+        }
+        if (exclusive_unlock(handle) < 0)
+            result = true;
+    }
+    errno = base_errno;
+    return result;
+}
+
+// Implement narwhal_shared_read_lock. See the header file.
+int
+narwhal_shared_read_lock(const Narwhal* narwhal) {
+    DEBUG_AT("narwhal_shared_read_lock");
+    Handle* handle = open_handle(narwhal);
+    if (!handle)
+        return -1;
+
+    // The last local reader releases the actual lock, which may be a different thread than the one which obtained it.
+    // This is fine for all backends except for the shm backend, whose pthread read/write lock must be released by its
+    // owner.
+    if (handle->backend == NARWHAL_SHM_BACKEND) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    errno = pthread_rwlock_rdlock(&handle->local_lock);
+    if (errno)
+        return -1;
+
+    pthread_mutex_lock(&handle->mutex);
+    use_handle(handle, narwhal);
+    while (handle->n_local_readers > 0 && (handle->is_sharing_stopped || should_stop_sharing(handle))) {
+        handle->is_sharing_stopped = true;
+        pthread_cond_wait(&handle->shared_cond, &handle->mutex);
+    }
+    handle->is_sharing_stopped = false;
+
+    int result = 0;
+    if (handle->n_local_readers == 0) {
+        // We can't snapshot the state version now without taking the lockfile again, so the first joiner will look.
+        memset(&handle->shared_version, 0, sizeof(handle->shared_version));
+        result = lock(handle, &unnamed_read_lock, 1, false, NULL);
+    }
+    publish_stats(handle);
+    if (result == 0)
+        handle->n_local_readers++;
+    int base_errno = errno;
+    pthread_mutex_unlock(&handle->mutex);
+
+    if (result < 0)
+        pthread_rwlock_unlock(&handle->local_lock);
+    errno = base_errno;
+    return result;
+}
+
+// Implement narwhal_shared_write_lock. See the header file.
+int
+narwhal_shared_write_lock(const Narwhal* narwhal) {
+    DEBUG_AT("narwhal_shared_write_lock");
+    Handle* handle = open_handle(narwhal);
+    if (!handle)
+        return -1;
+
+    errno = pthread_rwlock_wrlock(&handle->local_lock);
+    if (errno)
+        return -1;
+
+    pthread_mutex_lock(&handle->mutex);
+    use_handle(handle, narwhal);
+    int result = lock(handle, &unnamed_write_lock, 1, false, NULL);
+    int base_errno = errno;
+    publish_stats(handle);
+    pthread_mutex_unlock(&handle->mutex);
+
+    if (result < 0)
+        pthread_rwlock_unlock(&handle->local_lock);
+    errno = base_errno;
+    return result;
+}
+
+// Implement narwhal_shared_unlock. See the header file.
+int
+narwhal_shared_unlock(const Narwhal* narwhal) {
+    DEBUG_AT("narwhal_shared_unlock");
+    Handle* handle = open_handle(narwhal);
+    if (!handle)
+        return -1;
+
+    // If there are local readers, we must be one of them (since a local writer excludes all local readers).
+    pthread_mutex_lock(&handle->mutex);
+    int result = 0;
+    if (handle->n_local_readers == 0 || --handle->n_local_readers == 0) {
+        use_handle(handle, narwhal);
+        result = unlock(handle);
+        publish_stats(handle);
+        pthread_cond_broadcast(&handle->shared_cond);
+    }
+    int base_errno = errno;
+    pthread_mutex_unlock(&handle->mutex);
+
+    pthread_rwlock_unlock(&handle->local_lock);
+    errno = base_errno;
+    return result;
+}
+
+// Implement narwhal_stats. See the header file.
+int
+narwhal_stats(const Narwhal* narwhal, NarwhalStats* stats) {
+    DEBUG_AT("narwhal_stats");
+    pthread_mutex_lock(&handles_mutex);
+    pthread_mutex_lock(&stats_mutex);
+    if (narwhal)
+        memset(stats, 0, sizeof(NarwhalStats));
+    else
+        *stats = closed_stats;
+    for (Handle* handle = handles; handle; handle = handle->next) {
+        if (!narwhal || !strcmp(handle->lockdir, narwhal->lockdir))
+            add_stats(stats, &handle->published_stats);
+    }
+    pthread_mutex_unlock(&stats_mutex);
+    pthread_mutex_unlock(&handles_mutex);
+    return 0;
+}
+
+// Implement narwhal_stats_reset. See the header file.
+int
+narwhal_stats_reset(const Narwhal* narwhal) {
+    DEBUG_AT("narwhal_stats_reset");
+    pthread_mutex_lock(&handles_mutex);
+    pthread_mutex_lock(&stats_mutex);
+    if (!narwhal)
+        memset(&closed_stats, 0, sizeof(NarwhalStats));
+    for (Handle* handle = handles; handle; handle = handle->next) {
+        if (!narwhal || !strcmp(handle->lockdir, narwhal->lockdir))
+            memset(&handle->published_stats, 0, sizeof(NarwhalStats));
+    }
+    pthread_mutex_unlock(&stats_mutex);
+    pthread_mutex_unlock(&handles_mutex);
+    return 0;
 }
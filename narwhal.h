@@ -14,7 +14,8 @@ extern "C" {
 // released.
 //
 // Note that while this implements locks for synchronizing between processes, the code is not thread safe; make all your
-// calls to this API from the same (main?) thread or otherwise ensure only one thread at a time calls the API.
+// calls to this API from the same (main?) thread or otherwise ensure only one thread at a time calls the API. The only
+// exception are the narwhal_shared_* functions, which allow multiple threads to share a single lock of the process.
 //
 // The idea is that this can be used by processes on different NFS clients to coordinate access to a (small) amount of
 // data, something like:
@@ -37,51 +38,274 @@ extern "C" {
 //      narwhal_unlock(&narwhal)
 //
 // This is implemented as a single .h file and a single .c file you can drop into your project. It depends only on ANSI
-// and POSIX APIs, and requires a C99 or C++ compiler.
+// and POSIX APIs (including POSIX threads, so link with -pthread), and requires a C99 or C++ compiler.
 
+#include <dirent.h>
+#include <stdbool.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
 
+// The format of the state file (see below).
+typedef enum {
+    // A simple text file with one line per request. Every change rewrites the whole file.
+    NARWHAL_TEXT_STATE = 0,
+
+    // A text file with a header line and fixed-width records. Changes only rewrite the affected records in place.
+    NARWHAL_FIXED_STATE
+} NarwhalStateFormat;
+
+// The protocol for coordinating the clients of a lockdir (see below).
+typedef enum {
+    // All the requests are kept in a single state file, and every change is protected by the lockfile.
+    NARWHAL_STATE_PROTOCOL = 0,
+
+    // Each client keeps its own requests in its own hostname.pid file, and no lockfile is used.
+    NARWHAL_SLOT_PROTOCOL
+} NarwhalProtocol;
+
+// The policy for ordering conflicting read and write requests (see below).
+typedef enum {
+    // Requests are granted strictly in ticket (arrival) order, so the lock alternates between batches of consecutive
+    // readers and single writers, and nobody is ever starved.
+    NARWHAL_FIFO_POLICY = 0,
+
+    // A read request only waits for granted write requests, and is granted even if there are (earlier) pending write
+    // requests. This gives the best read throughput, but a steady stream of readers starves the writers.
+    NARWHAL_READER_POLICY,
+
+    // A read request also waits for all the pending write requests (even later ones), and a write request only waits
+    // for earlier write requests and granted read requests. Consecutive pending writers are therefore granted back to
+    // back before the readers resume. This gives the best write latency, but a steady stream of writers starves the
+    // readers.
+    NARWHAL_WRITER_POLICY
+} NarwhalPolicy;
+
+// The backend implementing the locks of a lockdir (see below).
+typedef enum {
+    // The hard link scheme described below, which works on NFS (and any other file system).
+    NARWHAL_NFS_BACKEND = 0,
+
+    // A POSIX byte-range lock (fcntl) of the lockdir/fcntl_lock file.
+    NARWHAL_FCNTL_BACKEND,
+
+    // A process-shared pthread read/write lock in a memory mapped lockdir/shm_lock file.
+    NARWHAL_SHM_BACKEND
+} NarwhalBackend;
+
 // Parameters for Narwhal operations.
 typedef struct {
     // A path of a directory that will contain lock files, typically stored on a remote NFS server. These files are:
     //
-    // - hostname.pid: an empty lock file for a specific process in a specific host.
+    // - hostname.pid and hostname.pid.alt: empty lock files for a specific process in a specific host. These are
+    //   created when the process first accesses the lockdir, and are kept until narwhal_close is called or the process
+    //   exits. If they are removed (e.g. by some cleanup script), they are simply re-created when needed. The process
+    //   alternates between them when obtaining the lockfile, so each time it holds it, it has a different inode than
+    //   the previous time.
     //
     // - lockfile: an empty lock file which is a hard link from one of the per-process lock files. Creating this link is
-    //   an atomic operation (even in NFS) which is the key to the whole scheme.
+    //   an atomic operation (even in NFS) which is the key to the whole scheme. If the same lockfile is held for longer
+    //   than the timeout, its holder is assumed to have died, and some other client breaks it by renaming it to its own
+    //   hostname.pid.broken file (which it removes right away).
     //
-    // - state: a text file containing the system state. All accesses to this file is protected by the lockfile. Each
-    //   line contains the following space separated fields:
+    // - state: a text file containing the system state. All modifications of this file are protected by the lockfile.
+    //   It is never modified in place; instead it is written into a hostname.pid.tmp file which is then renamed to
+    //   replace the state file, so it is never seen in a partially written state. Each line contains the following
+    //   space separated fields:
     //
     //   - The hostname() of the process requesting this lock.
     //
     //   - The getpid() of the process requesting this lock.
     //
-    //   - The desired lock state of some process, one of R (read) or W (write).
+    //   - The desired lock state of some process, one of R (read) or W (write), or r or w for the intention locks of
+    //     narwhal_lock_path.
     //
-    //   - Whether the lock is G (granted) or P (pending).
+    //   - Whether the lock is G (granted), P (pending), or U (a pending write request upgraded from a granted read
+    //     lock, see narwhal_upgrade).
     //
-    //   - The time() the process requested this lock state. This assumes all the clients have synchronized UTC time()
-    //     results.
+    //   - The time the process requested (or last renewed) this lock state, in milliseconds since the epoch
+    //     (CLOCK_REALTIME). This assumes all the clients have synchronized clocks. Local deadlines (e.g. when to give
+    //     up on the lockfile) use CLOCK_MONOTONIC, so they are not affected by steps of the wall clock.
+    //
+    //   - The ticket of the request, its position in the queue. Each new request (or set of requests, see
+    //     narwhal_lock_many) gets a ticket after all the existing ones, and requests are granted strictly in ticket
+    //     order (consecutive read requests are granted together).
+    //
+    //     Versions before tickets were added did not have this field (in either format), and can't parse state files
+    //     containing it, nor write ones we can parse. Old and new clients must therefore never share a lockdir; stop
+    //     all the clients of the old version and "hard reset" the lockdir (see below) before starting new ones.
+    //
+    //   - The name of the lock (see narwhal_lock_many). This is omitted for the unnamed lock used by all the other
+    //     functions, so lockdirs which don't use named locks are not affected by their existence.
+    //
+    //   The text format state file may also start with a "#writes" line containing the write generation (see
+    //   narwhal_read_lock_gen), which is omitted until the first write lock is released, and a "#payload" line
+    //   containing the payload in hex (see narwhal_unlock_payload), which is omitted while it is empty.
+    //
+    //   If the state file uses the fixed format, it starts with a header line containing "narwhal", a generation number
+    //   (incremented whenever requests are added or removed), the number of write requests (granted or pending), and
+    //   the write generation, followed by a "#payload" line padded with spaces to the maximal payload size.
+    //   This is followed by fixed-width records containing the same fields as above (the lock name being empty for the
+    //   unnamed lock), padded with spaces. Records of
+    //   removed requests are filled with spaces and are reused by later requests. In this format, the state file is
+    //   updated in place (typically by a single write of one record).
     //
     // You can "hard reset" the system by removing all files in the lockdir (as long as you are 100% certain that there
     // are no active processes trying to use it). In particular, this is a reasonable thing to do when booting a system.
-    // You can also safely delete all files whose last modification time is in the past (more than the maximal timeout
-    // you are using).
+    // You can also safely delete all the hostname.pid and hostname.pid.alt files, and the state file if its last
+    // modification time is in the past (more than the maximal timeout you are using). Any leftover hostname.pid.tmp
+    // files (from crashed processes) can also be safely deleted, and so can hostname.pid.wake files (see the wakeup
+    // parameter). However, when using NARWHAL_SLOT_PROTOCOL, the hostname.pid files hold the requests of the clients
+    // (including the granted ones), so you may only delete stale ones, whose requests are all older than the timeout
+    // (the clients remove these by themselves anyway).
     const char* lockdir;
 
     // The number of microseconds to sleep when spinning waiting for a lock. Should be low to minimize the latency of
     // obtaining a lock. This comes at the cost of consuming more CPU and network resources. A reasonable value is ~1000
     // (1 millisecond to deal with local network latency) Sleeping is done using nanosleep().
+    //
+    // This is the initial (minimal) sleep duration. If max_spin_usec is larger, then each further failed attempt sleeps
+    // longer (up to max_spin_usec), so waiters start responsive and slow down under contention.
     suseconds_t spin_usec;
 
+    // The maximal number of microseconds to sleep when spinning waiting for a lock. If this is zero (or not larger than
+    // spin_usec), we always sleep for spin_usec, which is the traditional behavior. Otherwise, the sleep duration grows
+    // by spin_growth after each failed attempt, up to this value. A reasonable value is ~10-100 times spin_usec; this
+    // caps the latency added to obtaining a lock while keeping the load on the NFS server bounded regardless of the
+    // number of waiting clients.
+    suseconds_t max_spin_usec;
+
+    // The factor to multiply the sleep duration by after each failed attempt. If this is zero (or not larger than 1),
+    // and max_spin_usec is larger than spin_usec, we use 2 (classic exponential backoff).
+    double spin_growth;
+
+    // The fraction (between 0 and 1) of each sleep duration to randomize. Each sleep is for a random duration between
+    // (1 - spin_jitter) and 1 times the current sleep duration. This prevents many clients that started waiting at the
+    // same time from hitting the NFS server in lockstep (the "thundering herd"). If this is zero, we sleep for exactly
+    // the current duration. A reasonable value is ~0.5.
+    double spin_jitter;
+
     // The number of seconds after which to assume a held lock is to be ignored due to the process obtaining it having
     // crashed, or not releasing the lock due to a bug. Should be high to minimize false positives. This comes at the
     // cost of stalling the whole system for a long time when a single process crashes. A reasonable number is ~10 (ten
     // seconds is plenty for a process to get its affairs in order, and is bearable for people waiting for a stalled
     // system to recover).
+    //
+    // The same timeout applies to the lockfile (see the lockdir parameter). Breaking an abandoned lockfile is not
+    // entirely race free. A holder which was merely stalled notices it lost the lockfile (and fails with ETIMEDOUT)
+    // before touching the state file, as long as it held it for over half the timeout. If the lockfile is released
+    // and obtained again in the few microseconds between another client seeing it abandoned and renaming it away, the
+    // breaking client sees it has a different inode and links it back (even if the same client obtained it again,
+    // since each client alternates between two private files). Two races remain. If the same client obtained the
+    // lockfile twice more in that window, it is linking the same inode again, so the breaking client can't tell and
+    // removes it. And if a third client obtains the lockfile before it is linked back, the breaking client backs off
+    // and leaves it to the third client, but the client it was taken from is not told. In both cases, two clients
+    // believe they hold the lockfile. These require full lockfile cycles between two NFS operations, exactly when the
+    // lockfile was held for the whole timeout, so they are very unlikely, but they are one more reason to keep the
+    // timeout generous.
     time_t timeout_sec;
+
+    // If positive, the timeout in milliseconds, overriding timeout_sec. Combined with the heartbeat option, this allows
+    // detecting crashed processes within a few hundred milliseconds, as long as the clocks of the clients are
+    // synchronized much better than that, and the NFS server responds well within it. All the mentions of timeout_sec
+    // below refer to this timeout.
+    long timeout_msec;
+
+    // The format to use when creating the state file. The default (text) format is simpler to read for debugging, and
+    // is reasonable for a small number of clients. The fixed format makes each update (even when there are hundreds of
+    // clients) a single small write, and allows waiting clients to only look at the header to detect changes. This
+    // only applies when the state file is empty (e.g. when it is first created); otherwise we keep using the format of
+    // the existing state file, so it is safe for different clients to disagree on this. Once created, a fixed format
+    // state file is never converted back to the text format; to do that, "hard reset" the lockdir.
+    NarwhalStateFormat state_format;
+
+    // The protocol for coordinating the clients. By default, every operation (even renewing a read lock) has to get the
+    // lockfile, which limits the whole cluster to about one operation per NFS round trip. In the slot protocol, each
+    // client writes its requests (in the text format) into its own hostname.pid file (replacing it using rename), and
+    // decides whether they are granted by reading the files of all the clients (removing the files of crashed clients
+    // once all their requests are stale). Tickets are chosen using Lamport's
+    // bakery algorithm, so no client ever waits for an exclusive section; read-mostly workloads scale with the number
+    // of readers. The cost is that each round reads all the request files (one NFS round trip per client), and that
+    // this relies on NFS close-to-open consistency for directories as well as files (the default, unless mounted with
+    // the nocto or lookupcache=none options). Waiting clients poll the modification time of the lockdir itself.
+    //
+    // All the clients of a lockdir must use the same protocol. The state_format is ignored by the slot protocol.
+    NarwhalProtocol protocol;
+
+    // The policy for ordering conflicting requests. All the clients of a lockdir must use the same policy (otherwise
+    // waiting clients may deadlock, e.g., a writer using the FIFO policy waiting for an earlier reader using the writer
+    // policy, which waits for the writer).
+    NarwhalPolicy policy;
+
+    // The backend implementing the locks. If all the clients of a lockdir run on the same host, there is no need to pay
+    // for the NFS scheme (a few file system operations and a state file rewrite per lock, which take milliseconds even
+    // on a local disk); a local backend uses a single system call (or none at all, if the lock is not contended) and
+    // takes microseconds. The fcntl backend locks are released by the kernel when the process exits, so a crash never
+    // leaves a stale lock behind. The shm backend is faster still, but if a process crashes while holding the lock, it
+    // is never released (until the shm_lock file is removed), and a lock must be released by the thread that obtained
+    // it (so it does not support narwhal_shared_read_lock).
+    //
+    // The local backends must be chosen explicitly; there is no way to check that a lockdir on a local file system is
+    // not exported over NFS, and remote clients (which would use the NFS backend) would not be excluded by local locks.
+    //
+    // The local backends only support narwhal_read_lock, narwhal_write_lock, narwhal_try_*, narwhal_*_lock_until and
+    // narwhal_unlock (and the narwhal_shared_* functions); the other lock functions fail with ENOTSUP, and the rest of
+    // the parameters (other than the lockdir and the spin parameters) are ignored. The backend is chosen when the
+    // process first accesses the lockdir, and all the clients of a lockdir must use the same one.
+    NarwhalBackend backend;
+
+    // If positive, obtaining a read lock gives a "lease" for (up to) this number of seconds. Releasing the read lock
+    // only marks it as idle (without accessing the NFS server at all). Obtaining a read lock again while holding the
+    // lease is (almost) free; it only checks whether the state file changed. The lease is really released only when we
+    // notice that some other client is waiting for a write lock (when obtaining a read lock again), when obtaining a
+    // write lock, or when calling narwhal_close (or exiting the process). Since an idle lease is not renewed, it will
+    // also be ignored by other clients once it becomes stale (after timeout_sec), so a process that stops using the
+    // lockdir will delay writers by at most timeout_sec.
+    //
+    // This is useful for read-heavy workloads; it removes most of the NFS traffic, at the cost of increasing the
+    // latency of (rare) write locks. The lease is capped to timeout_sec - 1 seconds (or to half the timeout, if it is
+    // less than 2 seconds), to ensure our request is never considered stale while we are using it.
+    time_t read_lease_sec;
+
+    // If set, a background thread renews our granted request (by updating its time in the state file) every
+    // timeout_sec/3 seconds, for as long as we hold the lock. This allows holding a lock for longer than timeout_sec,
+    // so the timeout can be made small (e.g., 2-3 seconds), which allows the system to recover from a crashed process
+    // much faster. If read_lease_sec is also set, the background thread also renews our idle read lease, so it does
+    // not age out; instead, it is released as soon as the thread notices some other client is waiting for a write
+    // lock.
+    //
+    // There is a single background thread in the process, which is started by the first lock using this option. It is
+    // not inherited when forking; a forked child process starts its own when it needs it. If the thread finds that our
+    // request was lost (e.g., because the thread was delayed by more than timeout_sec), the following narwhal_unlock
+    // will fail with ENOTSUP.
+    bool heartbeat;
+
+    // If set, waiting for a lock is driven by hints instead of just polling. A process which needs to wait listens on
+    // a UDP port, and advertises it in a hostname.pid.wake file in the lockdir; a process which releases (or
+    // downgrades, or gives up on) its lock sends a datagram to the waiters which may now be granted, which cuts their
+    // sleep short. This allows using a large max_spin_usec (so idle waiters hardly load the NFS server) while still
+    // handing the lock over within a network round trip. The hints are only an optimization; the protocol is the same,
+    // and lost hints (or clients which don't set this) just mean waiting for the next poll. Sending hints costs an NFS
+    // round trip (reading the wake file) per waiter woken, and requires the host names of the clients to be resolvable
+    // and UDP traffic between them to be allowed.
+    bool wakeup;
+
+    // If positive, the expected maximal number of requests (one per lock) in the lockdir. The buffers used for loading,
+    // parsing and writing the state are allocated for this many up front, when the process first accesses the lockdir,
+    // so polling and updating the state never allocates memory while the lockdir stays within this size. Exceeding it
+    // is not an error; the buffers just grow (geometrically) as needed. Otherwise, the buffers start small and grow
+    // the same way.
+    int max_clients;
+
+    // If set, the path of the unix socket of a local coordinator daemon (see narwhal_coordinator.h). Instead of
+    // accessing the lockdir directly, narwhal_read_lock, narwhal_write_lock and narwhal_unlock (and the
+    // narwhal_shared_* functions) ask the daemon to obtain and release the lock on our behalf. The daemon holds a
+    // single request in the state file for all the local processes sharing a read lock, so the load on the NFS server
+    // does not grow with the number of processes per host. If the process crashes (or closes the lockdir) while
+    // holding a lock, the daemon releases it when it notices the connection was closed. The other lock functions are
+    // not supported in this mode (they fail with ENOTSUP), and the rest of the parameters are those given to the
+    // daemon.
+    const char* coordinator;
 } Narwhal;
 
 // Obtain a read lock. This works by:
@@ -90,62 +314,479 @@ typedef struct {
 //
 // - Parse the state file. Remove any stale entries (older than the timeout).
 //
-// - If there are no write locks (granted or pending), mark the lock as granted, otherwise as pending.
+// - If there are no write requests granted or ahead of ours in the queue (or also behind it, using the writer policy;
+//   or only granted ones, using the reader policy), mark the lock as granted, otherwise as pending.
 //
 // - Write the state file (if modified) and release the lockfile.
 //
-// - If the lock was granted, return. Otherwise, sleep and try again (spin).
+// - If the lock was granted, return. Otherwise, sleep and try again (spin). While the request is pending, each spin
+//   only checks whether the state file has changed (without getting ownership of the lockfile). We only get ownership
+//   of the lockfile and try again if it did, or if our request needs to be renewed (every timeout_sec/2 seconds), or
+//   if some other request became stale. The sleep duration is scaled by the number of conflicting requests ahead of
+//   ours in the queue, so the load on the NFS server does not grow much with the number of waiting clients.
 //
 // Behaves like standard C functions - returns 0 on success and -1 on error, setting ERRNO to something appropriate. In
-// particular, will set errno to ENOTSUP if the process already has a lock. This will ignore stale lock requests, but if
-// there is an abandoned lockfile (very rare, since we only hold it when accessing the state file), this will ETIMEDOUT
-// after timeout_sec.
+// particular, will set errno to ENOTSUP if the process already has a lock. This will ignore stale lock requests, and
+// break an abandoned lockfile (very rare, since we only hold it when accessing the state file) after timeout_sec.
 extern int
 narwhal_read_lock(const Narwhal* narwhal);
 
-// Obtain a read lock. This works by:
+// The maximal size of the payload (see narwhal_unlock_payload).
+#define NARWHAL_MAX_PAYLOAD 512
+
+// Obtain a read lock (like narwhal_read_lock), and set the generation to the write generation of the lockdir when the
+// lock was granted. This counts the write locks (of any name) released so far, including write locks downgraded to
+// read locks, and write locks which became stale (since their holder might have crashed in the middle of modifying the
+// protected data). If the generation is the same as when we last read the protected data, no writer could have
+// modified it since, so a cached copy of it is still valid.
+//
+// The write generation is kept in the state file, so it starts again from zero if the lockdir is "hard reset"; discard
+// any cached copies when doing so.
+//
+// Behaves like standard C functions - returns 0 on success and -1 on error, setting ERRNO to something appropriate. In
+// particular, will set errno to ENOTSUP with the slot protocol, a local backend, or a coordinator (which do not have a
+// single state file).
+extern int
+narwhal_read_lock_gen(const Narwhal* narwhal, unsigned long long* generation);
+
+// Obtain a write lock. This works by:
 //
 // - Getting exclusive ownership of the lockfile.
 //
 // - Parse the state file. Remove any stale entries (older than the timeout).
 //
-// - If there are no granted write locks, mark the lock as granted, otherwise as pending.
+// - If there are no requests granted or ahead of ours in the queue (ignoring pending read requests, using the writer
+//   policy), mark the lock as granted, otherwise as pending.
 //
 // - Write the state file (if modified) and release the lockfile.
 //
-// - If the lock was granted, return. Otherwise, sleep and try again (spin).
+// - If the lock was granted, return. Otherwise, sleep and try again (spin). While the request is pending, each spin
+//   only checks whether the state file has changed (without getting ownership of the lockfile). We only get ownership
+//   of the lockfile and try again if it did, or if our request needs to be renewed (every timeout_sec/2 seconds), or
+//   if some other request became stale. The sleep duration is scaled by the number of conflicting requests ahead of
+//   ours in the queue, so the load on the NFS server does not grow much with the number of waiting clients.
 //
 // Behaves like standard C functions - returns 0 on success and -1 on error, setting ERRNO to something appropriate. In
-// particular, will set errno to ENOTSUP if the process already has a lock. This will ignore stale lock requests, but if
-// there is an abandoned lockfile (very rare, since we only hold it when accessing the state file), this will ETIMEDOUT
-// after timeout_sec.
+// particular, will set errno to ENOTSUP if the process already has a lock. This will ignore stale lock requests, and
+// break an abandoned lockfile (very rare, since we only hold it when accessing the state file) after timeout_sec.
 extern int
 narwhal_write_lock(const Narwhal* narwhal);
 
-// Release a read or write lock. This works by:
+// Try to obtain a read lock, without waiting. This does a single round of narwhal_read_lock. If the lock is not
+// granted, our request is withdrawn (so it does not stall anyone else), and this fails with EBUSY.
+//
+// Behaves like standard C functions - returns 0 on success and -1 on error, setting ERRNO to something appropriate.
+extern int
+narwhal_try_read_lock(const Narwhal* narwhal);
+
+// Try to obtain a write lock, without waiting. This does a single round of narwhal_write_lock. If the lock is not
+// granted, our request is withdrawn (so it does not stall anyone else), and this fails with EBUSY.
+//
+// Behaves like standard C functions - returns 0 on success and -1 on error, setting ERRNO to something appropriate.
+extern int
+narwhal_try_write_lock(const Narwhal* narwhal);
+
+// Obtain a read lock, waiting until some deadline (an absolute CLOCK_REALTIME time, as in pthread_mutex_timedlock).
+// This works like narwhal_read_lock, except that once the deadline passes, we do a final round, and if the lock is
+// still not granted, our request is withdrawn, and this fails with ETIMEDOUT. This may return slightly after the
+// deadline (by up to max_spin_usec, plus the time it takes to access the state file).
+//
+// Behaves like standard C functions - returns 0 on success and -1 on error, setting ERRNO to something appropriate.
+extern int
+narwhal_read_lock_until(const Narwhal* narwhal, const struct timespec* deadline);
+
+// Obtain a write lock, waiting until some deadline (an absolute CLOCK_REALTIME time, as in pthread_mutex_timedlock).
+// This works like narwhal_write_lock, except that once the deadline passes, we do a final round, and if the lock is
+// still not granted, our request is withdrawn, and this fails with ETIMEDOUT. This may return slightly after the
+// deadline (by up to max_spin_usec, plus the time it takes to access the state file).
+//
+// Behaves like standard C functions - returns 0 on success and -1 on error, setting ERRNO to something appropriate.
+extern int
+narwhal_write_lock_until(const Narwhal* narwhal, const struct timespec* deadline);
+
+// A named lock in a set of locks to obtain at once (see narwhal_lock_many).
+typedef struct {
+    // The name of the lock. Must not contain white space, and may not be longer than 64 characters if using the fixed
+    // state format. If this is NULL (or empty), this is the unnamed lock used by narwhal_read_lock and friends.
+    const char* name;
+
+    // Whether to obtain a write lock (or a read lock).
+    bool is_write_lock;
+
+    // Whether this is an intention lock (see narwhal_lock_path), announcing that we hold (or are waiting for) a lock
+    // further down the tree. Intention locks never conflict with each other; an intention to read (IR) conflicts only
+    // with a write lock of the same name, and an intention to write (IW) conflicts with a read or write lock of the
+    // same name.
+    bool is_intent;
+} NarwhalNamedLock;
+
+// Obtain a set of (read or write) named locks at once. A single lockdir (and state file) can hold any number of
+// independent named locks; a read lock conflicts only with a write lock of the same name, and a write lock conflicts
+// with any lock of the same name. This works just like narwhal_read_lock and narwhal_write_lock, except that each round
+// requests all the locks in a single exclusive section, and grants all of them, or none of them (leaving all the
+// requests pending). Compared to obtaining each lock separately, this saves the NFS round trips of all but one of the
+// exclusive sections, and since a process never holds some of the locks while waiting for the rest, there is no way
+// for processes requesting overlapping sets to deadlock, regardless of the order of the locks.
+//
+// The whole set is released by a single call to narwhal_unlock. A process can hold at most one set of locks per
+// lockdir, same as with the other lock functions.
+//
+// Behaves like standard C functions - returns 0 on success and -1 on error, setting ERRNO to something appropriate. In
+// particular, will set errno to EINVAL if the set is empty, contains the same name twice, or contains an invalid name,
+// and to ENOTSUP if the process already has a lock.
+extern int
+narwhal_lock_many(const Narwhal* narwhal, const NarwhalNamedLock* locks, int n_locks);
+
+// Obtain a read or write lock of a node in a tree of named locks, where the path of the node is a "/" separated list of
+// names (e.g., "project/sample"). This is a set of locks (see narwhal_lock_many) containing the named lock of the node
+// itself, and an intention lock of each of its ancestors (e.g., "project"). Thus writing different leaves proceeds in
+// parallel (their intentions to write the shared ancestors do not conflict), while writing a whole subtree (locking
+// its root) excludes reading or writing any node below it, and vice versa. Since the whole set is granted at once, it
+// does not matter in which order processes lock the nodes.
+//
+// All the nodes share a single lockdir (and state file), so obtaining and releasing each lock still costs an exclusive
+// section, but holding locks of unrelated nodes does not serialize the processes.
+//
+// Behaves like standard C functions - returns 0 on success and -1 on error, setting ERRNO to something appropriate. In
+// particular, will set errno to EINVAL if the path is empty, or has an empty (or invalid) name, and to ENOTSUP if the
+// process already has a lock.
+extern int
+narwhal_lock_path(const Narwhal* narwhal, const char* path, bool is_write_lock);
+
+// Start obtaining a read or write lock asynchronously, for use in event loops. This registers the request and does the
+// first round of narwhal_read_lock or narwhal_write_lock, but never sleeps (it only tries once to get the lockfile).
+// If the lock was not granted, call narwhal_lock_poll (after about next_poll_usec microseconds) to do the next round,
+// until the lock is granted, or call narwhal_lock_cancel to give up. If there is an idle read lease (see
+// read_lease_sec), this may need to wait for the lockfile to renew or release it.
+//
+// A process can have at most one outstanding request (asynchronous or not) per lockdir, but a single thread can drive
+// requests for many lockdirs at once. A pending request is only renewed by narwhal_lock_poll (the heartbeat thread only
+// renews granted locks), so it must be polled at least every timeout_sec/2 seconds. A request which is not polled for
+// timeout_sec becomes stale, and the other clients ignore it (the following poll would then request the lock again, at
+// the end of the queue).
+//
+// Returns 1 if the lock was granted, 0 if the request is pending, and -1 on error, setting ERRNO to something
+// appropriate. An error ends the request (any pending entry we left in the state file is eventually ignored as stale).
+// In particular, will set errno to ENOTSUP if the process already has a lock or an outstanding request.
+extern int
+narwhal_lock_begin(const Narwhal* narwhal, bool is_write_lock, suseconds_t* next_poll_usec);
+
+// Do the next round of an asynchronous request started by narwhal_lock_begin. This does only a bounded amount of work
+// (typically just checking whether the state file changed) and never sleeps.
+//
+// Returns 1 if the lock was granted, 0 if the request is pending (and sets next_poll_usec to the suggested delay
+// until the next call), and -1 on error, setting ERRNO to something appropriate. In particular, will set errno to
+// ENOTSUP if there is no outstanding request.
+extern int
+narwhal_lock_poll(const Narwhal* narwhal, suseconds_t* next_poll_usec);
+
+// Withdraw an outstanding asynchronous request started by narwhal_lock_begin. This needs to wait for the lockfile, so
+// it may block briefly (and, like narwhal_unlock, will break the lockfile after timeout_sec if it is abandoned).
+//
+// Behaves like standard C functions - returns 0 on success and -1 on error, setting ERRNO to something appropriate. In
+// particular, will set errno to ENOTSUP if there is no outstanding request.
+extern int
+narwhal_lock_cancel(const Narwhal* narwhal);
+
+// Release a read or write lock (or a set of locks obtained by narwhal_lock_many). If this is a read lock and
+// read_lease_sec is set, this just marks the lock as idle (see above). Otherwise, this works by:
 //
 // - Getting exclusive ownership of the lockfile.
 //
 // - Parse the state file. Remove any stale entries (older than the timeout) and
-// the entry for the current process.
+// the entries for the current process.
 //
 // - Write the state file (if modified) and release the lockfile.
 //
 // Behaves like standard C functions - returns 0 on success and -1 on error, setting ERRNO to something appropriate. In
-// particular, will set errno to ENOTSUP if the process does not have a lock.
+// particular, will set errno to ENOTSUP if the process does not have a lock, and to ETIMEDOUT if we were delayed for
+// so long while holding the lockfile that some other client broke it (in which case we do not touch the state file).
 extern int
 narwhal_unlock(const Narwhal* narwhal);
 
+// Release a lock like narwhal_unlock, but without waiting for the exclusive section; the background thread (see the
+// heartbeat parameter) does it instead, so a process which releases many locks does not pay an NFS round trip for
+// each. The lock is only really released once the thread gets to it, so other clients may wait a bit longer for it.
+// Any following operation on the same lockdir first completes the pending unlock (in the calling thread, if the
+// background thread did not get to it yet), so the process never holds (or requests) the lock twice. Releasing a read
+// lease, or releasing a lock using a coordinator or a local backend, is cheap anyway, so it is done immediately.
+//
+// Returns 0 if the unlock was scheduled and -1 on error, setting ERRNO to something appropriate. In particular, will
+// set errno to ENOTSUP if the process does not have a lock. Errors of the deferred unlock itself are reported by the
+// following narwhal_flush.
+extern int
+narwhal_unlock_async(const Narwhal* narwhal);
+
+// Wait until a pending narwhal_unlock_async of the lockdir is done (doing it in the calling thread if the background
+// thread did not get to it yet). Calling narwhal_close also does this, but ignores the errors.
+//
+// Behaves like standard C functions - returns 0 on success and -1 on error, setting ERRNO to something appropriate. In
+// particular, will set errno to that of the first deferred unlock which failed since the previous narwhal_flush.
+extern int
+narwhal_flush(const Narwhal* narwhal);
+
+// Release a write lock (like narwhal_unlock), and set the payload of the lockdir in the same exclusive section. The
+// payload is a small (up to NARWHAL_MAX_PAYLOAD bytes) piece of data kept in the state file itself, e.g. the name of
+// the current version of a dataset, or a small configuration. Since the state file is loaded anyway when obtaining a
+// lock, reading it costs nothing, so if all the protected data fits in the payload, there is no need to access any
+// other file while holding the lock. The payload is kept until the next call sets it (an empty payload clears it).
+//
+// Behaves like standard C functions - returns 0 on success and -1 on error, setting ERRNO to something appropriate. In
+// particular, will set errno to EMSGSIZE if the payload is too large, and to ENOTSUP if the process does not hold
+// (just) the unnamed write lock, or with the slot protocol, a local backend, or a coordinator (which do not have a
+// single state file). In both cases, the lock is not released.
+extern int
+narwhal_unlock_payload(const Narwhal* narwhal, const void* payload, size_t size);
+
+// Copy the payload of the lockdir, as of when our (read or write) lock was granted, into a buffer. This does not access
+// the NFS server.
+//
+// Returns the size of the payload on success and -1 on error, setting ERRNO to something appropriate. In particular,
+// will set errno to ERANGE if the buffer is too small, and to ENOTSUP if the process does not hold a lock (or with the
+// slot protocol, a local backend, or a coordinator).
+extern ssize_t
+narwhal_get_payload(const Narwhal* narwhal, void* buffer, size_t capacity);
+
+// Upgrade the read lock of the current process to a write lock, without releasing it in between. This turns our
+// request into an upgrading write request, which keeps its place in the queue, so it is ahead of every request which
+// arrived after we got the read lock, and no other writer can get the lock before we do. This waits (like
+// narwhal_write_lock) until all the other readers release their locks. Compared to unlocking and then obtaining a write
+// lock, this needs one exclusive section less, and there is no need to validate the data we read under the read lock.
+//
+// Only one reader may upgrade at a time; otherwise, each would wait for the other forever. If some other process is
+// already upgrading its read lock, this fails with EDEADLK, and we still hold our read lock; the caller should then
+// unlock it and obtain the write lock in the normal way (without assuming the data it read is still valid).
+//
+// Behaves like standard C functions - returns 0 on success and -1 on error, setting ERRNO to something appropriate. In
+// particular, will set errno to ENOTSUP if the process does not hold just the (unnamed) read lock, or if using a
+// coordinator.
+extern int
+narwhal_upgrade(const Narwhal* narwhal);
+
+// Downgrade the write lock of the current process to a read lock, without releasing it in between. This needs a single
+// exclusive section, and the readers queued behind us are granted the lock as soon as they notice.
+//
+// Behaves like standard C functions - returns 0 on success and -1 on error, setting ERRNO to something appropriate. In
+// particular, will set errno to ENOTSUP if the process does not hold just the (unnamed) write lock, or if using a
+// coordinator.
+extern int
+narwhal_downgrade(const Narwhal* narwhal);
+
+// Release the (unnamed) lock of the current process and request it again in the given mode, in a single exclusive
+// section. Unlike narwhal_upgrade and narwhal_downgrade, the new request gets a new ticket at the end of the queue, so
+// it honors the policy (e.g., a reader switching to a write lock waits for the requests queued before it, and a writer
+// switching to a read lock waits for the writers queued before it using the FIFO or writer policy). Compared to
+// unlocking and then locking again, this needs one exclusive section less. If the new request is not granted right
+// away, this waits for it (like narwhal_read_lock or narwhal_write_lock).
+//
+// Behaves like standard C functions - returns 0 on success and -1 on error, setting ERRNO to something appropriate. In
+// particular, will set errno to ENOTSUP if the process does not hold just the (unnamed) lock, or if using a coordinator
+// or a local backend.
+extern int
+narwhal_relock(const Narwhal* narwhal, bool is_write_lock);
+
+// Obtain a read lock on behalf of the current thread. This may be called concurrently from multiple threads. The first
+// local reader obtains the actual read lock (using narwhal_read_lock); additional local readers just share it, until
+// the last one releases it. This allows N threads to pay the cost of M round trips to the NFS server, instead of N * M.
+// Using the NFS backend, when some other client is waiting for a lock which a new read request would wait for (e.g. a
+// writer, in the default policy), new local readers stop joining and wait until the current ones release the lock, so
+// overlapping local readers can't starve remote writers. Other backends do not report waiting clients, so local readers
+// keep joining while the lock is held.
+// The last local reader may be a different thread than the first one, so this is not supported by the shm backend
+// (whose locks must be released by the thread that obtained them).
+//
+// Behaves like standard C functions - returns 0 on success and -1 on error, setting ERRNO to something appropriate. In
+// particular, will set errno to ENOTSUP if using the shm backend. Do not mix the narwhal_shared_* functions with the
+// other lock functions for the same lockdir in the same process.
+extern int
+narwhal_shared_read_lock(const Narwhal* narwhal);
+
+// Obtain a write lock on behalf of the current thread. This may be called concurrently from multiple threads. Local
+// writers are serialized (against local readers and other local writers) using a local read/write lock, before
+// obtaining the actual write lock (using narwhal_write_lock).
+//
+// Behaves like standard C functions - returns 0 on success and -1 on error, setting ERRNO to something appropriate.
+extern int
+narwhal_shared_write_lock(const Narwhal* narwhal);
+
+// Release a read or write lock obtained by narwhal_shared_read_lock or narwhal_shared_write_lock by the current thread.
+// The actual lock is released (using narwhal_unlock) when the last local thread releases it.
+//
+// Behaves like standard C functions - returns 0 on success and -1 on error, setting ERRNO to something appropriate.
+extern int
+narwhal_shared_unlock(const Narwhal* narwhal);
+
+// Prepare for accessing the lockdir. The process keeps an (internal) handle for each lockdir it accesses, which holds
+// the precomputed paths of the files in the lockdir, reusable buffers for the state, and the hostname.pid file. This
+// allows a process to hold locks in many lockdirs at once (e.g., one per data partition) without re-computing paths or
+// re-allocating buffers for each operation. The handle is identified by the lockdir path, so different Narwhal structs
+// with the same lockdir share the same handle (the other parameters are taken from the Narwhal passed to each call).
+// A process must always use the same path for each lockdir; accessing it using a different path (e.g., "./d" instead
+// of "d") while it has a handle fails with EEXIST, since both handles would share the same private files (and the
+// fcntl locks of the process).
+//
+// It is not required to call this; the handle is created on the first access to the lockdir. However, calling this
+// moves the cost (and any errors) of creating the handle up front.
+//
+// Behaves like standard C functions - returns 0 on success and -1 on error, setting ERRNO to something appropriate.
+extern int
+narwhal_open(const Narwhal* narwhal);
+
+// Release the handle used by this process for accessing the lockdir, specifically, remove its hostname.pid file. This
+// should not be called while holding a lock (or waiting for one). It is not required to call this; all the handles are
+// automatically released when the process exits (unless it crashes). However, it is appropriate to call this when the
+// process is done with the lockdir, especially for long-running processes accessing many lockdirs.
+//
+// Behaves like standard C functions - returns 0 on success and -1 on error, setting ERRNO to something appropriate.
+extern int
+narwhal_close(const Narwhal* narwhal);
+
+// The number of buckets in the histogram of the latency of obtaining locks.
+#define NARWHAL_LATENCY_BUCKETS 32
+
+// Statistics of the operations of the process, for investigating performance problems. These are always collected (the
+// overhead is negligible compared to accessing the NFS server). All the fields are counters (durations are in
+// microseconds). The time spent waiting is only measured for the blocking functions (when using narwhal_lock_poll, the
+// caller is doing the waiting).
+typedef struct {
+    // The number of attempts to link the lockfile, and how many of them failed (because someone else was holding it).
+    unsigned long long link_attempts;
+    unsigned long long link_failures;
+
+    // The number of times we slept waiting for the lockfile, and the total time we spent doing so.
+    unsigned long long lockfile_spins;
+    unsigned long long lockfile_wait_usec;
+
+    // The number of abandoned lockfiles we broke (see the lockdir parameter).
+    unsigned long long lockfile_breaks;
+
+    // The number of times we slept while our request was pending, and the total time we spent doing so.
+    unsigned long long pending_spins;
+    unsigned long long pending_wait_usec;
+
+    // The number of times we checked whether the state file changed (while pending, or when resuming a read lease).
+    unsigned long long version_checks;
+
+    // The total time spent reading, writing and checking the state file, and the number of bytes read and written.
+    unsigned long long state_io_usec;
+    unsigned long long state_bytes_read;
+    unsigned long long state_bytes_written;
+
+    // The number of entries parsed from the state file, and how many of them were evicted as stale.
+    unsigned long long entries_parsed;
+    unsigned long long stale_entries;
+
+    // The number of wakeup hints we sent to waiters, and received while waiting (see the wakeup parameter).
+    unsigned long long wakeups_sent;
+    unsigned long long wakeups_received;
+
+    // The number of locks obtained, and the histogram of the time it took to obtain them. Bucket 0 counts locks
+    // obtained in less than 1 microsecond, and bucket i counts locks obtained in at least 2^(i-1) and less than 2^i
+    // microseconds. The last bucket also counts all the slower locks.
+    unsigned long long locks_acquired;
+    unsigned long long acquire_latency_histogram[NARWHAL_LATENCY_BUCKETS];
+} NarwhalStats;
+
+// Get the statistics of the operations of the process on the lockdir. If narwhal is NULL, get the total statistics of
+// the operations on all lockdirs (including the ones which were closed). The statistics of each operation are available
+// once it is complete.
+//
+// Behaves like standard C functions - returns 0 on success and -1 on error, setting ERRNO to something appropriate.
+extern int
+narwhal_stats(const Narwhal* narwhal, NarwhalStats* stats);
+
+// Reset the statistics of the operations of the process on the lockdir (or on all lockdirs, if narwhal is NULL).
+//
+// Behaves like standard C functions - returns 0 on success and -1 on error, setting ERRNO to something appropriate.
+extern int
+narwhal_stats_reset(const Narwhal* narwhal);
+
 // Set the hostname to use for this process. By default, uses the result of gethostname, but it is sometimes useful to
-// override it (e.g. for tests).
+// override it (e.g. for tests). This should be called before accessing any lockdir; it implicitly closes any lockdir
+// accessed using the previous hostname.
 extern void
 narwhal_hostname(const char* hostname);
 
 // Set the pid to use for this process. By default, uses the result of getpid, but it is sometimes useful to override it
-// (e.g. for tests).
+// (e.g. for tests). This should be called before accessing any lockdir; it implicitly closes any lockdir accessed using
+// the previous pid.
 extern void
 narwhal_pid(const char* pid);
 
+// The types of tracing events (see narwhal_trace).
+typedef enum {
+    // A request for a lock was added to the state file.
+    NARWHAL_TRACE_REQUESTED,
+
+    // A request for a lock was granted.
+    NARWHAL_TRACE_GRANTED,
+
+    // A request for a lock was removed from the state file (when unlocking, giving up on a pending request, or when
+    // releasing an idle read lease).
+    NARWHAL_TRACE_RELEASED,
+
+    // The request of some other client was evicted from the state file because it became stale.
+    NARWHAL_TRACE_STALE_EVICTED,
+
+    // Failed to get the lockfile because some other client is holding it.
+    NARWHAL_TRACE_LOCKFILE_CONTENDED,
+
+    // We broke an abandoned lockfile (see the lockdir parameter).
+    NARWHAL_TRACE_LOCKFILE_BROKEN
+} NarwhalTraceEventType;
+
+// A tracing event. The strings are only valid during the invocation of the callback.
+typedef struct {
+    NarwhalTraceEventType type;
+
+    // The lockdir the event happened in.
+    const char* lockdir;
+
+    // The request the event is about (all NULL/false for lockfile events). The name is NULL for the unnamed lock.
+    const char* host_name;
+    const char* pid;
+    const char* name;
+    bool is_write_lock;
+} NarwhalTraceEvent;
+
+// A callback for receiving tracing events.
+typedef void (*NarwhalTraceCallback)(const NarwhalTraceEvent* event, void* context);
+
+// Register a callback for tracing the operations of the process (or disable tracing if callback is NULL). When tracing
+// is disabled (the default), it costs a single branch at each point an event might be reported. The callback is
+// invoked synchronously, possibly from the heartbeat thread, while the lockdir is locked, so it should be quick, and
+// must not invoke any of the functions of this API. This should be called before accessing any lockdir.
+//
+// Compiling with -DLOG additionally dumps a detailed debug log of the internal operations to stderr.
+extern void
+narwhal_trace(NarwhalTraceCallback callback, void* context);
+
+// The system calls used to access the lockdir. All the accesses to the lockdir go through these, so tests and
+// benchmarks can replace them to simulate the behavior of an NFS server (latency, jitter, lost replies and errors)
+// without a real cluster (see narwhal_sim.h). Each function must behave like the standard system call of the same name,
+// and must be thread safe (they are also invoked by the heartbeat thread).
+typedef struct {
+    int (*link)(const char* old_path, const char* new_path);
+    int (*unlink)(const char* path);
+    int (*rename)(const char* old_path, const char* new_path);
+    int (*open)(const char* path, int flags, mode_t mode);
+    int (*close)(int fd);
+    ssize_t (*read)(int fd, void* buffer, size_t size);
+    ssize_t (*write)(int fd, const void* buffer, size_t size);
+    ssize_t (*pread)(int fd, void* buffer, size_t size, off_t offset);
+    ssize_t (*pwrite)(int fd, const void* buffer, size_t size, off_t offset);
+    int (*stat)(const char* path, struct stat* stbuf);
+    int (*fstat)(int fd, struct stat* stbuf);
+    DIR* (*opendir)(const char* path);
+    struct dirent* (*readdir)(DIR* dir);
+    int (*closedir)(DIR* dir);
+} NarwhalSyscalls;
+
+// Replace the system calls used to access the lockdir (or restore the default ones, if hooks is NULL). This should be
+// called before accessing any lockdir, and, like the rest of the API, is not thread safe.
+extern void
+narwhal_syscalls(const NarwhalSyscalls* hooks);
+
 #ifdef __cplusplus
 }
 #endif
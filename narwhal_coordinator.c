@@ -0,0 +1,156 @@
+#include "narwhal_coordinator.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// A connection of a local client.
+typedef struct {
+    int fd;
+    Narwhal narwhal;
+} Connection;
+
+// Send a reply to a local client. Returns whether this succeeded.
+static bool
+send_reply(int fd, int result) {
+    char reply[64];
+    int size = snprintf(reply, sizeof(reply), "%d %d\n", result, result < 0 ? errno : 0);
+    for (int sent = 0; sent < size;) {
+        ssize_t sent_now = send(fd, reply + sent, size - sent, MSG_NOSIGNAL);
+        if (sent_now < 0)
+            return false;
+        sent += sent_now;
+    }
+    return true;
+}
+
+// Execute a single command of a local client. The held_lockdir is the lockdir of the lock held by the client (if any).
+static int
+execute_command(Connection* connection, char command, const char* lockdir, char** held_lockdirp) {
+    Narwhal narwhal = connection->narwhal;
+    narwhal.lockdir = lockdir;
+    narwhal.coordinator = NULL;
+
+    switch (command) {
+    case 'R':
+    case 'W':
+        if (*held_lockdirp) {
+            errno = ENOTSUP;
+            return -1;
+        }
+        if ((command == 'R' ? narwhal_shared_read_lock(&narwhal) : narwhal_shared_write_lock(&narwhal)) < 0)
+            return -1;
+        *held_lockdirp = strdup(lockdir);
+        return 0;
+
+    case 'U':
+        if (!*held_lockdirp || strcmp(*held_lockdirp, lockdir)) {
+            errno = ENOTSUP;
+            return -1;
+        }
+        free(*held_lockdirp);
+        *held_lockdirp = NULL;
+        return narwhal_shared_unlock(&narwhal);
+
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+}
+
+// Serve the commands of a local client until it closes the connection, then release any lock it still holds.
+static void*
+serve_connection(void* arg) {
+    Connection* connection = arg;
+    FILE* input = fdopen(connection->fd, "r");
+    char* held_lockdir = NULL;
+    char* line = NULL;
+    size_t capacity = 0;
+
+    ssize_t size;
+    while (input && (size = getline(&line, &capacity, input)) > 0) {
+        if (line[size - 1] == '\n')
+            line[--size] = '\0';
+        int result;
+        if (size < 3 || line[1] != ' ') {
+            errno = EINVAL;
+            result = -1;
+        } else {
+            result = execute_command(connection, line[0], line + 2, &held_lockdir);
+        }
+        if (!send_reply(connection->fd, result))
+            break;
+    }
+
+    if (held_lockdir) {  // The client crashed (or closed the lockdir) while holding the lock.
+        Narwhal narwhal = connection->narwhal;
+        narwhal.lockdir = held_lockdir;
+        narwhal.coordinator = NULL;
+        narwhal_shared_unlock(&narwhal);
+        free(held_lockdir);
+    }
+
+    free(line);
+    if (input)
+        fclose(input);
+    else
+        close(connection->fd);
+    free(connection);
+    return NULL;
+}
+
+// Implement narwhal_coordinate. See the header file.
+int
+narwhal_coordinate(const Narwhal* narwhal, const char* socket_path) {
+    // We bind the socket to a temporary path, and only rename it into place once it is listening, so clients which
+    // find the socket can connect to it right away.
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(socket_path) + sizeof(".tmp") > sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s.tmp", socket_path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0)
+        return -1;
+    unlink(address.sun_path);
+    if (bind(listen_fd, (const struct sockaddr*)&address, sizeof(address)) < 0 || listen(listen_fd, SOMAXCONN) < 0
+        || rename(address.sun_path, socket_path) < 0) {
+        int base_errno = errno;
+        close(listen_fd);
+        unlink(address.sun_path);
+        errno = base_errno;
+        return -1;
+    }
+
+    for (;;) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            int base_errno = errno;
+            close(listen_fd);
+            errno = base_errno;
+            return -1;
+        }
+
+        Connection* connection = malloc(sizeof(Connection));
+        connection->fd = fd;
+        connection->narwhal = *narwhal;
+        pthread_t thread;
+        errno = pthread_create(&thread, NULL, serve_connection, connection);
+        if (errno) {
+            close(fd);
+            free(connection);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
@@ -0,0 +1,47 @@
+#ifndef __NARWHAL_COORDINATOR__
+#define __NARWHAL_COORDINATOR__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Narwhal local coordinator
+//
+// When many processes on the same host use the same lockdir, each of them has its own request in the state file, and
+// does its own NFS operations to obtain, renew and release it. A local coordinator daemon collapses all of them into a
+// single NFS client: each local process connects to the daemon over a unix socket (see the coordinator parameter of
+// Narwhal), and the daemon obtains the locks on their behalf using the narwhal_shared_* functions, so all the local
+// readers share a single read request in the state file. Something like:
+//
+//      #include <narwhal_coordinator.h>
+//
+//      narwhal = Narwhal {
+//              .spin_usec = 1000,
+//              .timeout_sec = 10,
+//              .heartbeat = true
+//      };
+//
+//      narwhal_coordinate(&narwhal, "/run/narwhal.sock");
+//
+// Or just run the narwhald program. The protocol is a line per request, containing a command (R for read lock, W for
+// write lock, U for unlock), a space, and the absolute path of the lockdir. Each request is answered by a line
+// containing the result (0 or -1) and the errno (or 0). Each connection may hold at most one lock at a time; if the
+// connection is closed while holding a lock (e.g., because the client crashed), the lock is released.
+
+#include "narwhal.h"
+
+// Serve local clients connecting to a unix socket at the specified path, forever. Any existing file at this path (e.g.
+// a leftover socket of a previous daemon) is replaced. The socket is created as path.tmp and renamed into place once
+// it accepts connections, so clients may wait for the path to exist before connecting. The lockdir of the parameters
+// is ignored (each request specifies its own); the other parameters are used for all the locks. It is recommended to
+// set the heartbeat option, so that locks held by local clients for a long time will not become stale.
+//
+// Only returns on error, returning -1 and setting ERRNO to something appropriate.
+extern int
+narwhal_coordinate(const Narwhal* narwhal, const char* socket_path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,174 @@
+#include "narwhal_sim.h"
+#include "narwhal.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// The parameters of the current simulation.
+static NarwhalSimulation simulation;
+
+// The state of the random number generator (xorshift64*), protected by the mutex since the system calls may be invoked
+// by the heartbeat thread as well.
+static unsigned long long random_state = 1;
+static pthread_mutex_t random_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Return a random number uniformly distributed in [0, 1).
+static double
+random_fraction(void) {
+    pthread_mutex_lock(&random_mutex);
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    unsigned long long value = random_state * 2685821657736338717ULL;
+    pthread_mutex_unlock(&random_mutex);
+    return (value >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Return whether an event with the specified probability happened.
+static bool
+random_event(double probability) {
+    return probability > 0 && random_fraction() < probability;
+}
+
+// Simulate the round trip to the NFS server. Returns true if the system call should be done, or false if it should
+// fail (with errno set to EIO).
+static bool
+round_trip(void) {
+    long delay_usec = simulation.latency_usec;
+    if (simulation.jitter_usec > 0)
+        delay_usec += (long)(random_fraction() * simulation.jitter_usec);
+    if (delay_usec > 0) {
+        struct timespec delay = { .tv_sec = delay_usec / 1000000, .tv_nsec = (delay_usec % 1000000) * 1000 };
+        while (nanosleep(&delay, &delay) < 0 && errno == EINTR) {
+        }
+    }
+
+    if (random_event(simulation.error_rate)) {
+        errno = EIO;
+        return false;
+    }
+    return true;
+}
+
+static int
+sim_link(const char* old_path, const char* new_path) {
+    if (!round_trip())
+        return -1;
+    int result = link(old_path, new_path);
+    if (result == 0 && random_event(simulation.link_retransmit_rate)) {
+        round_trip();  // The retransmitted request.
+        errno = EEXIST;
+        return -1;
+    }
+    return result;
+}
+
+static int
+sim_unlink(const char* path) {
+    return round_trip() ? unlink(path) : -1;
+}
+
+static int
+sim_rename(const char* old_path, const char* new_path) {
+    return round_trip() ? rename(old_path, new_path) : -1;
+}
+
+static int
+sim_open(const char* path, int flags, mode_t mode) {
+    return round_trip() ? open(path, flags, mode) : -1;
+}
+
+// Closing always closes the file descriptor (even if it reports an error), otherwise we would leak it.
+static int
+sim_close(int fd) {
+    bool is_ok = round_trip();
+    int result = close(fd);
+    if (!is_ok) {
+        errno = EIO;
+        return -1;
+    }
+    return result;
+}
+
+static ssize_t
+sim_read(int fd, void* buffer, size_t size) {
+    return round_trip() ? read(fd, buffer, size) : -1;
+}
+
+static ssize_t
+sim_write(int fd, const void* buffer, size_t size) {
+    return round_trip() ? write(fd, buffer, size) : -1;
+}
+
+static ssize_t
+sim_pread(int fd, void* buffer, size_t size, off_t offset) {
+    return round_trip() ? pread(fd, buffer, size, offset) : -1;
+}
+
+static ssize_t
+sim_pwrite(int fd, const void* buffer, size_t size, off_t offset) {
+    return round_trip() ? pwrite(fd, buffer, size, offset) : -1;
+}
+
+static int
+sim_stat(const char* path, struct stat* stbuf) {
+    return round_trip() ? stat(path, stbuf) : -1;
+}
+
+static int
+sim_fstat(int fd, struct stat* stbuf) {
+    return round_trip() ? fstat(fd, stbuf) : -1;
+}
+
+static DIR*
+sim_opendir(const char* path) {
+    return round_trip() ? opendir(path) : NULL;
+}
+
+// Listing a directory is a single round trip (for a reasonable number of entries), done when it is opened.
+static struct dirent*
+sim_readdir(DIR* dir) {
+    return readdir(dir);
+}
+
+static int
+sim_closedir(DIR* dir) {
+    return closedir(dir);
+}
+
+// Implement narwhal_sim_start. See the header file.
+void
+narwhal_sim_start(const NarwhalSimulation* parameters) {
+    static const NarwhalSyscalls hooks = { .link = sim_link,
+                                           .unlink = sim_unlink,
+                                           .rename = sim_rename,
+                                           .open = sim_open,
+                                           .close = sim_close,
+                                           .read = sim_read,
+                                           .write = sim_write,
+                                           .pread = sim_pread,
+                                           .pwrite = sim_pwrite,
+                                           .stat = sim_stat,
+                                           .fstat = sim_fstat,
+                                           .opendir = sim_opendir,
+                                           .readdir = sim_readdir,
+                                           .closedir = sim_closedir };
+    simulation = *parameters;
+    pthread_mutex_lock(&random_mutex);
+    random_state = simulation.seed ? simulation.seed : 1;  // Xorshift gets stuck at zero.
+    pthread_mutex_unlock(&random_mutex);
+    narwhal_syscalls(&hooks);
+}
+
+// Implement narwhal_sim_stop. See the header file.
+void
+narwhal_sim_stop(void) {
+    narwhal_syscalls(NULL);
+}
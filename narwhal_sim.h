@@ -0,0 +1,66 @@
+#ifndef __NARWHAL_SIM__
+#define __NARWHAL_SIM__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Narwhal NFS simulation
+//
+// Testing the scaling behavior of Narwhal requires many NFS clients accessing the same NFS server, which is not always
+// available. This replaces the system calls used by Narwhal (see narwhal_syscalls) with wrappers which simulate the
+// behavior of a (slow, unreliable) NFS server on top of a local file system, something like:
+//
+//      #include <narwhal_sim.h>
+//
+//      NarwhalSimulation simulation = {
+//              .latency_usec = 500,
+//              .jitter_usec = 200,
+//              .link_retransmit_rate = 0.01,
+//              .seed = 17
+//      };
+//
+//      narwhal_sim_start(&simulation);
+//      ... use Narwhal as usual ...
+//      narwhal_sim_stop();
+//
+// Since this only wraps the local system calls, it does not simulate the NFS caching semantics; it is meant for
+// measuring the effect of the latency and the errors of the server on the lock protocol, not for verifying it.
+
+#include <sys/types.h>
+
+// The parameters of the simulation.
+typedef struct {
+    // The latency of each system call in microseconds.
+    long latency_usec;
+
+    // The maximal random jitter added to the latency of each system call in microseconds.
+    long jitter_usec;
+
+    // The probability that the reply to a successful link is lost. In this case, the NFS client retransmits the
+    // request, which fails with EEXIST since the link already exists (the NFS server does not always detect such
+    // duplicates).
+    double link_retransmit_rate;
+
+    // The probability that a system call fails with EIO without doing anything.
+    double error_rate;
+
+    // The seed of the random number generator, to make the simulation reproducible. Processes sharing the same lockdir
+    // should use different seeds.
+    unsigned long long seed;
+} NarwhalSimulation;
+
+// Start simulating NFS using the specified parameters (which are copied). This should be called before accessing any
+// lockdir, as it replaces the system calls used by Narwhal.
+extern void
+narwhal_sim_start(const NarwhalSimulation* simulation);
+
+// Stop simulating NFS, restoring the default system calls.
+extern void
+narwhal_sim_stop(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
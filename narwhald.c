@@ -0,0 +1,81 @@
+#include "narwhal_coordinator.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// A local coordinator daemon (see narwhal_coordinator.h). Run it on each host, and set the coordinator parameter of the
+// local clients to the path of its socket.
+
+// Print usage and exit.
+static void
+usage(const char* program) {
+    fprintf(stderr, "usage: %s -s SOCKET [options]\n", program);
+    fprintf(stderr, "  -s PATH  unix socket to listen on\n");
+    fprintf(stderr, "  -u USEC  spin_usec (default: 1000)\n");
+    fprintf(stderr, "  -m USEC  max_spin_usec (default: 0)\n");
+    fprintf(stderr, "  -g X     spin_growth (default: 0)\n");
+    fprintf(stderr, "  -j X     spin_jitter (default: 0)\n");
+    fprintf(stderr, "  -t SEC   timeout_sec (default: 10)\n");
+    fprintf(stderr, "  -T MSEC  timeout_msec (default: 0, overrides -t if set)\n");
+    fprintf(stderr, "  -l SEC   read_lease_sec (default: 0)\n");
+    fprintf(stderr, "  -P NAME  policy, fifo, reader or writer (default: fifo)\n");
+    fprintf(stderr, "  -n       disable the heartbeat\n");
+    exit(1);
+}
+
+int
+main(int argc, char* argv[]) {
+    const char* socket_path = NULL;
+    Narwhal narwhal = { .spin_usec = 1000, .timeout_sec = 10, .heartbeat = true };
+
+    int option;
+    while ((option = getopt(argc, argv, "s:u:m:g:j:t:T:l:P:n")) != -1) {
+        switch (option) {
+        case 's':
+            socket_path = optarg;
+            break;
+        case 'u':
+            narwhal.spin_usec = atol(optarg);
+            break;
+        case 'm':
+            narwhal.max_spin_usec = atol(optarg);
+            break;
+        case 'g':
+            narwhal.spin_growth = atof(optarg);
+            break;
+        case 'j':
+            narwhal.spin_jitter = atof(optarg);
+            break;
+        case 't':
+            narwhal.timeout_sec = atol(optarg);
+            break;
+        case 'T':
+            narwhal.timeout_msec = atol(optarg);
+            break;
+        case 'l':
+            narwhal.read_lease_sec = atol(optarg);
+            break;
+        case 'P':
+            if (!strcmp(optarg, "reader"))
+                narwhal.policy = NARWHAL_READER_POLICY;
+            else if (!strcmp(optarg, "writer"))
+                narwhal.policy = NARWHAL_WRITER_POLICY;
+            else if (strcmp(optarg, "fifo"))
+                usage(argv[0]);
+            break;
+        case 'n':
+            narwhal.heartbeat = false;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc || !socket_path)
+        usage(argv[0]);
+
+    narwhal_coordinate(&narwhal, socket_path);
+    perror(socket_path);
+    return 1;
+}
@@ -1,13 +1,21 @@
 #include "narwhal.h"
+#include "narwhal_coordinator.h"
+#include "narwhal_sim.h"
 
 #include <assert.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 void
@@ -87,6 +95,1818 @@ test_write_lock(const char* lockdir) {
     assert_errno("narwhal_unlock", NULL);
 }
 
+// Wait for a forked child process and verify it exited successfully.
+void
+wait_child(pid_t child) {
+    int status;
+    waitpid(child, &status, 0);
+    assert_errno("waitpid", NULL);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+// Have a child process wait for a read lock while we are holding a write lock.
+void
+contend(const Narwhal* narwhal) {
+    narwhal_pid("1");
+    narwhal_write_lock(narwhal);
+    assert_errno("narwhal_write_lock", NULL);
+
+    pid_t child = fork();
+    assert_errno("fork", NULL);
+    if (!child) {
+        narwhal_pid("2");
+        narwhal_read_lock(narwhal);
+        assert_errno("narwhal_read_lock", NULL);
+        narwhal_unlock(narwhal);
+        assert_errno("narwhal_unlock", NULL);
+        exit(0);
+    }
+
+    usleep(50000);
+    narwhal_unlock(narwhal);
+    assert_errno("narwhal_unlock", NULL);
+
+    wait_child(child);
+}
+
+void
+test_backoff(const char* lockdir) {
+    fprintf(stderr, "test_backoff\n");
+    const Narwhal narwhal = { .lockdir = lockdir,
+                              .spin_usec = 100,
+                              .max_spin_usec = 10000,
+                              .spin_growth = 1.5,
+                              .spin_jitter = 0.5,
+                              .timeout_sec = 10 };
+    contend(&narwhal);
+}
+
+// Return whether a file exists in the lockdir.
+bool
+lockdir_has(const char* lockdir, const char* name) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", lockdir, name);
+    bool result = access(path, F_OK) == 0;
+    errno = 0;
+    return result;
+}
+
+void
+test_private_file(const char* lockdir) {
+    fprintf(stderr, "test_private_file\n");
+    const Narwhal narwhal = { .lockdir = lockdir, .spin_usec = 1000, .timeout_sec = 10 };
+
+    narwhal_hostname("host");
+    narwhal_pid("1");
+
+    narwhal_read_lock(&narwhal);
+    assert_errno("narwhal_read_lock", NULL);
+    assert(lockdir_has(lockdir, "host.1") && lockdir_has(lockdir, "host.1.alt"));
+    assert(!lockdir_has(lockdir, "lockfile"));
+
+    narwhal_unlock(&narwhal);
+    assert_errno("narwhal_unlock", NULL);
+    assert(lockdir_has(lockdir, "host.1") && lockdir_has(lockdir, "host.1.alt"));
+
+    narwhal_close(&narwhal);
+    assert_errno("narwhal_close", NULL);
+    assert(!lockdir_has(lockdir, "host.1") && !lockdir_has(lockdir, "host.1.alt"));
+}
+
+void
+test_stale_lock(const char* lockdir) {
+    fprintf(stderr, "test_stale_lock\n");
+    const Narwhal narwhal = { .lockdir = lockdir, .spin_usec = 1000, .max_spin_usec = 100000, .timeout_sec = 1 };
+
+    pid_t child = fork();
+    assert_errno("fork", NULL);
+    if (!child) {
+        narwhal_pid("1");
+        narwhal_write_lock(&narwhal);
+        assert_errno("narwhal_write_lock", NULL);
+        _exit(0);  // Crash while holding the lock.
+    }
+    wait_child(child);
+
+    narwhal_pid("2");
+    narwhal_read_lock(&narwhal);
+    assert_errno("narwhal_read_lock", NULL);
+
+    narwhal_unlock(&narwhal);
+    assert_errno("narwhal_unlock", NULL);
+}
+
+// The number of seconds since some start time (using CLOCK_MONOTONIC).
+double
+seconds_since(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec - start->tv_sec + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void
+test_msec_timeout(const char* lockdir) {
+    fprintf(stderr, "test_msec_timeout\n");
+    const Narwhal narwhal = {
+        .lockdir = lockdir, .spin_usec = 1000, .max_spin_usec = 10000, .timeout_msec = 300, .heartbeat = true
+    };
+
+    pid_t child = fork();
+    assert_errno("fork", NULL);
+    if (!child) {
+        narwhal_pid("1");
+        narwhal_write_lock(&narwhal);
+        assert_errno("narwhal_write_lock", NULL);
+        _exit(0);  // Crash while holding the lock.
+    }
+    wait_child(child);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    narwhal_pid("2");
+    narwhal_write_lock(&narwhal);
+    assert_errno("narwhal_write_lock", NULL);
+    assert(seconds_since(&start) < 1.5);  // The crashed holder was detected quickly.
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    child = fork();
+    assert_errno("fork", NULL);
+    if (!child) {
+        narwhal_pid("3");
+        narwhal_write_lock(&narwhal);
+        assert_errno("narwhal_write_lock", NULL);
+        assert(seconds_since(&start) >= 1);  // The heartbeat kept our lock from becoming stale.
+        narwhal_unlock(&narwhal);
+        assert_errno("narwhal_unlock", NULL);
+        exit(0);
+    }
+
+    usleep(1000000);  // Much longer than the timeout.
+    narwhal_unlock(&narwhal);
+    assert_errno("narwhal_unlock", NULL);
+    wait_child(child);
+}
+
+void
+test_abandoned_lockfile(const char* lockdir) {
+    fprintf(stderr, "test_abandoned_lockfile\n");
+    const Narwhal narwhal = { .lockdir = lockdir, .spin_usec = 1000, .max_spin_usec = 10000, .timeout_msec = 500 };
+
+    // Some process died while holding the lockfile.
+    char private_path[PATH_MAX];
+    snprintf(private_path, sizeof(private_path), "%s/host.9", lockdir);
+    char lockfile_path[PATH_MAX];
+    snprintf(lockfile_path, sizeof(lockfile_path), "%s/lockfile", lockdir);
+    close(open(private_path, O_CREAT | O_WRONLY, 0777));
+    assert_errno("open(", private_path, ")", NULL);
+    link(private_path, lockfile_path);
+    assert_errno("link(", lockfile_path, ")", NULL);
+
+    narwhal_stats_reset(NULL);
+    assert_errno("narwhal_stats_reset", NULL);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    narwhal_pid("1");
+    narwhal_write_lock(&narwhal);
+    assert_errno("narwhal_write_lock", NULL);
+    assert(seconds_since(&start) < 1.5);  // Broken after about the timeout.
+    assert(!lockdir_has(lockdir, "host.1.broken"));
+
+    NarwhalStats stats;
+    narwhal_stats(&narwhal, &stats);
+    assert_errno("narwhal_stats", NULL);
+    assert(stats.lockfile_breaks == 1);
+
+    narwhal_unlock(&narwhal);
+    assert_errno("narwhal_unlock", NULL);
+    assert(!lockdir_has(lockdir, "lockfile"));
+    unlink(private_path);
+    assert_errno("unlink(", private_path, ")", NULL);
+}
+
+// Hooks for a stalled holder of the lockfile, which releases it and obtains it again just as some other client breaks
+// it. The holder stalls in its next two exclusive sections (when replacing the state file, after the first time it did
+// so) until told to continue. The breaker
+// tells it to continue when it is about to rename the lockfile away, waits until it obtained the lockfile again, and
+// lets it go on once the lockfile is linked again (either restored, or obtained by the breaker).
+static int relink_fds[2];  // Reading messages from the other process, writing messages to it.
+static int n_relink_states;
+static int n_relink_stalls;
+static bool is_relink_renamed;
+static bool is_relink_restored;
+
+bool
+has_path_suffix(const char* path, const char* suffix) {
+    size_t path_length = strlen(path);
+    size_t suffix_length = strlen(suffix);
+    return path_length >= suffix_length && !strcmp(path + path_length - suffix_length, suffix);
+}
+
+void
+relink_send(char message) {
+    assert(write(relink_fds[1], &message, 1) == 1);
+}
+
+void
+relink_receive(char expected) {
+    char message;
+    assert(read(relink_fds[0], &message, 1) == 1 && message == expected);
+}
+
+int
+stalling_rename(const char* old_path, const char* new_path) {
+    if (has_path_suffix(new_path, "/state") && ++n_relink_states > 1 && n_relink_stalls < 2) {
+        n_relink_stalls++;
+        relink_send(n_relink_stalls == 1 ? 'h' : 'r');  // Holding the lockfile (again).
+        relink_receive(n_relink_stalls == 1 ? '1' : '2');
+    }
+    return rename(old_path, new_path);
+}
+
+int
+breaking_rename(const char* old_path, const char* new_path) {
+    if (has_path_suffix(old_path, "/lockfile") && !is_relink_renamed) {
+        relink_send('1');
+        relink_receive('r');
+        is_relink_renamed = true;
+    }
+    return rename(old_path, new_path);
+}
+
+int
+breaking_link(const char* old_path, const char* new_path) {
+    int result = link(old_path, new_path);
+    if (result == 0 && is_relink_renamed && n_relink_stalls == 0) {
+        n_relink_stalls = 1;
+        is_relink_restored = has_path_suffix(old_path, ".broken");
+        relink_send('2');
+    }
+    return result;
+}
+
+int
+hook_open(const char* path, int flags, mode_t mode) {
+    return open(path, flags, mode);
+}
+
+int
+hook_stat(const char* path, struct stat* stbuf) {
+    return stat(path, stbuf);
+}
+
+int
+hook_fstat(int fd, struct stat* stbuf) {
+    return fstat(fd, stbuf);
+}
+
+// Install system call hooks which only replace link and rename.
+void
+hook_syscalls(int (*link_hook)(const char*, const char*), int (*rename_hook)(const char*, const char*)) {
+    const NarwhalSyscalls hooks = { .link = link_hook,
+                                    .unlink = unlink,
+                                    .rename = rename_hook,
+                                    .open = hook_open,
+                                    .close = close,
+                                    .read = read,
+                                    .write = write,
+                                    .pread = pread,
+                                    .pwrite = pwrite,
+                                    .stat = hook_stat,
+                                    .fstat = hook_fstat,
+                                    .opendir = opendir,
+                                    .readdir = readdir,
+                                    .closedir = closedir };
+    narwhal_syscalls(&hooks);
+}
+
+void
+test_relinked_lockfile(const char* lockdir) {
+    fprintf(stderr, "test_relinked_lockfile\n");
+    const Narwhal narwhal = { .lockdir = lockdir, .spin_usec = 1000, .max_spin_usec = 10000, .timeout_msec = 500 };
+
+    int to_child[2];
+    int to_parent[2];
+    pipe(to_child);
+    assert_errno("pipe", NULL);
+    pipe(to_parent);
+    assert_errno("pipe", NULL);
+
+    pid_t child = fork();
+    assert_errno("fork", NULL);
+    if (!child) {
+        relink_fds[0] = to_child[0];
+        relink_fds[1] = to_parent[1];
+        hook_syscalls(link, stalling_rename);
+        narwhal_pid("9");
+        narwhal_write_lock(&narwhal);
+        assert_errno("narwhal_write_lock", NULL);
+        narwhal_unlock(&narwhal);  // Stalls while holding the lockfile for longer than the timeout.
+        assert_errno("narwhal_unlock", NULL);
+        narwhal_write_lock(&narwhal);  // Obtains the lockfile again just as it is broken.
+        assert_errno("narwhal_write_lock", NULL);
+        narwhal_unlock(&narwhal);
+        assert_errno("narwhal_unlock", NULL);
+        narwhal_close(&narwhal);
+        assert_errno("narwhal_close", NULL);
+        exit(0);
+    }
+
+    relink_fds[0] = to_parent[0];
+    relink_fds[1] = to_child[1];
+    relink_receive('h');
+    hook_syscalls(breaking_link, breaking_rename);
+    narwhal_stats_reset(NULL);
+    assert_errno("narwhal_stats_reset", NULL);
+    narwhal_pid("1");
+    narwhal_write_lock(&narwhal);
+    assert_errno("narwhal_write_lock", NULL);
+    narwhal_syscalls(NULL);
+    wait_child(child);
+
+    // The lockfile the holder obtained again was restored, rather than broken.
+    assert(is_relink_renamed && is_relink_restored);
+    NarwhalStats stats;
+    narwhal_stats(&narwhal, &stats);
+    assert_errno("narwhal_stats", NULL);
+    assert(stats.lockfile_breaks == 0);
+
+    narwhal_unlock(&narwhal);
+    assert_errno("narwhal_unlock", NULL);
+    assert(!lockdir_has(lockdir, "lockfile"));
+    for (int index = 0; index < 2; index++) {
+        close(to_child[index]);
+        close(to_parent[index]);
+    }
+}
+
+void
+test_state_file(const char* lockdir) {
+    fprintf(stderr, "test_state_file\n");
+    const Narwhal narwhal = { .lockdir = lockdir, .spin_usec = 1000, .timeout_sec = 10 };
+
+    narwhal_hostname("host");
+    narwhal_pid("1");
+
+    narwhal_write_lock(&narwhal);
+    assert_errno("narwhal_write_lock", NULL);
+    assert(!lockdir_has(lockdir, "host.1.tmp"));
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/state", lockdir);
+    FILE* state_fp = fopen(path, "r");
+    assert_errno("fopen(", path, ")", NULL);
+    char line[1024];
+    assert(fgets(line, sizeof(line), state_fp));
+    assert(!strncmp(line, "host 1 W G ", 11));
+    assert(!fgets(line, sizeof(line), state_fp));
+    fclose(state_fp);
+    errno = 0;
+
+    narwhal_unlock(&narwhal);
+    assert_errno("narwhal_unlock", NULL);
+    assert(!lockdir_has(lockdir, "host.1.tmp"));
+}
+
+// Read the state file of the lockdir into a buffer.
+size_t
+read_state(const char* lockdir, char* buffer, size_t capacity) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/state", lockdir);
+    FILE* state_fp = fopen(path, "r");
+    assert_errno("fopen(", path, ")", NULL);
+    size_t size = fread(buffer, 1, capacity - 1, state_fp);
+    buffer[size] = '\0';
+    fclose(state_fp);
+    return size;
+}
+
+void
+test_fixed_state(const char* lockdir) {
+    fprintf(stderr, "test_fixed_state\n");
+    const Narwhal narwhal = { .lockdir = lockdir,
+                              .spin_usec = 1000,
+                              .timeout_sec = 10,
+                              .state_format = NARWHAL_FIXED_STATE };
+    char state[4096];
+    const size_t records_offset = 61 + 9 + 2 * NARWHAL_MAX_PAYLOAD + 1;  // The header and the (empty) payload lines.
+
+    narwhal_hostname("host");
+    narwhal_pid("1");
+    narwhal_read_lock(&narwhal);
+    assert_errno("narwhal_read_lock", NULL);
+
+    narwhal_pid("2");
+    narwhal_read_lock(&narwhal);
+    assert_errno("narwhal_read_lock", NULL);
+
+    size_t size = read_state(lockdir, state, sizeof(state));
+    assert(!strncmp(state, "narwhal 00000000000000000002 0000000000 00000000000000000000\n", 61));
+    assert(!strncmp(state + 61, "#payload  ", 10) && state[records_offset - 1] == '\n');
+    size_t record_size = (size - records_offset) / 2;
+    assert(size == records_offset + 2 * record_size);
+    assert(!strncmp(state + records_offset, "host ", 5));
+    assert(!strncmp(state + records_offset + record_size, "host ", 5));
+
+    narwhal_pid("1");
+    narwhal_unlock(&narwhal);
+    assert_errno("narwhal_unlock", NULL);
+
+    assert(read_state(lockdir, state, sizeof(state)) == size);
+    assert(!strncmp(state, "narwhal 00000000000000000003 0000000000 00000000000000000000\n", 61));
+    assert(state[records_offset] == ' ' && state[records_offset + record_size - 1] == '\n');
+
+    narwhal_pid("3");
+    narwhal_read_lock(&narwhal);
+    assert_errno("narwhal_read_lock", NULL);
+
+    assert(read_state(lockdir, state, sizeof(state)) == size);  // Reused the free record.
+    assert(!strncmp(state + records_offset, "host ", 5));
+    assert(strstr(state + records_offset, " 3 "));
+
+    narwhal_pid("2");
+    narwhal_unlock(&narwhal);
+    assert_errno("narwhal_unlock", NULL);
+
+    narwhal_pid("3");
+    narwhal_unlock(&narwhal);
+    assert_errno("narwhal_unlock", NULL);
+
+    contend(&narwhal);
+}
+
+void
+test_write_generation(const char* lockdir) {
+    fprintf(stderr, "test_write_generation\n");
+    Narwhal narwhal = { .lockdir = lockdir, .spin_usec = 1000, .timeout_sec = 10 };
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/state", lockdir);
+    char state[4096];
+
+    narwhal_hostname("host");
+    narwhal_pid("1");
+    for (int format = 0; format < 2; format++) {
+        narwhal.state_format = format ? NARWHAL_FIXED_STATE : NARWHAL_TEXT_STATE;
+        unsigned long long generation = 1;
+        narwhal_read_lock_gen(&narwhal, &generation);
+        assert_errno("narwhal_read_lock_gen", NULL);
+        assert(generation == 0);
+        narwhal_unlock(&narwhal);
+        assert_errno("narwhal_unlock", NULL);
+
+        narwhal_write_lock(&narwhal);
+        assert_errno("narwhal_write_lock", NULL);
+        narwhal_unlock(&narwhal);
+        assert_errno("narwhal_unlock", NULL);
+        narwhal_read_lock(&narwhal);  // Readers do not change the generation.
+        assert_errno("narwhal_read_lock", NULL);
+        narwhal_unlock(&narwhal);
+        assert_errno("narwhal_unlock", NULL);
+        narwhal_read_lock_gen(&narwhal, &generation);
+        assert_errno("narwhal_read_lock_gen", NULL);
+        assert(generation == 1);
+        narwhal_unlock(&narwhal);
+        assert_errno("narwhal_unlock", NULL);
+
+        narwhal_write_lock(&narwhal);
+        assert_errno("narwhal_write_lock", NULL);
+        narwhal_downgrade(&narwhal);
+        assert_errno("narwhal_downgrade", NULL);
+        narwhal_unlock(&narwhal);
+        assert_errno("narwhal_unlock", NULL);
+        narwhal_read_lock_gen(&narwhal, &generation);
+        assert_errno("narwhal_read_lock_gen", NULL);
+        assert(generation == 2);
+        narwhal_unlock(&narwhal);
+        assert_errno("narwhal_unlock", NULL);
+
+        read_state(lockdir, state, sizeof(state));
+        if (format)
+            assert(!strncmp(state + 39, " 00000000000000000002\n", 22));
+        else
+            assert(!strcmp(state, "#writes 2\n"));
+        unlink(path);  // Hard reset the lockdir.
+        assert_errno("unlink(", path, ")", NULL);
+    }
+
+    narwhal.protocol = NARWHAL_SLOT_PROTOCOL;
+    unsigned long long generation;
+    assert(narwhal_read_lock_gen(&narwhal, &generation) < 0 && errno == ENOTSUP);
+    errno = 0;
+}
+
+void
+test_payload(const char* lockdir) {
+    fprintf(stderr, "test_payload\n");
+    Narwhal narwhal = { .lockdir = lockdir, .spin_usec = 1000, .max_spin_usec = 10000, .timeout_sec = 10 };
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/state", lockdir);
+    char payload[NARWHAL_MAX_PAYLOAD + 1];
+
+    narwhal_hostname("host");
+    narwhal_pid("1");
+    for (int format = 0; format < 2; format++) {
+        narwhal.state_format = format ? NARWHAL_FIXED_STATE : NARWHAL_TEXT_STATE;
+        narwhal_read_lock(&narwhal);
+        assert_errno("narwhal_read_lock", NULL);
+        assert(narwhal_get_payload(&narwhal, payload, sizeof(payload)) == 0);
+        assert(narwhal_unlock_payload(&narwhal, "x", 1) < 0 && errno == ENOTSUP);  // Only writers set it.
+        errno = 0;
+        narwhal_unlock(&narwhal);
+        assert_errno("narwhal_unlock", NULL);
+        assert(narwhal_get_payload(&narwhal, payload, sizeof(payload)) < 0 && errno == ENOTSUP);
+        errno = 0;
+
+        narwhal_write_lock(&narwhal);
+        assert_errno("narwhal_write_lock", NULL);
+        assert(narwhal_unlock_payload(&narwhal, payload, sizeof(payload)) < 0 && errno == EMSGSIZE);
+        errno = 0;
+        narwhal_unlock_payload(&narwhal, "dataset-17", 10);
+        assert_errno("narwhal_unlock_payload", NULL);
+
+        pid_t child = fork();
+        assert_errno("fork", NULL);
+        if (!child) {
+            narwhal_pid("2");
+            narwhal_read_lock(&narwhal);
+            assert_errno("narwhal_read_lock", NULL);
+            assert(narwhal_get_payload(&narwhal, payload, 4) < 0 && errno == ERANGE);
+            errno = 0;
+            assert(narwhal_get_payload(&narwhal, payload, sizeof(payload)) == 10);
+            assert(!memcmp(payload, "dataset-17", 10));
+            narwhal_unlock(&narwhal);
+            assert_errno("narwhal_unlock", NULL);
+            exit(0);
+        }
+        wait_child(child);
+
+        // The payload is kept by write locks which do not set it, until it is cleared.
+        narwhal_write_lock(&narwhal);
+        assert_errno("narwhal_write_lock", NULL);
+        assert(narwhal_get_payload(&narwhal, payload, sizeof(payload)) == 10);
+        narwhal_unlock(&narwhal);
+        assert_errno("narwhal_unlock", NULL);
+        narwhal_write_lock(&narwhal);
+        assert_errno("narwhal_write_lock", NULL);
+        assert(narwhal_get_payload(&narwhal, payload, sizeof(payload)) == 10);
+        narwhal_unlock_payload(&narwhal, "", 0);
+        assert_errno("narwhal_unlock_payload", NULL);
+        narwhal_read_lock(&narwhal);
+        assert_errno("narwhal_read_lock", NULL);
+        assert(narwhal_get_payload(&narwhal, payload, sizeof(payload)) == 0);
+        narwhal_unlock(&narwhal);
+        assert_errno("narwhal_unlock", NULL);
+
+        unlink(path);  // Hard reset the lockdir.
+        assert_errno("unlink(", path, ")", NULL);
+    }
+}
+
+void
+test_many_lockdirs(const char* lockdir) {
+    fprintf(stderr, "test_many_lockdirs\n");
+    char lockdirs[3][PATH_MAX];
+    Narwhal narwhals[3];
+    narwhal_hostname("host");
+    narwhal_pid("1");
+    for (int i = 0; i < 3; i++) {
+        snprintf(lockdirs[i], sizeof(lockdirs[i]), "%s/%d", lockdir, i);
+        mkdir(lockdirs[i], 0777);
+        assert_errno("mkdir(", lockdirs[i], ")", NULL);
+        narwhals[i] = (Narwhal){ .lockdir = lockdirs[i], .spin_usec = 1000, .timeout_sec = 10 };
+        narwhal_open(&narwhals[i]);
+        assert_errno("narwhal_open", NULL);
+    }
+
+    for (int i = 0; i < 3; i++) {
+        if (i % 2)
+            narwhal_write_lock(&narwhals[i]);
+        else
+            narwhal_read_lock(&narwhals[i]);
+        assert_errno("narwhal_*_lock", NULL);
+        assert(lockdir_has(lockdirs[i], "host.1"));
+    }
+
+    for (int i = 0; i < 3; i++) {
+        narwhal_unlock(&narwhals[i]);
+        assert_errno("narwhal_unlock", NULL);
+        narwhal_close(&narwhals[i]);
+        assert_errno("narwhal_close", NULL);
+        assert(!lockdir_has(lockdirs[i], "host.1"));
+        cleanup(lockdirs[i]);
+    }
+}
+
+// Skip the write generation line (if any) of a text format state file.
+const char*
+skip_write_generation(const char* state) {
+    return *state == '#' ? strchr(state, '\n') + 1 : state;
+}
+
+// Count the request lines in the state file of the lockdir (ignoring the write generation line).
+int
+count_state_lines(const char* lockdir) {
+    char state[4096];
+    read_state(lockdir, state, sizeof(state));
+    int n_lines = 0;
+    for (const char* p = state; *p; p = strchr(p, '\n') + 1)
+        n_lines += *p != '#';
+    return n_lines;
+}
+
+// Shared between the threads of test_shared_locks.
+static const Narwhal* shared_narwhal;
+static pthread_barrier_t shared_barrier;
+static int n_shared_writers;
+static int shared_counter;
+
+void*
+shared_reader(void* arg) {
+    narwhal_shared_read_lock(shared_narwhal);
+    assert_errno("narwhal_shared_read_lock", NULL);
+    pthread_barrier_wait(&shared_barrier);  // All readers hold the lock.
+    pthread_barrier_wait(&shared_barrier);  // The main thread looked at the state.
+    narwhal_shared_unlock(shared_narwhal);
+    assert_errno("narwhal_shared_unlock", NULL);
+    return arg;
+}
+
+void*
+shared_writer(void* arg) {
+    for (int i = 0; i < 10; i++) {
+        narwhal_shared_write_lock(shared_narwhal);
+        assert_errno("narwhal_shared_write_lock", NULL);
+        assert(++n_shared_writers == 1);
+        shared_counter++;
+        usleep(100);
+        assert(--n_shared_writers == 0);
+        narwhal_shared_unlock(shared_narwhal);
+        assert_errno("narwhal_shared_unlock", NULL);
+    }
+    return arg;
+}
+
+void
+test_shared_locks(const char* lockdir) {
+    fprintf(stderr, "test_shared_locks\n");
+    const Narwhal narwhal = { .lockdir = lockdir, .spin_usec = 100, .max_spin_usec = 1000, .timeout_sec = 10 };
+    shared_narwhal = &narwhal;
+
+    pthread_t threads[4];
+    pthread_barrier_init(&shared_barrier, NULL, 5);
+    for (int i = 0; i < 4; i++)
+        pthread_create(&threads[i], NULL, shared_reader, NULL);
+    pthread_barrier_wait(&shared_barrier);
+    assert(count_state_lines(lockdir) == 1);  // A single (NFS) read lock for all the threads.
+    pthread_barrier_wait(&shared_barrier);
+    for (int i = 0; i < 4; i++)
+        pthread_join(threads[i], NULL);
+    pthread_barrier_destroy(&shared_barrier);
+    assert(count_state_lines(lockdir) == 0);
+
+    for (int i = 0; i < 4; i++)
+        pthread_create(&threads[i], NULL, shared_writer, NULL);
+    for (int i = 0; i < 4; i++)
+        pthread_join(threads[i], NULL);
+    assert(shared_counter == 40);
+    assert(count_state_lines(lockdir) == 0);
+}
+
+// Shared between the threads of test_shared_readers_stream.
+static volatile bool is_stream_stopped;
+
+void*
+stream_reader(void* arg) {
+    int* n_locks = arg;
+    while (!is_stream_stopped) {
+        narwhal_shared_read_lock(shared_narwhal);
+        assert_errno("narwhal_shared_read_lock", NULL);
+        usleep(2000);
+        narwhal_shared_unlock(shared_narwhal);
+        assert_errno("narwhal_shared_unlock", NULL);
+        ++*n_locks;
+    }
+    return arg;
+}
+
+void
+test_shared_readers_stream(const char* lockdir) {
+    fprintf(stderr, "test_shared_readers_stream\n");
+    const Narwhal narwhal = { .lockdir = lockdir, .spin_usec = 100, .max_spin_usec = 1000, .timeout_sec = 10 };
+    shared_narwhal = &narwhal;
+    is_stream_stopped = false;
+
+    // Overlapping local readers, so there is always some thread holding the shared read lock.
+    narwhal_hostname("host");
+    narwhal_pid("1");
+    pthread_t threads[4];
+    int n_locks[4] = { 0 };
+    for (int i = 0; i < 4; i++)
+        pthread_create(&threads[i], NULL, stream_reader, &n_locks[i]);
+    while (!lockdir_has(lockdir, "state") || count_state_lines(lockdir) < 1)
+        usleep(1000);
+
+    pid_t child = fork();
+    assert_errno("fork", NULL);
+    if (!child) {
+        narwhal_pid("2");
+        narwhal_write_lock(&narwhal);
+        assert_errno("narwhal_write_lock", NULL);
+        narwhal_unlock(&narwhal);
+        assert_errno("narwhal_unlock", NULL);
+        exit(0);
+    }
+
+    // The remote writer must get the lock even though the local readers never stop.
+    int status = 0;
+    pid_t waited = 0;
+    for (int i = 0; i < 5000 && !waited; i++) {
+        usleep(1000);
+        waited = waitpid(child, &status, WNOHANG);
+    }
+    if (!waited) {
+        kill(child, SIGKILL);
+        waitpid(child, NULL, 0);
+    }
+    assert(waited == child && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    is_stream_stopped = true;
+    for (int i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+        assert(n_locks[i] > 0);
+    }
+    assert(count_state_lines(lockdir) == 0);
+}
+
+// Return the modification time of the state file of the lockdir.
+struct timespec
+state_mtime(const char* lockdir) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/state", lockdir);
+    struct stat stbuf;
+    stat(path, &stbuf);
+    assert_errno("stat(", path, ")", NULL);
+    return stbuf.st_mtim;
+}
+
+void
+test_read_lease(const char* lockdir) {
+    fprintf(stderr, "test_read_lease\n");
+    const Narwhal narwhal = { .lockdir = lockdir,
+                              .spin_usec = 1000,
+                              .max_spin_usec = 10000,
+                              .timeout_sec = 10,
+                              .read_lease_sec = 5 };
+
+    narwhal_hostname("host");
+    narwhal_pid("1");
+    narwhal_read_lock(&narwhal);
+    assert_errno("narwhal_read_lock", NULL);
+    narwhal_unlock(&narwhal);
+    assert_errno("narwhal_unlock", NULL);
+    assert(count_state_lines(lockdir) == 1);  // Still holding the lease.
+
+    struct timespec mtime = state_mtime(lockdir);
+    for (int i = 0; i < 10; i++) {
+        narwhal_read_lock(&narwhal);
+        assert_errno("narwhal_read_lock", NULL);
+        narwhal_unlock(&narwhal);
+        assert_errno("narwhal_unlock", NULL);
+    }
+    struct timespec new_mtime = state_mtime(lockdir);
+    assert(mtime.tv_sec == new_mtime.tv_sec && mtime.tv_nsec == new_mtime.tv_nsec);
+
+    pid_t child = fork();
+    assert_errno("fork", NULL);
+    if (!child) {
+        narwhal_pid("2");
+        narwhal_write_lock(&narwhal);
+        assert_errno("narwhal_write_lock", NULL);
+        narwhal_unlock(&narwhal);
+        assert_errno("narwhal_unlock", NULL);
+        exit(0);
+    }
+
+    while (count_state_lines(lockdir) < 2)
+        usleep(1000);
+
+    narwhal_read_lock(&narwhal);  // Notices the pending writer, so releases the lease before requesting a new one.
+    assert_errno("narwhal_read_lock", NULL);
+    narwhal_unlock(&narwhal);
+    assert_errno("narwhal_unlock", NULL);
+
+    narwhal_close(&narwhal);  // Releases the lease.
+    assert_errno("narwhal_close", NULL);
+    wait_child(child);
+    assert(count_state_lines(lockdir) == 0);
+}
+
+void
+test_heartbeat(const char* lockdir) {
+    fprintf(stderr, "test_heartbeat\n");
+    const Narwhal narwhal = {
+        .lockdir = lockdir, .spin_usec = 1000, .max_spin_usec = 100000, .timeout_sec = 2, .heartbeat = true
+    };
+
+    narwhal_hostname("host");
+    narwhal_pid("1");
+    narwhal_write_lock(&narwhal);
+    assert_errno("narwhal_write_lock", NULL);
+
+    time_t start_time = time(NULL);
+    pid_t child = fork();
+    assert_errno("fork", NULL);
+    if (!child) {
+        narwhal_pid("2");
+        narwhal_write_lock(&narwhal);
+        assert_errno("narwhal_write_lock", NULL);
+        assert(time(NULL) - start_time >= 4);  // Our lock was not considered stale.
+        narwhal_unlock(&narwhal);
+        assert_errno("narwhal_unlock", NULL);
+        exit(0);
+    }
+
+    sleep(5);  // Much longer than timeout_sec.
+    narwhal_unlock(&narwhal);
+    assert_errno("narwhal_unlock", NULL);
+    wait_child(child);
+}
+
+void
+test_try_lock(const char* lockdir) {
+    fprintf(stderr, "test_try_lock\n");
+    const Narwhal narwhal = { .lockdir = lockdir, .spin_usec = 1000, .max_spin_usec = 10000, .timeout_sec = 10 };
+
+    narwhal_hostname("host");
+    narwhal_pid("1");
+    narwhal_write_lock(&narwhal);
+    assert_errno("narwhal_write_lock", NULL);
+
+    pid_t child = fork();
+    assert_errno("fork", NULL);
+    if (!child) {
+        narwhal_pid("2");
+        assert(narwhal_try_read_lock(&narwhal) < 0 && errno == EBUSY);
+        errno = 0;
+        assert(count_state_lines(lockdir) == 1);  // Our request was withdrawn.
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 100000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        assert(narwhal_write_lock_until(&narwhal, &deadline) < 0 && errno == ETIMEDOUT);
+        errno = 0;
+        assert(count_state_lines(lockdir) == 1);  // Our request was withdrawn.
+        exit(0);
+    }
+    wait_child(child);
+
+    narwhal_unlock(&narwhal);
+    assert_errno("narwhal_unlock", NULL);
+
+    narwhal_try_write_lock(&narwhal);
+    assert_errno("narwhal_try_write_lock", NULL);
+    narwhal_unlock(&narwhal);
+    assert_errno("narwhal_unlock", NULL);
+    assert(count_state_lines(lockdir) == 0);
+}
+
+void
+test_async_lock(const char* lockdir) {
+    fprintf(stderr, "test_async_lock\n");
+    const Narwhal narwhal = { .lockdir = lockdir, .spin_usec = 1000, .max_spin_usec = 10000, .timeout_sec = 10 };
+
+    narwhal_hostname("host");
+    narwhal_pid("1");
+    suseconds_t next_poll_usec;
+    assert(narwhal_lock_begin(&narwhal, true, &next_poll_usec) == 1);
+    assert_errno("narwhal_lock_begin", NULL);
+
+    pid_t child = fork();
+    assert_errno("fork", NULL);
+    if (!child) {
+        narwhal_pid("2");
+        assert(narwhal_lock_begin(&narwhal, false, &next_poll_usec) == 0 && next_poll_usec > 0);
+        assert(narwhal_lock_poll(&narwhal, &next_poll_usec) == 0);
+        assert_errno("narwhal_lock_poll", NULL);
+        narwhal_lock_cancel(&narwhal);
+        assert_errno("narwhal_lock_cancel", NULL);
+        assert(count_state_lines(lockdir) == 1);  // Our request was withdrawn.
+
+        assert(narwhal_lock_begin(&narwhal, false, &next_poll_usec) == 0);
+        char ready_path[PATH_MAX];
+        snprintf(ready_path, sizeof(ready_path), "%s/ready", lockdir);
+        fclose(fopen(ready_path, "w"));
+        int result;
+        while ((result = narwhal_lock_poll(&narwhal, &next_poll_usec)) == 0)
+            usleep(next_poll_usec);
+        assert(result == 1);
+        assert_errno("narwhal_lock_poll", NULL);
+        narwhal_unlock(&narwhal);
+        assert_errno("narwhal_unlock", NULL);
+        exit(0);
+    }
+
+    while (!lockdir_has(lockdir, "ready"))
+        usleep(1000);
+    narwhal_unlock(&narwhal);
+    assert_errno("narwhal_unlock", NULL);
+    wait_child(child);
+}
+
+// Count the pending requests in the state file.
+int
+count_pending_requests(const char* lockdir) {
+    char state[4096];
+    read_state(lockdir, state, sizeof(state));
+    int count = 0;
+    for (const char* p = state; (p = strstr(p, " P ")); p++)
+        count++;
+    return count;
+}
+
+void
+test_lock_many(const char* lockdir) {
+    fprintf(stderr, "test_lock_many\n");
+    const Narwhal narwhal = { .lockdir = lockdir, .spin_usec = 1000, .max_spin_usec = 10000, .timeout_sec = 10 };
+    const NarwhalNamedLock locks[] = { { .name = "a", .is_write_lock = true }, { .name = "b" } };
+    const NarwhalNamedLock other_locks[] = { { .name = "b" }, { .name = "c", .is_write_lock = true } };
+    const NarwhalNamedLock conflicting_locks[] = { { .name = "c", .is_write_lock = true }, { .name = "a" } };
+    const NarwhalNamedLock duplicate_locks[] = { { .name = "c" }, { .name = "c" } };
+
+    narwhal_hostname("host");
+    narwhal_pid("1");
+    assert(narwhal_lock_many(&narwhal, duplicate_locks, 2) < 0 && errno == EINVAL);
+    errno = 0;
+    narwhal_lock_many(&narwhal, locks, 2);
+    assert_errno("narwhal_lock_many", NULL);
+    assert(count_state_lines(lockdir) == 2);
+
+    pid_t child = fork();
+    assert_errno("fork", NULL);
+    if (!child) {
+        narwhal_pid("2");
+        narwhal_lock_many(&narwhal, other_locks, 2);  // Does not conflict.
+        assert_errno("narwhal_lock_many", NULL);
+        narwhal_unlock(&narwhal);
+        assert_errno("narwhal_unlock", NULL);
+
+        narwhal_write_lock(&narwhal);  // The unnamed lock is independent of the named ones.
+        assert_errno("narwhal_write_lock", NULL);
+        narwhal_unlock(&narwhal);
+        assert_errno("narwhal_unlock", NULL);
+
+        narwhal_lock_many(&narwhal, conflicting_locks, 2);  // Waits for "a".
+        assert_errno("narwhal_lock_many", NULL);
+        narwhal_unlock(&narwhal);
+        assert_errno("narwhal_unlock", NULL);
+        exit(0);
+    }
+
+    while (count_pending_requests(lockdir) < 2)
+        usleep(1000);
+    assert(count_state_lines(lockdir) == 4);  // All or nothing, so "c" is pending as well.
+
+    narwhal_unlock(&narwhal);
+    assert_errno("narwhal_unlock", NULL);
+    wait_child(child);
+    assert(count_state_lines(lockdir) == 0);
+}
+
+void
+test_intent_locks(const char* lockdir) {
+    fprintf(stderr, "test_intent_locks\n");
+    const Narwhal narwhal = { .lockdir = lockdir, .spin_usec = 1000, .max_spin_usec = 10000, .timeout_sec = 10 };
+    char state[4096];
+
+    narwhal_hostname("host");
+    narwhal_pid("1");
+    const char* invalid_paths[] = { "", "/a", "a/", "a//b", "a b/c" };
+    for (size_t path_index = 0; path_index < sizeof(invalid_paths) / sizeof(*invalid_paths); path_index++) {
+        assert(narwhal_lock_path(&narwhal, invalid_paths[path_index], true) < 0 && errno == EINVAL);
+        errno = 0;
+    }
+
+    narwhal_lock_path(&narwhal, "p/a", true);
+    assert_errno("narwhal_lock_path", NULL);
+    read_state(lockdir, state, sizeof(state));
+    assert(count_state_lines(lockdir) == 2 && strstr(state, " w G ") && strstr(state, " W G "));
+
+    pid_t child = fork();
+    assert_errno("fork", NULL);
+    if (!child) {
+        narwhal_pid("2");
+        narwhal_lock_path(&narwhal, "p/b", true);  // Only the intentions to write "p" overlap.
+        assert_errno("narwhal_lock_path", NULL);
+        narwhal_unlock(&narwhal);
+        assert_errno("narwhal_unlock", NULL);
+
+        narwhal_lock_path(&narwhal, "p/b/c", false);
+        assert_errno("narwhal_lock_path", NULL);
+        narwhal_unlock(&narwhal);
+        assert_errno("narwhal_unlock", NULL);
+        exit(0);
+    }
+    wait_child(child);
+
+    child = fork();
+    assert_errno("fork", NULL);
+    if (!child) {
+        narwhal_pid("2");
+        narwhal_lock_path(&narwhal, "p", false);  // Waits for our intention to write "p".
+        assert_errno("narwhal_lock_path", NULL);
+        narwhal_unlock(&narwhal);
+        assert_errno("narwhal_unlock", NULL);
+        exit(0);
+    }
+    while (count_pending_requests(lockdir) < 1)
+        usleep(1000);
+    narwhal_unlock(&narwhal);
+    assert_errno("narwhal_unlock", NULL);
+    wait_child(child);
+    assert(count_state_lines(lockdir) == 0);
+}
+
+void
+test_max_clients(const char* lockdir) {
+    fprintf(stderr, "test_max_clients\n");
+    Narwhal narwhal
+        = { .lockdir = lockdir, .spin_usec = 1000, .max_spin_usec = 10000, .timeout_sec = 10, .max_clients = 2 };
+    NarwhalNamedLock locks[8];
+    char names[8][8];
+    for (int lock_index = 0; lock_index < 8; lock_index++) {
+        snprintf(names[lock_index], sizeof(names[0]), "lock%d", lock_index);
+        locks[lock_index].name = names[lock_index];
+        locks[lock_index].is_write_lock = false;
+        locks[lock_index].is_intent = false;
+    }
+
+    // Exceeding max_clients just grows the buffers, in either format.
+    for (int format = NARWHAL_TEXT_STATE; format <= NARWHAL_FIXED_STATE; format++) {
+        narwhal.state_format = (NarwhalStateFormat)format;
+        narwhal_pid("1");
+        narwhal_lock_many(&narwhal, locks, 8);
+        assert_errno("narwhal_lock_many", NULL);
+        pid_t child = fork();
+        assert_errno("fork", NULL);
+        if (!child) {
+            narwhal_pid("2");
+            narwhal_lock_many(&narwhal, locks, 8);
+            assert_errno("narwhal_lock_many", NULL);
+            assert(format == NARWHAL_FIXED_STATE || count_state_lines(lockdir) == 16);
+            narwhal_unlock(&narwhal);
+            assert_errno("narwhal_unlock", NULL);
+            exit(0);
+        }
+        wait_child(child);
+        narwhal_unlock(&narwhal);
+        assert_errno("narwhal_unlock", NULL);
+        assert(format == NARWHAL_FIXED_STATE || count_state_lines(lockdir) == 0);
+        narwhal_close(&narwhal);
+        assert_errno("narwhal_close", NULL);
+    }
+}
+
+void
+test_stats(const char* lockdir) {
+    fprintf(stderr, "test_stats\n");
+    const Narwhal narwhal = { .lockdir = lockdir, .spin_usec = 1000, .max_spin_usec = 10000, .timeout_sec = 10 };
+
+    narwhal_stats_reset(NULL);
+    assert_errno("narwhal_stats_reset", NULL);
+    contend(&narwhal);
+
+    NarwhalStats stats;
+    narwhal_stats(&narwhal, &stats);
+    assert_errno("narwhal_stats", NULL);
+    assert(stats.locks_acquired == 1);
+    assert(stats.link_attempts >= 2 && stats.link_attempts >= stats.link_failures);
+    assert(stats.state_bytes_written > 0 && stats.entries_parsed > 0);
+
+    unsigned long long n_latencies = 0;
+    for (int bucket = 0; bucket < NARWHAL_LATENCY_BUCKETS; bucket++)
+        n_latencies += stats.acquire_latency_histogram[bucket];
+    assert(n_latencies == stats.locks_acquired);
+
+    narwhal_close(&narwhal);
+    assert_errno("narwhal_close", NULL);
+    NarwhalStats total_stats;
+    narwhal_stats(NULL, &total_stats);
+    assert_errno("narwhal_stats", NULL);
+    assert(total_stats.locks_acquired == 1);
+
+    narwhal_stats_reset(NULL);
+    assert_errno("narwhal_stats_reset", NULL);
+    narwhal_stats(NULL, &total_stats);
+    assert_errno("narwhal_stats", NULL);
+    assert(total_stats.locks_acquired == 0);
+}
+
+void
+test_nfs_simulation(const char* lockdir) {
+    fprintf(stderr, "test_nfs_simulation\n");
+    const Narwhal narwhal = { .lockdir = lockdir, .spin_usec = 1000, .max_spin_usec = 10000, .timeout_sec = 10 };
+
+    // Every link reply is lost, so we must detect we got the lockfile anyway, rather than waiting for it forever.
+    const NarwhalSimulation simulation = {
+        .latency_usec = 100, .jitter_usec = 100, .link_retransmit_rate = 1, .seed = 1
+    };
+    narwhal_sim_start(&simulation);
+    narwhal_stats_reset(NULL);
+    assert_errno("narwhal_stats_reset", NULL);
+    contend(&narwhal);
+    narwhal_sim_stop();
+
+    NarwhalStats stats;
+    narwhal_stats(&narwhal, &stats);
+    assert_errno("narwhal_stats", NULL);
+    assert(stats.link_failures == stats.link_attempts);  // All of them reported EEXIST.
+    assert(!lockdir_has(lockdir, "lockfile"));
+    assert(count_state_lines(lockdir) == 0);
+}
+
+void
+test_fifo_queue(const char* lockdir) {
+    fprintf(stderr, "test_fifo_queue\n");
+    const Narwhal narwhal = { .lockdir = lockdir, .spin_usec = 1000, .max_spin_usec = 10000, .timeout_sec = 10 };
+
+    narwhal_pid("1");
+    narwhal_read_lock(&narwhal);
+    assert_errno("narwhal_read_lock", NULL);
+
+    pid_t writer = fork();
+    assert_errno("fork", NULL);
+    if (!writer) {
+        narwhal_pid("2");
+        narwhal_write_lock(&narwhal);
+        assert_errno("narwhal_write_lock", NULL);
+        narwhal_unlock(&narwhal);
+        assert_errno("narwhal_unlock", NULL);
+        exit(0);
+    }
+
+    while (count_pending_requests(lockdir) < 1)
+        usleep(1000);
+
+    pid_t reader = fork();
+    assert_errno("fork", NULL);
+    if (!reader) {
+        narwhal_pid("3");
+        assert(narwhal_try_read_lock(&narwhal) < 0 && errno == EBUSY);  // Queued behind the pending writer.
+        errno = 0;
+        exit(0);
+    }
+    wait_child(reader);
+    assert(count_state_lines(lockdir) == 2);
+
+    narwhal_unlock(&narwhal);
+    assert_errno("narwhal_unlock", NULL);
+    wait_child(writer);
+    assert(count_state_lines(lockdir) == 0);
+}
+
+void
+test_lock_policies(const char* lockdir) {
+    fprintf(stderr, "test_lock_policies\n");
+    Narwhal narwhal = { .lockdir = lockdir,
+                        .spin_usec = 1000,
+                        .max_spin_usec = 10000,
+                        .timeout_sec = 10,
+                        .policy = NARWHAL_READER_POLICY };
+
+    // Using the reader policy, a new reader is not queued behind a pending writer.
+    narwhal_pid("1");
+    narwhal_read_lock(&narwhal);
+    assert_errno("narwhal_read_lock", NULL);
+    pid_t writer = fork();
+    assert_errno("fork", NULL);
+    if (!writer) {
+        narwhal_pid("2");
+        narwhal_write_lock(&narwhal);
+        assert_errno("narwhal_write_lock", NULL);
+        narwhal_unlock(&narwhal);
+        assert_errno("narwhal_unlock", NULL);
+        exit(0);
+    }
+    while (count_pending_requests(lockdir) < 1)
+        usleep(1000);
+    pid_t reader = fork();
+    assert_errno("fork", NULL);
+    if (!reader) {
+        narwhal_pid("3");
+        narwhal_try_read_lock(&narwhal);
+        assert_errno("narwhal_try_read_lock", NULL);
+        narwhal_unlock(&narwhal);
+        assert_errno("narwhal_unlock", NULL);
+        exit(0);
+    }
+    wait_child(reader);
+    narwhal_unlock(&narwhal);
+    assert_errno("narwhal_unlock", NULL);
+    wait_child(writer);
+
+    // Using the writer policy, a later writer is granted before an earlier reader.
+    narwhal.policy = NARWHAL_WRITER_POLICY;
+    narwhal_write_lock(&narwhal);
+    assert_errno("narwhal_write_lock", NULL);
+    reader = fork();
+    assert_errno("fork", NULL);
+    if (!reader) {
+        narwhal_pid("2");
+        narwhal_read_lock(&narwhal);
+        assert_errno("narwhal_read_lock", NULL);
+        assert(lockdir_has(lockdir, "writer.tmp"));
+        narwhal_unlock(&narwhal);
+        assert_errno("narwhal_unlock", NULL);
+        exit(0);
+    }
+    while (count_pending_requests(lockdir) < 1)
+        usleep(1000);
+    writer = fork();
+    assert_errno("fork", NULL);
+    if (!writer) {
+        narwhal_pid("3");
+        narwhal_write_lock(&narwhal);
+        assert_errno("narwhal_write_lock", NULL);
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/writer.tmp", lockdir);
+        close(open(path, O_CREAT | O_WRONLY, 0777));
+        assert_errno("open(", path, ")", NULL);
+        narwhal_unlock(&narwhal);
+        assert_errno("narwhal_unlock", NULL);
+        exit(0);
+    }
+    while (count_pending_requests(lockdir) < 2)
+        usleep(1000);
+    narwhal_unlock(&narwhal);
+    assert_errno("narwhal_unlock", NULL);
+    wait_child(writer);
+    wait_child(reader);
+    assert(count_state_lines(lockdir) == 0);
+}
+
+void
+test_upgrade_downgrade(const char* lockdir) {
+    fprintf(stderr, "test_upgrade_downgrade\n");
+    const Narwhal narwhal = { .lockdir = lockdir, .spin_usec = 1000, .max_spin_usec = 10000, .timeout_sec = 10 };
+
+    narwhal_hostname("host");
+    narwhal_pid("1");
+    narwhal_read_lock(&narwhal);
+    assert_errno("narwhal_read_lock", NULL);
+    assert(narwhal_downgrade(&narwhal) < 0 && errno == ENOTSUP);
+    errno = 0;
+
+    pid_t upgrader = fork();
+    assert_errno("fork", NULL);
+    if (!upgrader) {
+        narwhal_pid("2");
+        narwhal_read_lock(&narwhal);
+        assert_errno("narwhal_read_lock", NULL);
+        narwhal_upgrade(&narwhal);
+        assert_errno("narwhal_upgrade", NULL);
+        char state[4096];
+        read_state(lockdir, state, sizeof(state));
+        assert(count_state_lines(lockdir) == 1 && !strncmp(state, "host 2 W G ", 11));
+        narwhal_unlock(&narwhal);
+        assert_errno("narwhal_unlock", NULL);
+        exit(0);
+    }
+
+    char state[4096];
+    do {
+        usleep(1000);
+        read_state(lockdir, state, sizeof(state));
+    } while (!strstr(state, "host 2 W U "));
+
+    assert(narwhal_upgrade(&narwhal) < 0 && errno == EDEADLK);  // Only one upgrader at a time.
+    errno = 0;
+    read_state(lockdir, state, sizeof(state));
+    assert(!strncmp(state, "host 1 R G ", 11));  // We still have our read lock.
+
+    pid_t reader = fork();
+    assert_errno("fork", NULL);
+    if (!reader) {
+        narwhal_pid("3");
+        assert(narwhal_try_read_lock(&narwhal) < 0 && errno == EBUSY);  // Queued behind the upgrader.
+        errno = 0;
+        exit(0);
+    }
+    wait_child(reader);
+
+    narwhal_unlock(&narwhal);
+    assert_errno("narwhal_unlock", NULL);
+    wait_child(upgrader);
+    assert(count_state_lines(lockdir) == 0);
+
+    narwhal_write_lock(&narwhal);
+    assert_errno("narwhal_write_lock", NULL);
+    reader = fork();
+    assert_errno("fork", NULL);
+    if (!reader) {
+        narwhal_pid("4");
+        narwhal_read_lock(&narwhal);
+        assert_errno("narwhal_read_lock", NULL);
+        narwhal_unlock(&narwhal);
+        assert_errno("narwhal_unlock", NULL);
+        exit(0);
+    }
+    while (count_pending_requests(lockdir) < 1)
+        usleep(1000);
+
+    narwhal_downgrade(&narwhal);
+    assert_errno("narwhal_downgrade", NULL);
+    wait_child(reader);  // Granted while we still have the (read) lock.
+    read_state(lockdir, state, sizeof(state));
+    assert(count_state_lines(lockdir) == 1 && !strncmp(skip_write_generation(state), "host 1 R G ", 11));
+
+    narwhal_upgrade(&narwhal);  // No other readers, so this is immediate.
+    assert_errno("narwhal_upgrade", NULL);
+    read_state(lockdir, state, sizeof(state));
+    assert(!strncmp(skip_write_generation(state), "host 1 W G ", 11));
+    narwhal_unlock(&narwhal);
+    assert_errno("narwhal_unlock", NULL);
+    assert(count_state_lines(lockdir) == 0);
+}
+
+void
+test_upgrade_pending_reader(const char* lockdir) {
+    fprintf(stderr, "test_upgrade_pending_reader\n");
+    const Narwhal narwhal = { .lockdir = lockdir, .spin_usec = 1000, .max_spin_usec = 10000, .timeout_sec = 10 };
+
+    // A reader queued behind our write lock, which polls so slowly it is still pending when we get a read lock (with a
+    // later ticket) and upgrade it. It must wait for our upgrade, and our upgrade must not wait for it.
+    narwhal_hostname("host");
+    narwhal_pid("1");
+    narwhal_write_lock(&narwhal);
+    assert_errno("narwhal_write_lock", NULL);
+    pid_t reader = fork();
+    assert_errno("fork", NULL);
+    if (!reader) {
+        const Narwhal slow_narwhal
+            = { .lockdir = lockdir, .spin_usec = 2000000, .max_spin_usec = 2000000, .timeout_sec = 10 };
+        narwhal_pid("2");
+        narwhal_read_lock(&slow_narwhal);
+        assert_errno("narwhal_read_lock", NULL);
+        assert(lockdir_has(lockdir, "writer.tmp"));
+        narwhal_unlock(&slow_narwhal);
+        assert_errno("narwhal_unlock", NULL);
+        exit(0);
+    }
+    while (count_pending_requests(lockdir) < 1)
+        usleep(1000);
+
+    narwhal_unlock(&narwhal);
+    assert_errno("narwhal_unlock", NULL);
+    narwhal_read_lock(&narwhal);
+    assert_errno("narwhal_read_lock", NULL);
+    assert(count_pending_requests(lockdir) == 1);
+    narwhal_upgrade(&narwhal);
+    assert_errno("narwhal_upgrade", NULL);
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/writer.tmp", lockdir);
+    close(open(path, O_CREAT | O_WRONLY, 0777));
+    assert_errno("open(", path, ")", NULL);
+    narwhal_unlock(&narwhal);
+    assert_errno("narwhal_unlock", NULL);
+    wait_child(reader);
+    assert(count_state_lines(lockdir) == 0);
+}
+
+void
+test_relock_async(const char* lockdir) {
+    fprintf(stderr, "test_relock_async\n");
+    const Narwhal narwhal = { .lockdir = lockdir, .spin_usec = 1000, .max_spin_usec = 10000, .timeout_sec = 10 };
+    char state[4096];
+
+    narwhal_hostname("host");
+    narwhal_pid("1");
+    assert(narwhal_relock(&narwhal, true) < 0 && errno == ENOTSUP);
+    errno = 0;
+    assert(narwhal_unlock_async(&narwhal) < 0 && errno == ENOTSUP);
+    errno = 0;
+
+    // Switching from a write lock to a read lock replaces our request.
+    narwhal_write_lock(&narwhal);
+    assert_errno("narwhal_write_lock", NULL);
+    narwhal_relock(&narwhal, false);
+    assert_errno("narwhal_relock", NULL);
+    read_state(lockdir, state, sizeof(state));
+    assert(count_state_lines(lockdir) == 1 && !strncmp(skip_write_generation(state), "host 1 R G ", 11));
+
+    // Unlike narwhal_upgrade, the new request is queued behind a pending writer.
+    pid_t writer = fork();
+    assert_errno("fork", NULL);
+    if (!writer) {
+        narwhal_pid("2");
+        narwhal_write_lock(&narwhal);
+        assert_errno("narwhal_write_lock", NULL);
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/writer.tmp", lockdir);
+        close(open(path, O_CREAT | O_WRONLY, 0777));
+        assert_errno("open(", path, ")", NULL);
+        narwhal_unlock(&narwhal);
+        assert_errno("narwhal_unlock", NULL);
+        exit(0);
+    }
+    while (count_pending_requests(lockdir) < 1)
+        usleep(1000);
+    narwhal_relock(&narwhal, true);
+    assert_errno("narwhal_relock", NULL);
+    assert(lockdir_has(lockdir, "writer.tmp"));
+    wait_child(writer);
+    read_state(lockdir, state, sizeof(state));
+    assert(count_state_lines(lockdir) == 1 && !strncmp(skip_write_generation(state), "host 1 W G ", 11));
+
+    // The heartbeat thread releases the lock in the background, right away (well before heartbeat_retry_interval, which
+    // is timeout_sec / 12), both when it is started and when it is already waiting. This is repeated since a delay
+    // depends on how the threads are scheduled.
+    for (int round = 0; round < 20; round++) {
+        if (round > 0) {
+            narwhal_write_lock(&narwhal);
+            assert_errno("narwhal_write_lock", NULL);
+        }
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        narwhal_unlock_async(&narwhal);
+        assert_errno("narwhal_unlock_async", NULL);
+        while (count_state_lines(lockdir) > 0)
+            usleep(1000);
+        assert(seconds_since(&start) < 0.2);
+    }
+    narwhal_flush(&narwhal);
+    assert_errno("narwhal_flush", NULL);
+
+    // The next operation completes a pending unlock first.
+    narwhal_read_lock(&narwhal);
+    assert_errno("narwhal_read_lock", NULL);
+    narwhal_unlock_async(&narwhal);
+    assert_errno("narwhal_unlock_async", NULL);
+    narwhal_try_write_lock(&narwhal);
+    assert_errno("narwhal_try_write_lock", NULL);
+    read_state(lockdir, state, sizeof(state));
+    assert(count_state_lines(lockdir) == 1 && !strncmp(skip_write_generation(state), "host 1 W G ", 11));
+    narwhal_unlock_async(&narwhal);
+    assert_errno("narwhal_unlock_async", NULL);
+    narwhal_flush(&narwhal);
+    assert_errno("narwhal_flush", NULL);
+    assert(count_state_lines(lockdir) == 0);
+}
+
+void
+test_wakeup(const char* lockdir) {
+    fprintf(stderr, "test_wakeup\n");
+    // Waiters poll only every 2 seconds, so a fast handoff means they were woken.
+    const Narwhal narwhal = { .lockdir = lockdir, .spin_usec = 2000000, .timeout_sec = 20, .wakeup = true };
+
+    narwhal_hostname("host");
+    narwhal_pid("1");
+    narwhal_stats_reset(NULL);
+    assert_errno("narwhal_stats_reset", NULL);
+    narwhal_write_lock(&narwhal);
+    assert_errno("narwhal_write_lock", NULL);
+
+    pid_t child = fork();
+    assert_errno("fork", NULL);
+    if (!child) {
+        narwhal_pid("2");
+        narwhal_read_lock(&narwhal);
+        assert_errno("narwhal_read_lock", NULL);
+        NarwhalStats stats;
+        narwhal_stats(&narwhal, &stats);
+        assert_errno("narwhal_stats", NULL);
+        assert(stats.wakeups_received >= 1);
+        narwhal_unlock(&narwhal);
+        assert_errno("narwhal_unlock", NULL);
+        exit(0);
+    }
+    while (count_pending_requests(lockdir) < 1 || !lockdir_has(lockdir, "host.2.wake"))
+        usleep(1000);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    narwhal_unlock(&narwhal);
+    assert_errno("narwhal_unlock", NULL);
+    wait_child(child);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    assert(end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9 < 1);
+
+    NarwhalStats stats;
+    narwhal_stats(&narwhal, &stats);
+    assert_errno("narwhal_stats", NULL);
+    assert(stats.wakeups_sent == 1);
+    assert(!lockdir_has(lockdir, "host.2.wake"));  // Removed when the child closed the lockdir.
+}
+
+// Repeatedly increment a counter in a file under a write lock, slowly, so any overlap would lose updates.
+void
+increment_counter(const Narwhal* narwhal, const char* path, int n_increments) {
+    for (int increment = 0; increment < n_increments; increment++) {
+        narwhal_write_lock(narwhal);
+        assert_errno("narwhal_write_lock", NULL);
+
+        int counter = 0;
+        FILE* counter_fp = fopen(path, "r");
+        if (counter_fp) {
+            assert(fscanf(counter_fp, "%d", &counter) == 1);
+            fclose(counter_fp);
+        }
+        errno = 0;
+        usleep(100);
+        counter_fp = fopen(path, "w");
+        assert_errno("fopen(", path, ")", NULL);
+        fprintf(counter_fp, "%d\n", counter + 1);
+        fclose(counter_fp);
+
+        narwhal_unlock(narwhal);
+        assert_errno("narwhal_unlock", NULL);
+    }
+}
+
+void
+test_slot_protocol(const char* lockdir) {
+    fprintf(stderr, "test_slot_protocol\n");
+    const Narwhal narwhal = { .lockdir = lockdir,
+                              .spin_usec = 100,
+                              .max_spin_usec = 10000,
+                              .spin_jitter = 0.5,
+                              .timeout_sec = 10,
+                              .protocol = NARWHAL_SLOT_PROTOCOL };
+
+    narwhal_hostname("host");
+    narwhal_pid("1");
+    narwhal_write_lock(&narwhal);
+    assert_errno("narwhal_write_lock", NULL);
+    assert(!lockdir_has(lockdir, "state") && !lockdir_has(lockdir, "lockfile"));
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/host.1", lockdir);
+    FILE* slot_fp = fopen(path, "r");
+    assert_errno("fopen(", path, ")", NULL);
+    char line[1024];
+    assert(fgets(line, sizeof(line), slot_fp));
+    assert(!strncmp(line, "host 1 W G ", 11));
+    fclose(slot_fp);
+
+    narwhal_unlock(&narwhal);
+    assert_errno("narwhal_unlock", NULL);
+    contend(&narwhal);
+
+    snprintf(path, sizeof(path), "%s/counter.tmp", lockdir);
+    pid_t children[4];
+    for (int index = 0; index < 4; index++) {
+        children[index] = fork();
+        assert_errno("fork", NULL);
+        if (!children[index]) {
+            char child_pid[32];
+            snprintf(child_pid, sizeof(child_pid), "%d", index + 10);
+            narwhal_pid(child_pid);
+            increment_counter(&narwhal, path, 25);
+            exit(0);
+        }
+    }
+    for (int index = 0; index < 4; index++)
+        wait_child(children[index]);
+
+    FILE* counter_fp = fopen(path, "r");
+    assert_errno("fopen(", path, ")", NULL);
+    int counter = 0;
+    assert(fscanf(counter_fp, "%d", &counter) == 1 && counter == 100);
+    fclose(counter_fp);
+}
+
+void
+test_stale_slot_file(const char* lockdir) {
+    fprintf(stderr, "test_stale_slot_file\n");
+    const Narwhal narwhal = { .lockdir = lockdir,
+                              .spin_usec = 1000,
+                              .max_spin_usec = 10000,
+                              .timeout_msec = 300,
+                              .protocol = NARWHAL_SLOT_PROTOCOL };
+
+    narwhal_hostname("host");
+    pid_t child = fork();
+    assert_errno("fork", NULL);
+    if (!child) {
+        narwhal_pid("2");
+        narwhal_write_lock(&narwhal);
+        assert_errno("narwhal_write_lock", NULL);
+        _exit(0);  // Crash while holding the lock.
+    }
+    wait_child(child);
+    assert(lockdir_has(lockdir, "host.2"));
+
+    narwhal_pid("1");
+    narwhal_read_lock(&narwhal);
+    assert_errno("narwhal_read_lock", NULL);
+    assert(!lockdir_has(lockdir, "host.2"));  // Removed once its request was stale.
+    assert(lockdir_has(lockdir, "host.1"));
+
+    narwhal_unlock(&narwhal);
+    assert_errno("narwhal_unlock", NULL);
+    narwhal_close(&narwhal);
+    assert_errno("narwhal_close", NULL);
+}
+
+void
+test_local_backends(const char* lockdir) {
+    fprintf(stderr, "test_local_backends\n");
+    const NarwhalBackend backends[] = { NARWHAL_FCNTL_BACKEND, NARWHAL_SHM_BACKEND };
+    for (int backend_index = 0; backend_index < 2; backend_index++) {
+        const Narwhal narwhal = { .lockdir = lockdir,
+                                  .spin_usec = 100,
+                                  .max_spin_usec = 1000,
+                                  .timeout_sec = 10,
+                                  .backend = backends[backend_index] };
+
+        narwhal_hostname("host");
+        contend(&narwhal);
+        assert(!lockdir_has(lockdir, "state") && !lockdir_has(lockdir, "lockfile"));
+
+        narwhal_read_lock(&narwhal);
+        assert_errno("narwhal_read_lock", NULL);
+        assert(narwhal_upgrade(&narwhal) < 0 && errno == ENOTSUP);
+        errno = 0;
+
+        // Another path to the same lockdir would share our fcntl lock.
+        char alias[PATH_MAX];
+        snprintf(alias, sizeof(alias), "%s/.", lockdir);
+        const Narwhal alias_narwhal = { .lockdir = alias, .backend = narwhal.backend };
+        assert(narwhal_try_read_lock(&alias_narwhal) < 0 && errno == EEXIST);
+        errno = 0;
+        if (narwhal.backend == NARWHAL_SHM_BACKEND) {
+            assert(narwhal_shared_read_lock(&narwhal) < 0 && errno == ENOTSUP);
+            errno = 0;
+        }
+        pid_t child = fork();
+        assert_errno("fork", NULL);
+        if (!child) {
+            narwhal_pid("2");
+            narwhal_try_read_lock(&narwhal);
+            assert_errno("narwhal_try_read_lock", NULL);
+            narwhal_unlock(&narwhal);
+            assert_errno("narwhal_unlock", NULL);
+            assert(narwhal_try_write_lock(&narwhal) < 0 && errno == EBUSY);
+            errno = 0;
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += 50000000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            assert(narwhal_write_lock_until(&narwhal, &deadline) < 0 && errno == ETIMEDOUT);
+            exit(0);
+        }
+        wait_child(child);
+        narwhal_unlock(&narwhal);
+        assert_errno("narwhal_unlock", NULL);
+
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/counter.tmp", lockdir);
+        pid_t children[4];
+        for (int index = 0; index < 4; index++) {
+            children[index] = fork();
+            assert_errno("fork", NULL);
+            if (!children[index]) {
+                char child_pid[32];
+                snprintf(child_pid, sizeof(child_pid), "%d", index + 10);
+                narwhal_pid(child_pid);
+                increment_counter(&narwhal, path, 25);
+                exit(0);
+            }
+        }
+        for (int index = 0; index < 4; index++)
+            wait_child(children[index]);
+
+        FILE* counter_fp = fopen(path, "r");
+        assert_errno("fopen(", path, ")", NULL);
+        int counter = 0;
+        assert(fscanf(counter_fp, "%d", &counter) == 1 && counter == 100);
+        fclose(counter_fp);
+        unlink(path);
+        assert_errno("unlink(", path, ")", NULL);
+
+        narwhal_close(&narwhal);  // The backend is chosen when opening the lockdir.
+        assert_errno("narwhal_close", NULL);
+        narwhal_pid("1");
+    }
+}
+
+// Wait until the state file of the lockdir has some number of lines.
+void
+wait_state_lines(const char* lockdir, int n_lines) {
+    while (count_state_lines(lockdir) != n_lines)
+        usleep(1000);
+}
+
+void
+test_coordinator(const char* lockdir) {
+    fprintf(stderr, "test_coordinator\n");
+    char socket_path[PATH_MAX];
+    snprintf(socket_path, sizeof(socket_path), "%s/coordinator", lockdir);
+
+    narwhal_hostname("host");
+    pid_t daemon = fork();
+    assert_errno("fork", NULL);
+    if (!daemon) {
+        narwhal_pid("9");
+        const Narwhal narwhal = { .spin_usec = 1000, .timeout_sec = 10, .heartbeat = true };
+        narwhal_coordinate(&narwhal, socket_path);
+        assert_errno("narwhal_coordinate", NULL);
+        exit(1);
+    }
+    while (!lockdir_has(lockdir, "coordinator"))
+        usleep(1000);
+
+    const Narwhal narwhal = { .lockdir = lockdir, .coordinator = socket_path };
+    narwhal_pid("1");
+    narwhal_read_lock(&narwhal);
+    assert_errno("narwhal_read_lock", NULL);
+    assert(!lockdir_has(lockdir, "host.1"));  // Only the daemon accesses the lockdir.
+
+    pid_t child = fork();
+    assert_errno("fork", NULL);
+    if (!child) {
+        narwhal_pid("2");
+        narwhal_read_lock(&narwhal);
+        assert_errno("narwhal_read_lock", NULL);
+        _exit(0);  // Crash while holding the lock.
+    }
+    wait_child(child);
+
+    char state[4096];
+    read_state(lockdir, state, sizeof(state));
+    assert(count_state_lines(lockdir) == 1 && !strncmp(state, "host 9 R G ", 11));  // Shared by both clients.
+    assert(narwhal_try_read_lock(&narwhal) < 0 && errno == ENOTSUP);
+    errno = 0;
+
+    narwhal_unlock(&narwhal);
+    assert_errno("narwhal_unlock", NULL);
+    wait_state_lines(lockdir, 0);  // Once the daemon notices the crashed client.
+
+    narwhal_write_lock(&narwhal);
+    assert_errno("narwhal_write_lock", NULL);
+    read_state(lockdir, state, sizeof(state));
+    assert(!strncmp(state, "host 9 W G ", 11));
+    narwhal_unlock(&narwhal);
+    assert_errno("narwhal_unlock", NULL);
+    assert(count_state_lines(lockdir) == 0);
+    narwhal_close(&narwhal);
+    assert_errno("narwhal_close", NULL);
+
+    kill(daemon, SIGKILL);
+    waitpid(daemon, NULL, 0);
+    assert_errno("waitpid", NULL);
+}
+
+// The number of tracing events of each type, and the last one about the request of some other client.
+static int n_trace_events[NARWHAL_TRACE_LOCKFILE_BROKEN + 1];
+static char traced_pid[32];
+static bool is_traced_write_lock;
+
+void
+count_trace_event(const NarwhalTraceEvent* event, void* context) {
+    assert(context == n_trace_events);
+    n_trace_events[event->type]++;
+    if (event->pid && strcmp(event->pid, "2")) {
+        snprintf(traced_pid, sizeof(traced_pid), "%s", event->pid);
+        is_traced_write_lock = event->is_write_lock;
+    }
+}
+
+void
+test_tracing(const char* lockdir) {
+    fprintf(stderr, "test_tracing\n");
+    const Narwhal narwhal = { .lockdir = lockdir, .spin_usec = 1000, .max_spin_usec = 100000, .timeout_sec = 1 };
+
+    pid_t child = fork();
+    assert_errno("fork", NULL);
+    if (!child) {
+        narwhal_pid("1");
+        narwhal_write_lock(&narwhal);
+        assert_errno("narwhal_write_lock", NULL);
+        _exit(0);  // Crash while holding the lock.
+    }
+    wait_child(child);
+
+    narwhal_trace(count_trace_event, n_trace_events);
+    narwhal_pid("2");
+    narwhal_read_lock(&narwhal);
+    assert_errno("narwhal_read_lock", NULL);
+    narwhal_unlock(&narwhal);
+    assert_errno("narwhal_unlock", NULL);
+    narwhal_trace(NULL, NULL);
+
+    assert(n_trace_events[NARWHAL_TRACE_REQUESTED] == 1);
+    assert(n_trace_events[NARWHAL_TRACE_GRANTED] == 1);
+    assert(n_trace_events[NARWHAL_TRACE_RELEASED] == 1);
+    assert(n_trace_events[NARWHAL_TRACE_STALE_EVICTED] == 1);
+    assert(!strcmp(traced_pid, "1") && is_traced_write_lock);
+}
+
 void
 run_test(void (*function)(const char*)) {
     char template[] = "tmp.XXXXXX";
@@ -106,6 +1926,39 @@ main(int argc, char* argv[]) {
     if (argc == 2 && !strcmp(argv[1], "run")) {
         run_test(test_read_lock);
         run_test(test_write_lock);
+        run_test(test_backoff);
+        run_test(test_private_file);
+        run_test(test_stale_lock);
+        run_test(test_msec_timeout);
+        run_test(test_abandoned_lockfile);
+        run_test(test_relinked_lockfile);
+        run_test(test_state_file);
+        run_test(test_fixed_state);
+        run_test(test_write_generation);
+        run_test(test_payload);
+        run_test(test_many_lockdirs);
+        run_test(test_shared_locks);
+        run_test(test_shared_readers_stream);
+        run_test(test_read_lease);
+        run_test(test_heartbeat);
+        run_test(test_try_lock);
+        run_test(test_async_lock);
+        run_test(test_lock_many);
+        run_test(test_intent_locks);
+        run_test(test_max_clients);
+        run_test(test_stats);
+        run_test(test_nfs_simulation);
+        run_test(test_tracing);
+        run_test(test_fifo_queue);
+        run_test(test_lock_policies);
+        run_test(test_upgrade_downgrade);
+        run_test(test_upgrade_pending_reader);
+        run_test(test_relock_async);
+        run_test(test_wakeup);
+        run_test(test_slot_protocol);
+        run_test(test_stale_slot_file);
+        run_test(test_local_backends);
+        run_test(test_coordinator);
         return 0;
     }
 